@@ -0,0 +1,646 @@
+/**
+ * 原始帧的黑电平/渐晕/辐射校正, 公式见calcorrect.h
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CALCORRECT_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CALCORRECT_SSE2
+#endif
+
+#include "calcorrect.h"
+#include "calib_le.h"
+
+/* 每个任务处理的行数 */
+#define TILE_ROWS   32
+
+/**
+ * 增益图缓存文件, 本机字节序, 只在本机使用. 第一页是头,
+ * 之后每个波段width * height个Q15增益, 按页对齐
+ */
+#define GAIN_MAGIC      0x504d4743  /* "CGMP" */
+#define GAIN_VERSION    1
+#define GAIN_Q15        32767.0f
+
+struct gain_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    crc;            /* 标定记录的CRC */
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    nbands;
+    struct {
+        uint32_t    band;
+        float       unit;       /* 增益 = Q15值 * unit */
+        uint32_t    offset;     /* 增益图在文件中的偏移 */
+        uint32_t    reserved;
+    } band[CALIB_MAX_BANDS];
+};
+
+struct calcorrect_pool {
+    pthread_mutex_t         lock;
+    pthread_cond_t          start;
+    pthread_cond_t          done;
+    pthread_t              *threads;
+    unsigned int            nthreads;   /* 不含调用者线程 */
+    unsigned int            gen;        /* 每帧加1, 唤醒工作线程 */
+    unsigned int            active;     /* 本帧还没做完的工作线程 */
+    int                     quit;
+
+    struct calcorrect      *cc;
+    const uint16_t *const  *raw;
+    float *const           *out;
+    unsigned int            tiles_per_band;
+    unsigned int            ntiles;
+    unsigned int            next_tile;
+};
+
+#ifdef CALCORRECT_NEON
+static inline float32x4_t neon_sqrt(float32x4_t x)
+{
+#ifdef __aarch64__
+    return vsqrtq_f32(x);
+#else
+    /* armv7没有vsqrtq, 用倒数平方根估计加两次牛顿迭代 */
+    float32x4_t y = vmaxq_f32(x, vdupq_n_f32(1e-12f));
+    float32x4_t e = vrsqrteq_f32(y);
+
+    e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(y, e), e));
+    e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(y, e), e));
+    return vmulq_f32(x, e);
+#endif
+}
+#endif
+
+/* 有增益图时每个像素只乘一次增益 */
+static void rows_gain(const struct calcorrect *cc,
+        const struct calcorrect_band *b, const uint16_t *raw, float *out,
+        unsigned int y0, unsigned int y1)
+{
+    size_t i = (size_t)y0 * cc->width;
+    size_t n = (size_t)y1 * cc->width;
+    float unit = b->gain_unit * b->scale;
+    float v;
+
+#if defined(CALCORRECT_NEON)
+    {
+        float32x4_t vblack = vdupq_n_f32(b->black);
+        float32x4_t vzero = vdupq_n_f32(0);
+        float32x4_t vunit = vdupq_n_f32(unit);
+
+        for (; i + 8 <= n; i += 8) {
+            uint16x8_t r16 = vld1q_u16(raw + i);
+            uint16x8_t g16 = vld1q_u16(b->gain + i);
+            float32x4_t v0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(r16)));
+            float32x4_t v1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(r16)));
+            float32x4_t g0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(g16)));
+            float32x4_t g1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(g16)));
+
+            v0 = vmulq_f32(vmaxq_f32(vsubq_f32(v0, vblack), vzero), vunit);
+            v1 = vmulq_f32(vmaxq_f32(vsubq_f32(v1, vblack), vzero), vunit);
+            vst1q_f32(out + i, vmulq_f32(v0, g0));
+            vst1q_f32(out + i + 4, vmulq_f32(v1, g1));
+        }
+    }
+#elif defined(CALCORRECT_SSE2)
+    {
+        __m128 vblack = _mm_set1_ps(b->black);
+        __m128 vzero = _mm_setzero_ps();
+        __m128 vunit = _mm_set1_ps(unit);
+        __m128i zero = _mm_setzero_si128();
+
+        for (; i + 8 <= n; i += 8) {
+            __m128i r16 = _mm_loadu_si128((const __m128i *)(raw + i));
+            __m128i g16 = _mm_loadu_si128((const __m128i *)(b->gain + i));
+            __m128 v0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(r16, zero));
+            __m128 v1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(r16, zero));
+            __m128 g0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(g16, zero));
+            __m128 g1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(g16, zero));
+
+            v0 = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(v0, vblack), vzero), vunit);
+            v1 = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(v1, vblack), vzero), vunit);
+            _mm_storeu_ps(out + i, _mm_mul_ps(v0, g0));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(v1, g1));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        v = raw[i] - b->black;
+        if (v < 0)
+            v = 0;
+        out[i] = v * unit * b->gain[i];
+    }
+}
+
+void calcorrect_rows(const struct calcorrect *cc, unsigned int band,
+        const uint16_t *raw, float *out, unsigned int y0, unsigned int y1)
+{
+    const struct calcorrect_band *b = &cc->band[band];
+    unsigned int width = cc->width;
+    /* scale乘进多项式系数 */
+    float p0 = b->poly[0] * b->scale;
+    float p1 = b->poly[1] * b->scale;
+    float p2 = b->poly[2] * b->scale;
+    float p3 = b->poly[3] * b->scale;
+    const float *dx2 = b->dx2;
+    const uint16_t *in;
+    float *o;
+    float dy2, v, r;
+    unsigned int x, y;
+
+    if (b->gain) {
+        rows_gain(cc, b, raw, out, y0, y1);
+        return;
+    }
+
+    for (y = y0; y < y1; y++) {
+        in = raw + (size_t)y * width;
+        o = out + (size_t)y * width;
+        dy2 = b->dy2[y];
+        x = 0;
+
+#if defined(CALCORRECT_NEON)
+        {
+            float32x4_t vblack = vdupq_n_f32(b->black);
+            float32x4_t vzero = vdupq_n_f32(0);
+            float32x4_t vdy2 = vdupq_n_f32(dy2);
+            float32x4_t vp0 = vdupq_n_f32(p0);
+            float32x4_t vp1 = vdupq_n_f32(p1);
+            float32x4_t vp2 = vdupq_n_f32(p2);
+            float32x4_t vp3 = vdupq_n_f32(p3);
+
+            for (; x + 8 <= width; x += 8) {
+                uint16x8_t r16 = vld1q_u16(in + x);
+                float32x4_t v0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(r16)));
+                float32x4_t v1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(r16)));
+                float32x4_t r0 = neon_sqrt(vaddq_f32(vld1q_f32(dx2 + x), vdy2));
+                float32x4_t r1 = neon_sqrt(vaddq_f32(vld1q_f32(dx2 + x + 4),
+                    vdy2));
+                float32x4_t g0, g1;
+
+                v0 = vmaxq_f32(vsubq_f32(v0, vblack), vzero);
+                v1 = vmaxq_f32(vsubq_f32(v1, vblack), vzero);
+                g0 = vmlaq_f32(vp2, vp3, r0);
+                g1 = vmlaq_f32(vp2, vp3, r1);
+                g0 = vmlaq_f32(vp1, g0, r0);
+                g1 = vmlaq_f32(vp1, g1, r1);
+                g0 = vmlaq_f32(vp0, g0, r0);
+                g1 = vmlaq_f32(vp0, g1, r1);
+                vst1q_f32(o + x, vmulq_f32(v0, g0));
+                vst1q_f32(o + x + 4, vmulq_f32(v1, g1));
+            }
+        }
+#elif defined(CALCORRECT_SSE2)
+        {
+            __m128 vblack = _mm_set1_ps(b->black);
+            __m128 vzero = _mm_setzero_ps();
+            __m128 vdy2 = _mm_set1_ps(dy2);
+            __m128 vp0 = _mm_set1_ps(p0);
+            __m128 vp1 = _mm_set1_ps(p1);
+            __m128 vp2 = _mm_set1_ps(p2);
+            __m128 vp3 = _mm_set1_ps(p3);
+            __m128i zero = _mm_setzero_si128();
+
+            for (; x + 8 <= width; x += 8) {
+                __m128i r16 = _mm_loadu_si128((const __m128i *)(in + x));
+                __m128 v0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(r16, zero));
+                __m128 v1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(r16, zero));
+                __m128 r0 = _mm_sqrt_ps(_mm_add_ps(_mm_loadu_ps(dx2 + x), vdy2));
+                __m128 r1 = _mm_sqrt_ps(_mm_add_ps(_mm_loadu_ps(dx2 + x + 4),
+                    vdy2));
+                __m128 g0, g1;
+
+                v0 = _mm_max_ps(_mm_sub_ps(v0, vblack), vzero);
+                v1 = _mm_max_ps(_mm_sub_ps(v1, vblack), vzero);
+                g0 = _mm_add_ps(_mm_mul_ps(vp3, r0), vp2);
+                g1 = _mm_add_ps(_mm_mul_ps(vp3, r1), vp2);
+                g0 = _mm_add_ps(_mm_mul_ps(g0, r0), vp1);
+                g1 = _mm_add_ps(_mm_mul_ps(g1, r1), vp1);
+                g0 = _mm_add_ps(_mm_mul_ps(g0, r0), vp0);
+                g1 = _mm_add_ps(_mm_mul_ps(g1, r1), vp0);
+                _mm_storeu_ps(o + x, _mm_mul_ps(v0, g0));
+                _mm_storeu_ps(o + x + 4, _mm_mul_ps(v1, g1));
+            }
+        }
+#endif
+
+        for (; x < width; x++) {
+            v = in[x] - b->black;
+            if (v < 0)
+                v = 0;
+            r = sqrtf(dx2[x] + dy2);
+            o[x] = v * (((p3 * r + p2) * r + p1) * r + p0);
+        }
+    }
+}
+
+/* 从共享的任务计数器取行块, 直到取完 */
+static void run_tiles(struct calcorrect_pool *p)
+{
+    struct calcorrect *cc = p->cc;
+    unsigned int t, band, y0, y1;
+
+    while ((t = __atomic_fetch_add(&p->next_tile, 1, __ATOMIC_RELAXED)) <
+           p->ntiles) {
+        band = t / p->tiles_per_band;
+        y0 = (t % p->tiles_per_band) * TILE_ROWS;
+        y1 = y0 + TILE_ROWS;
+        if (y1 > cc->height)
+            y1 = cc->height;
+        calcorrect_rows(cc, band, p->raw[band], p->out[band], y0, y1);
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct calcorrect_pool *p = arg;
+    unsigned int gen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (gen == p->gen && !p->quit)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->quit)
+            break;
+        gen = p->gen;
+        pthread_mutex_unlock(&p->lock);
+
+        run_tiles(p);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->active == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void pool_free(struct calcorrect_pool *p, unsigned int started)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p);
+}
+
+static int pool_create(struct calcorrect *cc, unsigned int nthreads)
+{
+    struct calcorrect_pool *p;
+    unsigned int i;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return -ENOMEM;
+    p->threads = calloc(nthreads, sizeof(*p->threads));
+    if (!p->threads) {
+        free(p);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->cc = cc;
+    p->nthreads = nthreads;
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&p->threads[i], NULL, worker, p)) {
+            pool_free(p, i);
+            return -EAGAIN;
+        }
+    }
+
+    cc->pool = p;
+    return 0;
+}
+
+static float *dist2_table(unsigned int n, float center)
+{
+    float *t;
+    float d;
+    unsigned int i;
+
+    /* 16字节对齐, SIMD按行读取 */
+    if (posix_memalign((void **)&t, 16, ((n + 3) & ~3u) * sizeof(float)))
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        d = i - center;
+        t[i] = d * d;
+    }
+    return t;
+}
+
+int calcorrect_init(struct calcorrect *cc, const struct calib_record *rec,
+        unsigned int width, unsigned int height, unsigned int nthreads)
+{
+    const struct calibration *cal;
+    struct calcorrect_band *b;
+    unsigned int i;
+    long ncpu;
+    int ret;
+
+    memset(cc, 0, sizeof(*cc));
+    if (!width || !height || rec->nbands > CALIB_MAX_BANDS)
+        return -EINVAL;
+
+    cc->width = width;
+    cc->height = height;
+    cc->nbands = rec->nbands;
+
+    for (i = 0; i < rec->nbands; i++) {
+        cal = &rec->cal[i];
+        b = &cc->band[i];
+        b->band = rec->band[i];
+        b->black = cal->BlackLevel;
+        b->scale = 1;
+        if (cal->RadiometricCalibration1 != 0 && cal->BandSensitivity != 0)
+            b->scale = cal->BandSensitivity / cal->RadiometricCalibration1;
+        b->poly[0] = cal->VignettingPolynomial0;
+        b->poly[1] = cal->VignettingPolynomial1;
+        b->poly[2] = cal->VignettingPolynomial2;
+        b->poly[3] = cal->VignettingPolynomial3;
+        b->dx2 = dist2_table(width, cal->VignettingCenter1);
+        b->dy2 = dist2_table(height, cal->VignettingCenter2);
+        if (!b->dx2 || !b->dy2) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    if (!nthreads) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? ncpu : 1;
+    }
+    if (nthreads > 1) {
+        ret = pool_create(cc, nthreads - 1);
+        if (ret)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    calcorrect_free(cc);
+    return ret;
+}
+
+void calcorrect_free(struct calcorrect *cc)
+{
+    unsigned int i;
+
+    if (cc->pool)
+        pool_free(cc->pool, cc->pool->nthreads);
+    cc->pool = NULL;
+
+    if (cc->gain_map)
+        munmap(cc->gain_map, cc->gain_size);
+    cc->gain_map = NULL;
+
+    for (i = 0; i < CALIB_MAX_BANDS; i++) {
+        free(cc->band[i].dx2);
+        free(cc->band[i].dy2);
+        cc->band[i].dx2 = NULL;
+        cc->band[i].dy2 = NULL;
+        cc->band[i].gain = NULL;
+    }
+}
+
+void calcorrect_frame(struct calcorrect *cc, const uint16_t *const raw[],
+        float *const out[])
+{
+    struct calcorrect_pool *p = cc->pool;
+    unsigned int i;
+
+    if (!p) {
+        for (i = 0; i < cc->nbands; i++)
+            calcorrect_rows(cc, i, raw[i], out[i], 0, cc->height);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->raw = raw;
+    p->out = out;
+    p->tiles_per_band = (cc->height + TILE_ROWS - 1) / TILE_ROWS;
+    p->ntiles = p->tiles_per_band * cc->nbands;
+    p->next_tile = 0;
+    p->active = p->nthreads;
+    p->gen++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    /* 调用者线程也参与 */
+    run_tiles(p);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->active)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static size_t gain_band_size(const struct calcorrect *cc)
+{
+    size_t page = getpagesize();
+
+    return ((size_t)cc->width * cc->height * 2 + page - 1) & ~(page - 1);
+}
+
+/* 映射已有的缓存文件, 与当前记录和尺寸不符时返回-1 */
+static int gain_map_file(struct calcorrect *cc, const char *path, uint32_t crc)
+{
+    const struct gain_header *h;
+    struct stat st;
+    unsigned int i;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size != getpagesize() + cc->nbands * gain_band_size(cc)) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    h = map;
+    if (h->magic != GAIN_MAGIC || h->version != GAIN_VERSION ||
+        h->crc != crc || h->width != cc->width || h->height != cc->height ||
+        h->nbands != cc->nbands) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    cc->gain_map = map;
+    cc->gain_size = st.st_size;
+    for (i = 0; i < cc->nbands; i++) {
+        cc->band[i].gain = (const uint16_t *)((char *)map + h->band[i].offset);
+        cc->band[i].gain_unit = h->band[i].unit;
+    }
+    return 0;
+}
+
+/* 计算一个波段的Q15增益图, 按整帧最大增益归一化 */
+static float gain_fill(const struct calcorrect_band *b, unsigned int width,
+        unsigned int height, uint16_t *gain)
+{
+    float vmax = 0;
+    float r, v;
+    unsigned int x, y;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                r = sqrtf(b->dx2[x] + b->dy2[y]);
+                v = ((b->poly[3] * r + b->poly[2]) * r + b->poly[1]) * r +
+                    b->poly[0];
+                if (v < 0)
+                    v = 0;
+                if (pass == 0) {
+                    if (v > vmax)
+                        vmax = v;
+                } else {
+                    gain[(size_t)y * width + x] =
+                        (uint16_t)(v / vmax * GAIN_Q15 + 0.5f);
+                }
+            }
+        }
+        if (vmax == 0)
+            vmax = 1;
+    }
+
+    return vmax / GAIN_Q15;
+}
+
+/**
+ * 计算增益图并写到path(先写临时文件再改名, 多个进程同时启动也不会读到
+ * 半个文件). path为NULL或写文件失败时放在匿名内存中
+ */
+static int gain_build(struct calcorrect *cc, const char *path, uint32_t crc)
+{
+    struct gain_header *h;
+    size_t band_size = gain_band_size(cc);
+    size_t size = getpagesize() + cc->nbands * band_size;
+    char tmp[PATH_MAX];
+    unsigned int i;
+    void *map = MAP_FAILED;
+    int fd = -1;
+
+    if (path && snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) <
+        (int)sizeof(tmp)) {
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && ftruncate(fd, size) == 0)
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED && fd >= 0) {
+            close(fd);
+            unlink(tmp);
+            fd = -1;
+        }
+    }
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            return -ENOMEM;
+    }
+
+    h = map;
+    h->magic = GAIN_MAGIC;
+    h->version = GAIN_VERSION;
+    h->crc = crc;
+    h->width = cc->width;
+    h->height = cc->height;
+    h->nbands = cc->nbands;
+    for (i = 0; i < cc->nbands; i++) {
+        struct calcorrect_band *b = &cc->band[i];
+        uint16_t *gain = (uint16_t *)((char *)map + getpagesize() +
+            i * band_size);
+
+        h->band[i].band = b->band;
+        h->band[i].offset = (char *)gain - (char *)map;
+        h->band[i].unit = gain_fill(b, cc->width, cc->height, gain);
+        b->gain = gain;
+        b->gain_unit = h->band[i].unit;
+    }
+
+    cc->gain_map = map;
+    cc->gain_size = size;
+
+    if (fd >= 0) {
+        if (msync(map, size, MS_SYNC) != 0 || rename(tmp, path) != 0)
+            unlink(tmp);
+        close(fd);
+    }
+    return 0;
+}
+
+int calcorrect_init_cached(struct calcorrect *cc,
+        const struct calib_record *rec, unsigned int width,
+        unsigned int height, unsigned int nthreads, const char *dir)
+{
+    unsigned char page[CALIB_HDR_SIZE + CALIB_MAX_BANDS * 256];
+    char path[PATH_MAX];
+    uint32_t crc;
+    int ret;
+
+    ret = calcorrect_init(cc, rec, width, height, nthreads);
+    if (ret)
+        return ret;
+
+    /* 用编码后记录的CRC作为key, 与flash上记录的CRC相同 */
+    ret = calib_encode(rec, page, sizeof(page));
+    if (ret < 0)
+        goto fail;
+    crc = get_le32(page + 20);
+
+    if (dir) {
+        mkdir(dir, 0755);
+        if (snprintf(path, sizeof(path), "%s/calgain-%08x-%ux%u.bin", dir,
+                crc, width, height) >= (int)sizeof(path))
+            dir = NULL;
+        else if (!gain_map_file(cc, path, crc))
+            return 0;
+    }
+
+    ret = gain_build(cc, dir ? path : NULL, crc);
+    if (ret)
+        goto fail;
+    return 0;
+
+fail:
+    calcorrect_free(cc);
+    return ret;
+}
@@ -0,0 +1,66 @@
+/**
+ * 用标定记录校正原始帧, 每个波段一帧16位原始数据, 输出float:
+ *
+ *   out = max(raw - BlackLevel, 0) * V(r) * scale
+ *   V(r) = P0 + P1 * r + P2 * r^2 + P3 * r^3, Pn为VignettingPolynomialn
+ *   r    = 像素到(VignettingCenter1, VignettingCenter2)的距离(像素)
+ *   scale = BandSensitivity / RadiometricCalibration1, 为0时取1
+ *
+ * r^2按列和按行预先算成两张表, 每个像素一次加法和一次平方根, 多项式
+ * 在SIMD寄存器中计算(NEON/SSE2, 其他平台标量). 帧按行切块, 由线程池
+ * 在所有波段上并行处理.
+ *
+ * 标定很少变化, calcorrect_init_cached把每个波段的V(r)预先算成Q15增益图,
+ * 以标定记录的CRC和帧尺寸为key缓存到文件(tmpfs或flash上的目录)并mmap,
+ * 之后每个像素只乘一次增益; 下次启动命中缓存时不再计算.
+ */
+#ifndef _CALCORRECT_H
+#define _CALCORRECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "calib.h"
+
+struct calcorrect_band {
+    unsigned int    band;           /* 波长nm */
+    float           black;
+    float           scale;          /* 初始化后可由调用者修改, 如乘以曝光系数 */
+    float           poly[4];
+    float          *dx2;            /* width个, 列到中心距离的平方 */
+    float          *dy2;            /* height个 */
+    const uint16_t *gain;           /* Q15增益图, 没有为NULL */
+    float           gain_unit;      /* V(r) = gain * gain_unit */
+};
+
+struct calcorrect_pool;
+
+struct calcorrect {
+    unsigned int            width;
+    unsigned int            height;
+    unsigned int            nbands;
+    struct calcorrect_band  band[CALIB_MAX_BANDS];
+    struct calcorrect_pool *pool;   /* 单线程时为NULL */
+    void                   *gain_map;   /* 所有波段的增益图 */
+    size_t                  gain_size;
+};
+
+/* nthreads为0时取CPU数 */
+int calcorrect_init(struct calcorrect *cc, const struct calib_record *rec,
+        unsigned int width, unsigned int height, unsigned int nthreads);
+/**
+ * 同calcorrect_init, 另外使用dir下的增益图缓存, 没有时计算并写入.
+ * dir为NULL或不可写时增益图只放在内存中
+ */
+int calcorrect_init_cached(struct calcorrect *cc,
+        const struct calib_record *rec, unsigned int width,
+        unsigned int height, unsigned int nthreads, const char *dir);
+void calcorrect_free(struct calcorrect *cc);
+/* 校正一帧的所有波段, raw[i]和out[i]对应rec中的第i个波段, 每行width个像素 */
+void calcorrect_frame(struct calcorrect *cc, const uint16_t *const raw[],
+        float *const out[]);
+/* 在调用者线程中校正一个波段的[y0, y1)行 */
+void calcorrect_rows(const struct calcorrect *cc, unsigned int band,
+        const uint16_t *raw, float *out, unsigned int y0, unsigned int y1);
+
+#endif
@@ -0,0 +1,390 @@
+/**
+ * 标定记录的编解码, 格式见calib.h. 记录在flash上的存放由calstore负责
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "calib.h"
+#include "calib_le.h"
+
+enum {
+    CALIB_F64,
+    CALIB_F32,
+    CALIB_I32,
+    CALIB_U32,
+    CALIB_I64,
+};
+
+/* 波段内字段的顺序和编码, 只能在末尾追加 */
+#define F(name, type) { #name, sizeof(#name) - 1, \
+    offsetof(struct calibration, name), type }
+static const struct {
+    const char     *name;       /* ini文件中的键名 */
+    unsigned char   name_len;
+    unsigned short  offset;
+    unsigned char   type;
+} calib_fields[] = {
+    F(RadiometricCalibration1,  CALIB_F64),
+    F(RadiometricCalibration2,  CALIB_I32),
+    F(RadiometricCalibration3,  CALIB_I32),
+    F(DarkRowValue1,            CALIB_U32),
+    F(DarkRowValue2,            CALIB_U32),
+    F(DarkRowValue3,            CALIB_U32),
+    F(DarkRowValue4,            CALIB_U32),
+    F(VignettingCenter1,        CALIB_F32),
+    F(VignettingCenter2,        CALIB_F32),
+    F(VignettingPolynomial0,    CALIB_F64),
+    F(VignettingPolynomial1,    CALIB_F64),
+    F(VignettingPolynomial2,    CALIB_F64),
+    F(VignettingPolynomial3,    CALIB_F64),
+    F(PerspectiveFocalLength,   CALIB_F64),
+    F(PerspectiveDistortion1,   CALIB_F64),
+    F(PerspectiveDistortion2,   CALIB_F64),
+    F(PerspectiveDistortion3,   CALIB_F64),
+    F(PerspectiveDistortion4,   CALIB_F64),
+    F(PerspectiveDistortion5,   CALIB_F64),
+    F(BootTimeStamp,            CALIB_I32),
+    F(TimeStamp,                CALIB_I64),
+    F(BandSensitivity,          CALIB_F64),
+    F(RawMeasurement,           CALIB_F64),
+    F(OffMeasurement,           CALIB_F64),
+    F(BlackLevel,               CALIB_I32),
+    F(PrincipalPoint1,          CALIB_F64),
+    F(PrincipalPoint2,          CALIB_F64),
+    F(RelativeOpticalCenterX,   CALIB_F64),
+    F(RelativeOpticalCenterY,   CALIB_F64),
+};
+#undef F
+
+#define NFIELDS (sizeof(calib_fields) / sizeof(calib_fields[0]))
+
+static const unsigned char calib_field_size[] = {
+    [CALIB_F64] = 8,
+    [CALIB_F32] = 4,
+    [CALIB_I32] = 4,
+    [CALIB_U32] = 4,
+    [CALIB_I64] = 8,
+};
+
+/* 当前版本一个波段的字节数 */
+static unsigned int calib_band_size(void)
+{
+    unsigned int size = 4;
+    unsigned int i;
+
+    for (i = 0; i < NFIELDS; i++)
+        size += calib_field_size[calib_fields[i].type];
+
+    return size;
+}
+
+/**
+ * 多项式0xedb88320的查找表, 预先算好放在只读段, 多线程同时调用
+ * calib_crc32时不需要初始化
+ */
+static const uint32_t calib_crc_table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+/* 与内核crc32_le(~0, p, len) ^ ~0相同, 即zlib的crc32 */
+uint32_t calib_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len--)
+        crc = calib_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void calib_encode_band(unsigned char *p, unsigned int band,
+        const struct calibration *cal)
+{
+    const unsigned char *base = (const unsigned char *)cal;
+    uint64_t v64;
+    uint32_t v32;
+    int32_t i32;
+    long l;
+    unsigned int i;
+
+    put_le32(p, band);
+    p += 4;
+
+    for (i = 0; i < NFIELDS; i++) {
+        const unsigned char *f = base + calib_fields[i].offset;
+
+        switch (calib_fields[i].type) {
+        case CALIB_F64:
+            memcpy(&v64, f, 8);
+            put_le64(p, v64);
+            break;
+        case CALIB_F32:
+        case CALIB_U32:
+            memcpy(&v32, f, 4);
+            put_le32(p, v32);
+            break;
+        case CALIB_I32:
+            memcpy(&i32, f, 4);
+            put_le32(p, (uint32_t)i32);
+            break;
+        case CALIB_I64:
+            memcpy(&l, f, sizeof(l));
+            put_le64(p, (uint64_t)(int64_t)l);
+            break;
+        }
+        p += calib_field_size[calib_fields[i].type];
+    }
+}
+
+/* size是记录中一个波段的字节数, 只解码其中包含的字段 */
+static void calib_decode_fields(const unsigned char *p, unsigned int size,
+        struct calibration *cal)
+{
+    unsigned char *base = (unsigned char *)cal;
+    unsigned int used = 4;
+    uint64_t v64;
+    uint32_t v32;
+    long l;
+    unsigned int i;
+
+    memset(cal, 0, sizeof(*cal));
+    p += 4;
+
+    for (i = 0; i < NFIELDS; i++) {
+        unsigned char *f = base + calib_fields[i].offset;
+        unsigned int fsize = calib_field_size[calib_fields[i].type];
+
+        if (used + fsize > size)
+            break;
+
+        switch (calib_fields[i].type) {
+        case CALIB_F64:
+            v64 = get_le64(p);
+            memcpy(f, &v64, 8);
+            break;
+        case CALIB_F32:
+        case CALIB_U32:
+        case CALIB_I32:
+            v32 = get_le32(p);
+            memcpy(f, &v32, 4);
+            break;
+        case CALIB_I64:
+            l = (long)(int64_t)get_le64(p);
+            memcpy(f, &l, sizeof(l));
+            break;
+        }
+        p += fsize;
+        used += fsize;
+    }
+}
+
+int calib_set_field(struct calibration *cal, const char *name, size_t len,
+        const char *value)
+{
+    unsigned char *f;
+    char *end;
+    double d;
+    float fl;
+    long l;
+    unsigned long ul;
+    int32_t i32;
+    uint32_t u32;
+    unsigned int i;
+
+    for (i = 0; i < NFIELDS; i++) {
+        if (calib_fields[i].name_len == len &&
+            !memcmp(calib_fields[i].name, name, len))
+            break;
+    }
+    if (i == NFIELDS)
+        return -ENOENT;
+
+    f = (unsigned char *)cal + calib_fields[i].offset;
+    errno = 0;
+    switch (calib_fields[i].type) {
+    case CALIB_F64:
+        d = strtod(value, &end);
+        memcpy(f, &d, 8);
+        break;
+    case CALIB_F32:
+        fl = strtof(value, &end);
+        memcpy(f, &fl, 4);
+        break;
+    case CALIB_I32:
+        l = strtol(value, &end, 0);
+        i32 = l;
+        if (i32 != l)
+            errno = ERANGE;
+        memcpy(f, &i32, 4);
+        break;
+    case CALIB_U32:
+        ul = strtoul(value, &end, 0);
+        u32 = ul;
+        if (u32 != ul)
+            errno = ERANGE;
+        memcpy(f, &u32, 4);
+        break;
+    case CALIB_I64:
+        l = strtol(value, &end, 0);
+        memcpy(f, &l, sizeof(l));
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (end == value || *end || errno)
+        return -EINVAL;
+    return 0;
+}
+
+int calib_encode(const struct calib_record *rec, unsigned char *page,
+        size_t size)
+{
+    unsigned int band_size = calib_band_size();
+    unsigned int len = CALIB_HDR_SIZE + rec->nbands * band_size;
+    uint32_t crc;
+    unsigned int i;
+
+    if (rec->nbands > CALIB_MAX_BANDS || len > size)
+        return -EINVAL;
+
+    memset(page, 0xff, size);
+    put_le32(page, CALIB_MAGIC);
+    put_le16(page + 4, CALIB_VERSION);
+    put_le16(page + 6, CALIB_HDR_SIZE);
+    put_le32(page + 8, rec->seq);
+    put_le32(page + 12, rec->time);
+    put_le16(page + 16, rec->nbands);
+    put_le16(page + 18, band_size);
+    put_le32(page + 20, 0);
+
+    for (i = 0; i < rec->nbands; i++)
+        calib_encode_band(page + CALIB_HDR_SIZE + i * band_size,
+            rec->band[i], &rec->cal[i]);
+
+    crc = calib_crc32(0, page, 20);
+    crc = calib_crc32(crc, page + CALIB_HDR_SIZE, len - CALIB_HDR_SIZE);
+    put_le32(page + 20, crc);
+
+    return len;
+}
+
+/* 检查头部和CRC, 返回第一个波段的偏移 */
+static int calib_check(const unsigned char *page, size_t size,
+        unsigned int *nbands, unsigned int *band_size)
+{
+    unsigned int hdr_size;
+    unsigned int len;
+    uint32_t crc;
+    size_t i;
+
+    if (get_le32(page) != CALIB_MAGIC) {
+        for (i = 0; i < size && page[i] == 0xff; i++)
+            ;
+        return (i == size) ? -ENOENT : -EBADMSG;
+    }
+
+    hdr_size = get_le16(page + 6);
+    *nbands = get_le16(page + 16);
+    *band_size = get_le16(page + 18);
+    len = hdr_size + *nbands * *band_size;
+    if (hdr_size < CALIB_HDR_SIZE || *band_size < 4 || len > size)
+        return -EBADMSG;
+
+    crc = calib_crc32(0, page, 20);
+    crc = calib_crc32(crc, page + hdr_size, len - hdr_size);
+    if (crc != get_le32(page + 20))
+        return -EBADMSG;
+
+    return hdr_size;
+}
+
+int calib_decode(const unsigned char *page, size_t size,
+        struct calib_record *rec)
+{
+    unsigned int nbands, band_size;
+    unsigned int i;
+    int ofs;
+
+    ofs = calib_check(page, size, &nbands, &band_size);
+    if (ofs < 0)
+        return ofs;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->seq = get_le32(page + 8);
+    rec->time = get_le32(page + 12);
+    rec->nbands = nbands < CALIB_MAX_BANDS ? nbands : CALIB_MAX_BANDS;
+    for (i = 0; i < rec->nbands; i++) {
+        rec->band[i] = get_le32(page + ofs + i * band_size);
+        calib_decode_fields(page + ofs + i * band_size, band_size,
+            &rec->cal[i]);
+    }
+
+    return 0;
+}
+
+int calib_decode_band(const unsigned char *page, size_t size,
+        unsigned int band, struct calibration *cal)
+{
+    unsigned int nbands, band_size;
+    const unsigned char *p;
+    unsigned int i;
+    int ofs;
+
+    ofs = calib_check(page, size, &nbands, &band_size);
+    if (ofs < 0)
+        return ofs;
+
+    for (i = 0; i < nbands; i++) {
+        p = page + ofs + i * band_size;
+        if (get_le32(p) == band) {
+            calib_decode_fields(p, band_size, cal);
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
@@ -0,0 +1,115 @@
+/**
+ * 标定记录的编码格式和编解码库, flashtest和相机程序共用.
+ *
+ * 一条记录编码后不超过一页, 作为calstore中CALSTORE_KEY_CALIB的值保存,
+ * 读写都经过calstore_get/calstore_put, 本库不直接访问flash.
+ * 所有整数小端, 浮点数按IEEE-754位模式小端存放, 与结构体布局和
+ * CPU字节序无关.
+ *
+ * 记录布局:
+ *   0  u32 magic       CALIB_MAGIC
+ *   4  u16 version     CALIB_VERSION
+ *   6  u16 hdr_size    头部长度, 以后加字段时变长
+ *   8  u32 seq         写入者填写的版本号, calstore另有自己的seq
+ *   12 u32 time        写入时间(秒)
+ *   16 u16 nbands
+ *   18 u16 band_size   每个波段的字节数
+ *   20 u32 crc         CRC32, 覆盖头部(crc字段除外)和所有波段
+ *   hdr_size起为nbands个波段, 每个是u32波长加calib_fields中的各字段.
+ *   新版本只在波段末尾追加字段: 旧程序忽略多出的字节, 新程序把旧记录
+ *   中没有的字段置0.
+ *
+ * 标定分区由calstore管理, 记录以CALSTORE_KEY_CALIB保存. 加载内核模块
+ * w25n01gw_calib后, 最新记录缓存在/dev/w25n_calib, mmap后直接用
+ * calib_decode_band解析, 不需要访问flash.
+ */
+#ifndef _CALIB_H
+#define _CALIB_H
+
+/* 内核模块w25n01gw_calib也使用 */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+#define CALIB_MAGIC         0x424c4143  /* "CALB" */
+#define CALIB_VERSION       1
+#define CALIB_HDR_SIZE      24
+#define CALIB_MAX_BANDS     8
+
+/* 一个波段的标定参数, 与相机程序原来的定义相同, 只用于内存中 */
+struct calibration{
+    double          RadiometricCalibration1;
+    int             RadiometricCalibration2;
+    int             RadiometricCalibration3;
+
+    unsigned int    DarkRowValue1;
+    unsigned int    DarkRowValue2;
+    unsigned int    DarkRowValue3;
+    unsigned int    DarkRowValue4;
+
+    float           VignettingCenter1;
+    float           VignettingCenter2;
+
+    double          VignettingPolynomial0;
+    double          VignettingPolynomial1;
+    double          VignettingPolynomial2;
+    double          VignettingPolynomial3;
+
+    double          PerspectiveFocalLength;
+
+    double          PerspectiveDistortion1;
+    double          PerspectiveDistortion2;
+    double          PerspectiveDistortion3;
+    double          PerspectiveDistortion4;
+    double          PerspectiveDistortion5;
+
+    int             BootTimeStamp;
+
+    long            TimeStamp;
+
+    double          BandSensitivity;
+
+    double          RawMeasurement;
+
+    double          OffMeasurement;
+
+    int             BlackLevel;
+
+    double          PrincipalPoint1;
+    double          PrincipalPoint2;
+    double          RelativeOpticalCenterX;
+    double          RelativeOpticalCenterY;
+};
+
+/* 一条记录: 一组波段的标定 */
+struct calib_record {
+    uint32_t            seq;        /* 版本号, 由写入者填写, 可以为0 */
+    uint32_t            time;       /* 写入时间(秒), 由写入者填写 */
+    unsigned int        nbands;
+    unsigned int        band[CALIB_MAX_BANDS];     /* 波长nm */
+    struct calibration  cal[CALIB_MAX_BANDS];
+};
+
+uint32_t calib_crc32(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * 按字段名(struct calibration的成员名, 长度len, 不需要以0结尾)设置一个参数,
+ * value是以0结尾的数值文本. 名字未知返回-ENOENT, 数值格式错误或越界返回-EINVAL
+ */
+int calib_set_field(struct calibration *cal, const char *name, size_t len,
+        const char *value);
+
+/* 编码到一页, 剩余部分填0xff, 返回使用的字节数, 放不下返回-EINVAL */
+int calib_encode(const struct calib_record *rec, unsigned char *page,
+        size_t size);
+/* 解码一页, 返回0, 空白页返回-ENOENT, 格式或CRC错误返回-EBADMSG */
+int calib_decode(const unsigned char *page, size_t size,
+        struct calib_record *rec);
+/* 只取一页中波长为band的波段, 不存在返回-ENOENT */
+int calib_decode_band(const unsigned char *page, size_t size,
+        unsigned int band, struct calibration *cal);
+
+#endif
@@ -0,0 +1,47 @@
+/**
+ * 标定库内部使用的小端读写
+ */
+#ifndef _CALIB_LE_H
+#define _CALIB_LE_H
+
+/* 内核模块w25n01gw_calib也使用 */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+static inline void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static inline void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static inline uint16_t get_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static inline uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * 标定导入工具: 解析标定ini文件, 直接填入struct calibration, 写入标定存储.
+ *
+ * calimport [-n] [-d /dev/mtd3] file.ini...
+ *   -n  只解析并打印, 不写flash
+ *   -d  标定分区, 默认/dev/mtd3
+ *
+ * ini格式:
+ *   ; 或 # 开头为注释
+ *   [Band555]                  一个波段, 数字是波长nm, 也可以只写[555]
+ *   BlackLevel = 2344          键名与struct calibration的成员名相同
+ *   ...
+ *   [Set]                      开始下一组波段
+ * 每个文件从新的一组开始. 每组(最多CALIB_MAX_BANDS个波段)是一条标定记录,
+ * 所有文件中的组依次写到CALSTORE_KEY_CALIB, CALSTORE_KEY_CALIB + 1, ...
+ * 文件整体mmap后一遍扫描, 不限制大小, 每行只查一次字段表.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "calib.h"
+#include "calstore.h"
+
+struct import {
+    const char          *file;
+    unsigned int        line;
+    struct calib_record *sets;  /* 按需扩大, 组数只受内存和标定存储空间限制 */
+    unsigned int        nsets;
+    unsigned int        max_sets;
+    struct calibration  *cal;   /* 当前波段, 不在波段内为NULL */
+    int                 split;      /* 下一个波段开始新的一组 */
+    int                 errors;
+};
+
+static struct calib_record *new_set(struct import *im)
+{
+    struct calib_record *rec;
+    unsigned int n;
+
+    /* 扩大后im->cal失效, 调用者随后指向新组中的波段 */
+    if (im->nsets == im->max_sets) {
+        n = im->max_sets ? im->max_sets * 2 : 16;
+        rec = realloc(im->sets, n * sizeof(*rec));
+        if (!rec)
+            return NULL;
+        im->sets = rec;
+        im->max_sets = n;
+    }
+
+    rec = &im->sets[im->nsets++];
+    memset(rec, 0, sizeof(*rec));
+    return rec;
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+static const char *trim_end(const char *start, const char *p)
+{
+    while (p > start && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r'))
+        p--;
+    return p;
+}
+
+/* [Set]或[Band555]/[555] */
+static int parse_section(struct import *im, const char *p, const char *end)
+{
+    struct calib_record *rec;
+    unsigned long band = 0;
+    const char *q;
+
+    if (end - p == 3 && !memcmp(p, "Set", 3)) {
+        im->cal = NULL;
+        im->split = 1;
+        return 0;
+    }
+
+    if (end - p > 4 && !memcmp(p, "Band", 4))
+        p += 4;
+    for (q = p; q < end; q++) {
+        if (*q < '0' || *q > '9')
+            return -EINVAL;
+        band = band * 10 + (*q - '0');
+    }
+    if (q == p || band == 0 || band > 100000)
+        return -EINVAL;
+
+    rec = (im->nsets && !im->split) ? &im->sets[im->nsets - 1] : new_set(im);
+    im->split = 0;
+    if (!rec)
+        return -ENOMEM;
+    if (rec->nbands == CALIB_MAX_BANDS)
+        return -E2BIG;
+
+    rec->band[rec->nbands] = band;
+    im->cal = &rec->cal[rec->nbands++];
+    return 0;
+}
+
+/* 键 = 值 */
+static int parse_value(struct import *im, const char *key, const char *end)
+{
+    const char *eq, *key_end, *p;
+    char value[64];
+    size_t len;
+
+    eq = memchr(key, '=', end - key);
+    if (!eq || !im->cal)
+        return -EINVAL;
+
+    key_end = trim_end(key, eq);
+    p = skip_space(eq + 1, end);
+    len = end - p;
+    if (len == 0 || len >= sizeof(value))
+        return -EINVAL;
+    memcpy(value, p, len);
+    value[len] = '\0';
+
+    return calib_set_field(im->cal, key, key_end - key, value);
+}
+
+static int parse_line(struct import *im, const char *p, const char *end)
+{
+    const char *close;
+
+    p = skip_space(p, end);
+    end = trim_end(p, end);
+    if (p == end || *p == ';' || *p == '#')
+        return 0;
+
+    if (*p == '[') {
+        close = memchr(p, ']', end - p);
+        if (!close || close + 1 != end)
+            return -EINVAL;
+        return parse_section(im, p + 1, close);
+    }
+
+    return parse_value(im, p, end);
+}
+
+static int parse_file(struct import *im, const char *file)
+{
+    const char *data, *p, *end, *nl;
+    struct stat st;
+    int fd;
+    int ret;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("%s: %s\n", file, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    im->file = file;
+    im->line = 0;
+    im->cal = NULL;
+    im->split = 1;      /* 每个文件从新的一组开始 */
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    end = data + st.st_size;
+    for (p = data; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if (!nl)
+            nl = end;
+        im->line++;
+
+        ret = parse_line(im, p, nl);
+        if (ret == -ENOENT) {
+            printf("%s:%u: unknown key, ignored\n", file, im->line);
+        } else if (ret) {
+            printf("%s:%u: %s\n", file, im->line, strerror(-ret));
+            im->errors++;
+        }
+    }
+
+    munmap((void *)data, st.st_size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct import im;
+    struct calstore cs;
+    unsigned char *page;
+    const char *dev = "/dev/mtd3";
+    int dry_run = 0;
+    unsigned int i, j;
+    int len;
+    int opt;
+    int ret = 0;
+
+    while ((opt = getopt(argc, argv, "nd:")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'd':
+            dev = optarg;
+            break;
+        default:
+            printf("usage: %s [-n] [-d mtd] file.ini...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        printf("usage: %s [-n] [-d mtd] file.ini...\n", argv[0]);
+        return 1;
+    }
+
+    memset(&im, 0, sizeof(im));
+
+    for (i = optind; i < (unsigned int)argc; i++) {
+        if (parse_file(&im, argv[i]))
+            im.errors++;
+    }
+    if (im.errors) {
+        printf("%d errors, nothing written\n", im.errors);
+        free(im.sets);
+        return 1;
+    }
+
+    for (i = 0; i < im.nsets; i++) {
+        printf("set %u:", i);
+        for (j = 0; j < im.sets[i].nbands; j++)
+            printf(" %u", im.sets[i].band[j]);
+        printf("\n");
+    }
+    if (dry_run || !im.nsets) {
+        free(im.sets);
+        return 0;
+    }
+
+    ret = calstore_open(&cs, dev);
+    if (ret) {
+        printf("%s: %s\n", dev, strerror(-ret));
+        free(im.sets);
+        return 1;
+    }
+
+    page = malloc(calstore_max_value(&cs));
+    for (i = 0; page && i < im.nsets; i++) {
+        len = calib_encode(&im.sets[i], page, calstore_max_value(&cs));
+        ret = len < 0 ? len :
+            calstore_put(&cs, CALSTORE_KEY_CALIB + i, page, len);
+        if (ret) {
+            printf("set %u: %s\n", i, strerror(-ret));
+            break;
+        }
+    }
+
+    free(page);
+    calstore_close(&cs);
+    free(im.sets);
+    return (ret || !page) ? 1 : 0;
+}
@@ -0,0 +1,618 @@
+/**
+ * 日志结构键值存储的实现, 原理见calstore.h. 页格式(小端):
+ *
+ * 块头(第0页):     u32 magic, u32 erase_count, u32 crc
+ * 记录:            u32 magic, u32 key, u32 seq, u16 len, u16 0, u32 crc, 数据
+ *                  crc覆盖前16字节和数据
+ * 块摘要(最后一页): u32 magic, u32 erase_count, u16 n, u16 0,
+ *                  n个{u32 key, u32 seq}依次对应第1页起的记录页,
+ *                  seq为0表示该页没有有效记录, 最后是u32 crc
+ *
+ * 摘要只列出关块时仍有效的记录, 被覆盖的旧记录不再需要.
+ * 回收时复制的记录保留原来的seq, 中途掉电两份相同, 取哪份都可以.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "calib.h"
+#include "calstore.h"
+#include "calib_le.h"
+
+enum {
+    CALSTORE_BAD,
+    CALSTORE_FREE,      /* 已擦除, used为0时还没有写块头 */
+    CALSTORE_DIRTY,     /* 内容无法识别, 使用前要擦除 */
+    CALSTORE_ACTIVE,
+    CALSTORE_CLOSED,
+};
+
+#define CALSTORE_RESERVE    2   /* 回收后至少保留的空闲块 */
+#define CALSTORE_WL_DELTA   32  /* 冷块与最旧块擦除次数相差超过此值时搬移冷块 */
+
+static off_t cs_ofs(const struct calstore *cs, unsigned int page)
+{
+    return (off_t)page * cs->page_size;
+}
+
+static int cs_read(struct calstore *cs, unsigned int page, unsigned char *buf)
+{
+    if (pread(cs->fd, buf, cs->page_size, cs_ofs(cs, page)) != cs->page_size)
+        return -EIO;
+    return 0;
+}
+
+static int cs_write(struct calstore *cs, unsigned int page,
+        const unsigned char *buf)
+{
+    if (pwrite(cs->fd, buf, cs->page_size, cs_ofs(cs, page)) != cs->page_size)
+        return -EIO;
+    return 0;
+}
+
+static int cs_blank(const struct calstore *cs, const unsigned char *buf)
+{
+    unsigned int i;
+
+    for (i = 0; i < cs->page_size; i++) {
+        if (buf[i] != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+static struct calstore_entry *cs_lookup(struct calstore *cs, uint32_t key)
+{
+    unsigned int mask = cs->index_size - 1;
+    unsigned int i = (key * 2654435761u) & mask;
+
+    while (cs->index[i].page && cs->index[i].key != key)
+        i = (i + 1) & mask;
+
+    return &cs->index[i];
+}
+
+static int cs_index_grow(struct calstore *cs)
+{
+    struct calstore_entry *old = cs->index;
+    unsigned int size = cs->index_size;
+    unsigned int i;
+
+    cs->index = calloc(size * 2, sizeof(*cs->index));
+    if (!cs->index) {
+        cs->index = old;
+        return -ENOMEM;
+    }
+    cs->index_size = size * 2;
+
+    for (i = 0; i < size; i++) {
+        if (old[i].page)
+            *cs_lookup(cs, old[i].key) = old[i];
+    }
+
+    free(old);
+    return 0;
+}
+
+/* 记录key在page上的seq版本, 比索引中的旧时忽略 */
+static int cs_index_set(struct calstore *cs, uint32_t key, uint32_t seq,
+        unsigned int page)
+{
+    struct calstore_entry *e;
+
+    if ((cs->count + 1) * 2 > cs->index_size && cs_index_grow(cs))
+        return -ENOMEM;
+
+    e = cs_lookup(cs, key);
+    if (e->page) {
+        if (e->seq > seq)
+            return 0;
+        cs->blk[e->page / cs->pages_per_block].live--;
+    } else {
+        cs->count++;
+    }
+
+    e->key = key;
+    e->seq = seq;
+    e->page = page;
+    cs->blk[page / cs->pages_per_block].live++;
+    if (seq > cs->seq)
+        cs->seq = seq;
+    return 0;
+}
+
+/* 解析一条记录, 返回数据长度, 无效返回-1 */
+static int cs_parse_rec(const struct calstore *cs, const unsigned char *p,
+        uint32_t *key, uint32_t *seq)
+{
+    unsigned int len;
+    uint32_t crc;
+
+    if (get_le32(p) != CALSTORE_MAGIC_REC)
+        return -1;
+
+    len = get_le16(p + 12);
+    if (len > cs->page_size - CALSTORE_REC_HDR)
+        return -1;
+
+    crc = calib_crc32(0, p, 16);
+    crc = calib_crc32(crc, p + CALSTORE_REC_HDR, len);
+    if (crc != get_le32(p + 16))
+        return -1;
+
+    *key = get_le32(p + 4);
+    *seq = get_le32(p + 8);
+    return len;
+}
+
+/* 摘要有效时返回其中的页数 */
+static int cs_parse_sum(const struct calstore *cs, const unsigned char *p)
+{
+    unsigned int n;
+
+    if (get_le32(p) != CALSTORE_MAGIC_SUM)
+        return -1;
+
+    n = get_le16(p + 8);
+    if (n != cs->pages_per_block - 2 || 12 + n * 8 + 4 > cs->page_size)
+        return -1;
+
+    if (calib_crc32(0, p, 12 + n * 8) != get_le32(p + 12 + n * 8))
+        return -1;
+
+    return n;
+}
+
+static int cs_isbad(struct calstore *cs, unsigned int block)
+{
+    loff_t ofs = cs_ofs(cs, block * cs->pages_per_block);
+
+    return ioctl(cs->fd, MEMGETBADBLOCK, &ofs) > 0;
+}
+
+static void cs_markbad(struct calstore *cs, unsigned int block)
+{
+    loff_t ofs = cs_ofs(cs, block * cs->pages_per_block);
+
+    printf("calstore: block %u is bad\n", block);
+    ioctl(cs->fd, MEMSETBADBLOCK, &ofs);
+    cs->blk[block].state = CALSTORE_BAD;
+}
+
+static int cs_write_header(struct calstore *cs, unsigned int block)
+{
+    unsigned char *p = cs->buf;
+
+    memset(p, 0xff, cs->page_size);
+    put_le32(p, CALSTORE_MAGIC_HDR);
+    put_le32(p + 4, cs->blk[block].erase_count);
+    put_le32(p + 8, calib_crc32(0, p, 8));
+
+    if (cs_write(cs, block * cs->pages_per_block, p)) {
+        cs_markbad(cs, block);
+        return -EIO;
+    }
+
+    cs->blk[block].used = 1;
+    return 0;
+}
+
+/* 擦除后立即写块头, 擦除次数不会因掉电丢失 */
+static int cs_erase(struct calstore *cs, unsigned int block)
+{
+    struct calstore_block *b = &cs->blk[block];
+    struct erase_info_user erase;
+
+    erase.start = cs_ofs(cs, block * cs->pages_per_block);
+    erase.length = cs->pages_per_block * cs->page_size;
+    if (ioctl(cs->fd, MEMERASE, &erase) != 0) {
+        cs_markbad(cs, block);
+        return -EIO;
+    }
+
+    b->erase_count++;
+    b->state = CALSTORE_FREE;
+    b->live = 0;
+    b->used = 0;
+    return cs_write_header(cs, block);
+}
+
+/* 块写满或打开时发现多个未关闭的块时写摘要 */
+static void cs_close_block(struct calstore *cs, unsigned int block)
+{
+    unsigned int ppb = cs->pages_per_block;
+    unsigned int base = block * ppb;
+    unsigned int n = ppb - 2;
+    unsigned char *p = cs->buf;
+    struct calstore_entry *e;
+    unsigned int i;
+
+    memset(p, 0xff, cs->page_size);
+    put_le32(p, CALSTORE_MAGIC_SUM);
+    put_le32(p + 4, cs->blk[block].erase_count);
+    put_le16(p + 8, n);
+    put_le16(p + 10, 0);
+    for (i = 0; i < n; i++) {
+        put_le32(p + 12 + i * 8, 0);
+        put_le32(p + 16 + i * 8, 0);
+    }
+
+    for (i = 0; i < cs->index_size; i++) {
+        e = &cs->index[i];
+        if (e->page > base && e->page < base + ppb - 1) {
+            put_le32(p + 12 + (e->page - base - 1) * 8, e->key);
+            put_le32(p + 16 + (e->page - base - 1) * 8, e->seq);
+        }
+    }
+    put_le32(p + 12 + n * 8, calib_crc32(0, p, 12 + n * 8));
+
+    /* 写失败时下次打开仍按未关闭的块逐页扫描 */
+    cs_write(cs, base + ppb - 1, p);
+    cs->blk[block].state = CALSTORE_CLOSED;
+    cs->blk[block].used = ppb;
+}
+
+static unsigned int cs_free_blocks(const struct calstore *cs)
+{
+    unsigned int n = 0;
+    unsigned int i;
+
+    for (i = 0; i < cs->blocks; i++) {
+        if (cs->blk[i].state == CALSTORE_FREE ||
+            cs->blk[i].state == CALSTORE_DIRTY)
+            n++;
+    }
+
+    return n;
+}
+
+static int cs_append(struct calstore *cs, uint32_t key, uint32_t seq,
+        const void *data, size_t len);
+
+/**
+ * 回收一个已关闭的块: 复制其中仍有效的记录后擦除.
+ * 一般选有效记录最少的块; 最冷的块比最旧的块少擦除WL_DELTA次以上时
+ * 选最冷的块, 把长期不变的数据搬到磨损较多的块上
+ */
+static int cs_gc_one(struct calstore *cs, int allow_wl)
+{
+    unsigned int ppb = cs->pages_per_block;
+    unsigned char *data;
+    uint32_t max_ec = 0;
+    uint32_t key, seq;
+    int victim = -1;
+    int cold = -1;
+    unsigned int i, page;
+    int len;
+    int ret = 0;
+
+    for (i = 0; i < cs->blocks; i++) {
+        struct calstore_block *b = &cs->blk[i];
+
+        if (b->state == CALSTORE_BAD)
+            continue;
+        if (b->erase_count > max_ec)
+            max_ec = b->erase_count;
+        if (b->state != CALSTORE_CLOSED)
+            continue;
+        if (victim < 0 || b->live < cs->blk[victim].live ||
+            (b->live == cs->blk[victim].live &&
+             b->erase_count < cs->blk[victim].erase_count))
+            victim = i;
+        if (cold < 0 || b->erase_count < cs->blk[cold].erase_count)
+            cold = i;
+    }
+
+    if (victim < 0)
+        return -ENOSPC;
+    if (allow_wl && max_ec - cs->blk[cold].erase_count > CALSTORE_WL_DELTA)
+        victim = cold;
+    else if (cs->blk[victim].live >= ppb - 2)
+        return -ENOSPC;     /* 全是有效数据, 回收没有收益 */
+
+    data = malloc(cs->page_size);
+    if (!data)
+        return -ENOMEM;
+
+    cs->in_gc = 1;
+    for (page = victim * ppb + 1;
+         page < (victim + 1) * ppb - 1 && cs->blk[victim].live; page++) {
+        if (cs_read(cs, page, data))
+            continue;
+        len = cs_parse_rec(cs, data, &key, &seq);
+        if (len < 0 || cs_lookup(cs, key)->page != page)
+            continue;
+
+        ret = cs_append(cs, key, seq, data + CALSTORE_REC_HDR, len);
+        if (ret)
+            break;
+    }
+    cs->in_gc = 0;
+    free(data);
+
+    if (!ret)
+        ret = cs_erase(cs, victim);
+    return ret;
+}
+
+static int cs_gc(struct calstore *cs)
+{
+    int allow_wl = 1;
+    int ret;
+
+    while (cs_free_blocks(cs) < CALSTORE_RESERVE) {
+        ret = cs_gc_one(cs, allow_wl);
+        if (ret)
+            return cs_free_blocks(cs) ? 0 : ret;
+        allow_wl = 0;
+    }
+
+    return 0;
+}
+
+/* 换一个擦除次数最少的空闲块作为追加块 */
+static int cs_open_block(struct calstore *cs)
+{
+    struct calstore_block *b;
+    int best;
+    unsigned int i;
+    int ret;
+
+    if (!cs->in_gc) {
+        ret = cs_gc(cs);
+        if (ret)
+            return ret;
+        /* 回收复制记录时已经打开了新块 */
+        if (cs->active >= 0)
+            return 0;
+    }
+
+    for (;;) {
+        best = -1;
+        for (i = 0; i < cs->blocks; i++) {
+            b = &cs->blk[i];
+            if (b->state != CALSTORE_FREE && b->state != CALSTORE_DIRTY)
+                continue;
+            if (best < 0 || b->erase_count < cs->blk[best].erase_count)
+                best = i;
+        }
+        if (best < 0)
+            return -ENOSPC;
+
+        b = &cs->blk[best];
+        if (b->state == CALSTORE_DIRTY && cs_erase(cs, best))
+            continue;
+        if (!b->used && cs_write_header(cs, best))
+            continue;
+
+        b->state = CALSTORE_ACTIVE;
+        cs->active = best;
+        return 0;
+    }
+}
+
+/* 追加一条记录, 编程失败的页跳过 */
+static int cs_append(struct calstore *cs, uint32_t key, uint32_t seq,
+        const void *data, size_t len)
+{
+    unsigned int ppb = cs->pages_per_block;
+    unsigned char *p;
+    unsigned int page;
+    struct calstore_block *b;
+    int ret;
+
+    if (len > calstore_max_value(cs))
+        return -EINVAL;
+
+    for (;;) {
+        if (cs->active < 0 || cs->blk[cs->active].used >= ppb - 1) {
+            if (cs->active >= 0)
+                cs_close_block(cs, cs->active);
+            cs->active = -1;
+            ret = cs_open_block(cs);
+            if (ret)
+                return ret;
+        }
+
+        /* 回收会用到缓冲区, 每次都在确定了写入块之后再组装记录 */
+        p = cs->rec;
+        memset(p, 0xff, cs->page_size);
+        put_le32(p, CALSTORE_MAGIC_REC);
+        put_le32(p + 4, key);
+        put_le32(p + 8, seq);
+        put_le16(p + 12, len);
+        put_le16(p + 14, 0);
+        memcpy(p + CALSTORE_REC_HDR, data, len);
+        put_le32(p + 16, calib_crc32(calib_crc32(0, p, 16),
+            p + CALSTORE_REC_HDR, len));
+
+        b = &cs->blk[cs->active];
+        page = cs->active * ppb + b->used++;
+        if (!cs_write(cs, page, p))
+            return cs_index_set(cs, key, seq, page);
+        printf("calstore: write page %u failed\n", page);
+    }
+}
+
+/**
+ * 扫描一块, 返回其中记录的最大seq. 有效摘要的块只读一页,
+ * 没有摘要的块读块头, 再逐页读到第一个空白页
+ */
+static uint32_t cs_scan_block(struct calstore *cs, unsigned int block)
+{
+    struct calstore_block *b = &cs->blk[block];
+    unsigned int ppb = cs->pages_per_block;
+    unsigned int base = block * ppb;
+    unsigned char *p = cs->buf;
+    uint32_t key, seq, max_seq = 0;
+    int last_blank;
+    int n, i;
+
+    if (cs_isbad(cs, block)) {
+        b->state = CALSTORE_BAD;
+        return 0;
+    }
+
+    if (!cs_read(cs, base + ppb - 1, p) && (n = cs_parse_sum(cs, p)) > 0) {
+        b->state = CALSTORE_CLOSED;
+        b->erase_count = get_le32(p + 4);
+        b->used = ppb;
+        for (i = 0; i < n; i++) {
+            key = get_le32(p + 12 + i * 8);
+            seq = get_le32(p + 16 + i * 8);
+            if (seq)
+                cs_index_set(cs, key, seq, base + 1 + i);
+        }
+        return 0;
+    }
+    last_blank = cs_blank(cs, p);
+
+    b->state = CALSTORE_DIRTY;
+    if (cs_read(cs, base, p))
+        return 0;
+    if (cs_blank(cs, p)) {
+        if (last_blank)
+            b->state = CALSTORE_FREE;
+        return 0;
+    }
+    if (get_le32(p) != CALSTORE_MAGIC_HDR ||
+        calib_crc32(0, p, 8) != get_le32(p + 8))
+        return 0;
+
+    b->erase_count = get_le32(p + 4);
+    for (b->used = 1; b->used < ppb - 1; b->used++) {
+        if (cs_read(cs, base + b->used, p))
+            continue;
+        if (cs_blank(cs, p))
+            break;
+        if (cs_parse_rec(cs, p, &key, &seq) < 0)
+            continue;
+        cs_index_set(cs, key, seq, base + b->used);
+        if (seq > max_seq)
+            max_seq = seq;
+    }
+    b->state = (b->used > 1) ? CALSTORE_ACTIVE : CALSTORE_FREE;
+    return max_seq;
+}
+
+int calstore_open(struct calstore *cs, const char *path)
+{
+    struct mtd_info_user info;
+    uint32_t seq, active_seq = 0;
+    unsigned int i;
+    int ret;
+
+    memset(cs, 0, sizeof(*cs));
+    cs->active = -1;
+    cs->fd = open(path, O_RDWR | O_SYNC);
+    if (cs->fd < 0)
+        return -errno;
+
+    if (ioctl(cs->fd, MEMGETINFO, &info) != 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    cs->page_size = info.writesize;
+    cs->pages_per_block = info.erasesize / info.writesize;
+    cs->blocks = info.size / info.erasesize;
+    cs->index_size = 256;
+    cs->blk = calloc(cs->blocks, sizeof(*cs->blk));
+    cs->index = calloc(cs->index_size, sizeof(*cs->index));
+    cs->buf = malloc(cs->page_size);
+    cs->rec = malloc(cs->page_size);
+    if (!cs->blk || !cs->index || !cs->buf || !cs->rec) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < cs->blocks; i++) {
+        seq = cs_scan_block(cs, i);
+        if (cs->blk[i].state == CALSTORE_ACTIVE &&
+            (cs->active < 0 || seq > active_seq)) {
+            cs->active = i;
+            active_seq = seq;
+        }
+    }
+
+    /* 只保留seq最大的未关闭块继续追加, 其余的补写摘要 */
+    for (i = 0; i < cs->blocks; i++) {
+        if (cs->blk[i].state == CALSTORE_ACTIVE && (int)i != cs->active)
+            cs_close_block(cs, i);
+    }
+
+    return 0;
+
+fail:
+    calstore_close(cs);
+    return ret;
+}
+
+void calstore_close(struct calstore *cs)
+{
+    if (cs->fd >= 0)
+        close(cs->fd);
+    cs->fd = -1;
+    free(cs->blk);
+    free(cs->index);
+    free(cs->buf);
+    free(cs->rec);
+    cs->blk = NULL;
+    cs->index = NULL;
+    cs->buf = NULL;
+    cs->rec = NULL;
+}
+
+size_t calstore_max_value(const struct calstore *cs)
+{
+    return cs->page_size - CALSTORE_REC_HDR;
+}
+
+int calstore_get(struct calstore *cs, uint32_t key, void *buf, size_t size)
+{
+    struct calstore_entry *e = cs_lookup(cs, key);
+    uint32_t k, seq;
+    int len;
+
+    if (!e->page)
+        return -ENOENT;
+
+    if (cs_read(cs, e->page, cs->buf))
+        return -EIO;
+    len = cs_parse_rec(cs, cs->buf, &k, &seq);
+    if (len < 0 || k != key)
+        return -EBADMSG;
+
+    memcpy(buf, cs->buf + CALSTORE_REC_HDR, (size_t)len < size ? (size_t)len : size);
+    return len;
+}
+
+int calstore_put(struct calstore *cs, uint32_t key, const void *buf,
+        size_t len)
+{
+    return cs_append(cs, key, cs->seq + 1, buf, len);
+}
+
+void calstore_wear(const struct calstore *cs, unsigned int *free_blocks,
+        uint32_t *min_erase, uint32_t *max_erase)
+{
+    unsigned int i;
+
+    *free_blocks = cs_free_blocks(cs);
+    *min_erase = UINT32_MAX;
+    *max_erase = 0;
+    for (i = 0; i < cs->blocks; i++) {
+        if (cs->blk[i].state == CALSTORE_BAD)
+            continue;
+        if (cs->blk[i].erase_count < *min_erase)
+            *min_erase = cs->blk[i].erase_count;
+        if (cs->blk[i].erase_count > *max_erase)
+            *max_erase = cs->blk[i].erase_count;
+    }
+}
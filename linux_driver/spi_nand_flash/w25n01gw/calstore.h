@@ -0,0 +1,72 @@
+/**
+ * 标定分区上的日志结构键值存储, 取代整片擦除后重写第0页.
+ *
+ * 每块第0页是块头(擦除次数), 最后一页是块摘要(各页记录的key和seq),
+ * 中间的页每页一条记录. 更新只追加一条记录, 一次页编程;
+ * 块写满后写摘要并换到擦除次数最少的空闲块. 空闲块不足时回收
+ * 有效记录最少的块, 冷数据块与最旧块的擦除次数相差过大时优先回收冷块.
+ * 打开时每块只读摘要页(未写满的块再读块头和已写的页), 在内存中
+ * 建立key到页的散列索引, 之后按key读取是一次页读.
+ */
+#ifndef _CALSTORE_H
+#define _CALSTORE_H
+
+/* 内核模块w25n01gw_calib也使用 */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+#define CALSTORE_MAGIC_HDR  0x42545343  /* "CSTB" 块头 */
+#define CALSTORE_MAGIC_REC  0x52545343  /* "CSTR" 记录 */
+#define CALSTORE_MAGIC_SUM  0x53545343  /* "CSTS" 块摘要 */
+#define CALSTORE_REC_HDR    20
+
+/* 保存完整标定记录(calib_encode的结果)的key */
+#define CALSTORE_KEY_CALIB  1
+
+struct calstore_block {
+    uint32_t    erase_count;
+    uint16_t    state;
+    uint16_t    live;       /* 索引中指向本块的记录数 */
+    uint16_t    used;       /* 下一个要写的页号(块内) */
+};
+
+struct calstore_entry {
+    uint32_t    key;
+    uint32_t    seq;
+    uint32_t    page;       /* 分区内页号, 0表示空槽 */
+};
+
+struct calstore {
+    int                     fd;
+    unsigned int            page_size;
+    unsigned int            pages_per_block;
+    unsigned int            blocks;
+    struct calstore_block  *blk;
+    struct calstore_entry  *index;
+    unsigned int            index_size; /* 2的幂 */
+    unsigned int            count;
+    int                     active;     /* 正在追加的块, -1表示没有 */
+    uint32_t                seq;        /* 最大的记录seq */
+    int                     in_gc;
+    unsigned char          *buf;        /* 一页, 读页和写块头/摘要用 */
+    unsigned char          *rec;        /* 一页, 组装待写的记录 */
+};
+
+int calstore_open(struct calstore *cs, const char *path);
+void calstore_close(struct calstore *cs);
+/* 一条记录最多能存的字节数 */
+size_t calstore_max_value(const struct calstore *cs);
+/* 读key的最新值, 返回长度, 不存在返回-ENOENT */
+int calstore_get(struct calstore *cs, uint32_t key, void *buf, size_t size);
+/* 写入key的新值 */
+int calstore_put(struct calstore *cs, uint32_t key, const void *buf,
+        size_t len);
+/* 空闲块数和擦除次数范围 */
+void calstore_wear(const struct calstore *cs, unsigned int *free_blocks,
+        uint32_t *min_erase, uint32_t *max_erase);
+
+#endif
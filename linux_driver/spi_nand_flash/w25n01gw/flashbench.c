@@ -0,0 +1,342 @@
+/**
+ * MTD性能测试: 擦除, 顺序写, 顺序读, 随机页读的吞吐量和延时分位数.
+ * 可以对真实芯片, 也可以对w25n01gw_sim模拟的芯片运行.
+ *
+ *   flashbench -d /dev/mtd3 -f [-s 起始块] [-b 块数] [-n 随机读次数]
+ *              [-r 顺序读每次的字节数] [-t erase,write,seqread,randread] [-v]
+ *
+ * 擦除和写会破坏分区内容, 必须加-f.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#define TEST_ERASE      (1 << 0)
+#define TEST_WRITE      (1 << 1)
+#define TEST_SEQREAD    (1 << 2)
+#define TEST_RANDREAD   (1 << 3)
+
+struct lat {
+    double         *us;
+    unsigned int    n;
+    unsigned int    max;
+};
+
+static int fd;
+static struct mtd_info_user info;
+static unsigned int start_block = 0;
+static unsigned int nblocks = 0;
+static unsigned int rand_reads = 1000;
+static unsigned int seq_len = 0;
+static int verify = 0;
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int lat_init(struct lat *l, unsigned int max)
+{
+    l->us = malloc(max * sizeof(double));
+    l->n = 0;
+    l->max = max;
+    return l->us ? 0 : -1;
+}
+
+static void lat_add(struct lat *l, double us)
+{
+    if (l->n < l->max)
+        l->us[l->n++] = us;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double lat_pct(struct lat *l, double pct)
+{
+    unsigned int i = (unsigned int)(pct / 100.0 * (l->n - 1) + 0.5);
+
+    return l->us[i];
+}
+
+/* 打印吞吐量和延时分位数, bytes为0时只打印次数 */
+static void lat_report(const char *name, struct lat *l, double bytes,
+        double total_us)
+{
+    if (!l->n) {
+        printf("%-9s no samples\n", name);
+        return;
+    }
+
+    qsort(l->us, l->n, sizeof(double), cmp_double);
+    printf("%-9s %6u ops", name, l->n);
+    if (bytes)
+        printf(" %8.2f MB/s", bytes / total_us);
+    else
+        printf(" %8.1f ops/s", l->n / total_us * 1e6);
+    printf("  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n",
+        lat_pct(l, 50), lat_pct(l, 90), lat_pct(l, 99), l->us[l->n - 1]);
+}
+
+static int block_isbad(unsigned int block)
+{
+    loff_t ofs = (loff_t)block * info.erasesize;
+
+    return ioctl(fd, MEMGETBADBLOCK, &ofs) > 0;
+}
+
+/* 页的测试数据: 每4字节为页号和偏移的组合 */
+static void fill_page(unsigned char *buf, unsigned int page)
+{
+    unsigned int i;
+
+    for (i = 0; i < info.writesize; i += 4) {
+        unsigned int v = (page << 12) ^ i;
+
+        memcpy(buf + i, &v, 4);
+    }
+}
+
+static void test_erase(void)
+{
+    struct erase_info_user erase;
+    struct lat l;
+    unsigned int block;
+    double t0, t, total = 0;
+
+    if (lat_init(&l, nblocks))
+        return;
+
+    erase.length = info.erasesize;
+    for (block = start_block; block < start_block + nblocks; block++) {
+        if (block_isbad(block))
+            continue;
+        erase.start = block * info.erasesize;
+        t0 = now_us();
+        if (ioctl(fd, MEMERASE, &erase) != 0)
+            printf("erase block %u failed: %s\n", block, strerror(errno));
+        t = now_us() - t0;
+        total += t;
+        lat_add(&l, t);
+    }
+
+    lat_report("erase", &l, (double)l.n * info.erasesize, total);
+    free(l.us);
+}
+
+static void test_write(void)
+{
+    unsigned int pages = info.erasesize / info.writesize;
+    unsigned char *buf = malloc(info.writesize);
+    unsigned int block, page;
+    struct lat l;
+    double t0, t, total = 0;
+
+    if (!buf || lat_init(&l, nblocks * pages))
+        goto out;
+
+    for (block = start_block; block < start_block + nblocks; block++) {
+        if (block_isbad(block))
+            continue;
+        for (page = block * pages; page < (block + 1) * pages; page++) {
+            fill_page(buf, page);
+            t0 = now_us();
+            if (pwrite(fd, buf, info.writesize,
+                       (off_t)page * info.writesize) != info.writesize)
+                printf("write page %u failed: %s\n", page, strerror(errno));
+            t = now_us() - t0;
+            total += t;
+            lat_add(&l, t);
+        }
+    }
+
+    lat_report("write", &l, (double)l.n * info.writesize, total);
+    free(l.us);
+out:
+    free(buf);
+}
+
+static void test_seqread(void)
+{
+    unsigned char *buf = malloc(seq_len);
+    unsigned char *ref = malloc(info.writesize);
+    unsigned int per_block = info.erasesize / seq_len;
+    unsigned int block, i, p;
+    unsigned int errors = 0;
+    struct lat l;
+    off_t ofs;
+    double t0, t, total = 0;
+
+    if (!buf || !ref || lat_init(&l, nblocks * per_block))
+        goto out;
+
+    for (block = start_block; block < start_block + nblocks; block++) {
+        if (block_isbad(block))
+            continue;
+        for (i = 0; i < per_block; i++) {
+            ofs = (off_t)block * info.erasesize + (off_t)i * seq_len;
+            t0 = now_us();
+            if (pread(fd, buf, seq_len, ofs) != seq_len)
+                printf("read 0x%llx failed: %s\n", (long long)ofs,
+                    strerror(errno));
+            t = now_us() - t0;
+            total += t;
+            lat_add(&l, t);
+
+            for (p = 0; verify && p < seq_len / info.writesize; p++) {
+                fill_page(ref, ofs / info.writesize + p);
+                if (memcmp(ref, buf + p * info.writesize, info.writesize))
+                    errors++;
+            }
+        }
+    }
+
+    lat_report("seqread", &l, (double)l.n * seq_len, total);
+    if (verify)
+        printf("seqread verify: %u bad pages\n", errors);
+    free(l.us);
+out:
+    free(buf);
+    free(ref);
+}
+
+static void test_randread(void)
+{
+    unsigned int pages = info.erasesize / info.writesize;
+    unsigned char *buf = malloc(info.writesize);
+    unsigned int i, page;
+    struct lat l;
+    double t0, t, total = 0;
+
+    if (!buf || lat_init(&l, rand_reads))
+        goto out;
+
+    srand(1);
+    for (i = 0; i < rand_reads; i++) {
+        page = start_block * pages + rand() % (nblocks * pages);
+        if (block_isbad(page / pages))
+            continue;
+        t0 = now_us();
+        if (pread(fd, buf, info.writesize,
+                  (off_t)page * info.writesize) != info.writesize)
+            printf("read page %u failed: %s\n", page, strerror(errno));
+        t = now_us() - t0;
+        total += t;
+        lat_add(&l, t);
+    }
+
+    lat_report("randread", &l, (double)l.n * info.writesize, total);
+    free(l.us);
+out:
+    free(buf);
+}
+
+static unsigned int parse_tests(char *s)
+{
+    unsigned int tests = 0;
+    char *tok;
+
+    for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+        if (!strcmp(tok, "erase"))
+            tests |= TEST_ERASE;
+        else if (!strcmp(tok, "write"))
+            tests |= TEST_WRITE;
+        else if (!strcmp(tok, "seqread"))
+            tests |= TEST_SEQREAD;
+        else if (!strcmp(tok, "randread"))
+            tests |= TEST_RANDREAD;
+        else
+            printf("unknown test %s\n", tok);
+    }
+
+    return tests;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dev = "/dev/mtd3";
+    unsigned int tests = TEST_ERASE | TEST_WRITE | TEST_SEQREAD | TEST_RANDREAD;
+    unsigned int total;
+    int force = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:s:b:n:r:t:fv")) != -1) {
+        switch (c) {
+        case 'd': dev = optarg; break;
+        case 's': start_block = strtoul(optarg, NULL, 0); break;
+        case 'b': nblocks = strtoul(optarg, NULL, 0); break;
+        case 'n': rand_reads = strtoul(optarg, NULL, 0); break;
+        case 'r': seq_len = strtoul(optarg, NULL, 0); break;
+        case 't': tests = parse_tests(optarg); break;
+        case 'f': force = 1; break;
+        case 'v': verify = 1; break;
+        default:
+            printf("usage: %s [-d dev] [-s block] [-b blocks] [-n reads] "
+                   "[-r bytes] [-t erase,write,seqread,randread] [-f] [-v]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+
+    if ((tests & (TEST_ERASE | TEST_WRITE)) && !force) {
+        printf("erase/write tests destroy %s, add -f\n", dev);
+        return 1;
+    }
+
+    fd = open(dev, O_RDWR | O_SYNC);
+    if (fd < 0) {
+        printf("open %s failed: %s\n", dev, strerror(errno));
+        return 1;
+    }
+
+    if (ioctl(fd, MEMGETINFO, &info) != 0) {
+        printf("MEMGETINFO failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* 起始块超出分区时nblocks会下溢, 没有块时随机读会rand() % 0 */
+    total = info.size / info.erasesize;
+    if (start_block >= total) {
+        printf("start block %u out of range, %s has %u blocks\n",
+            start_block, dev, total);
+        close(fd);
+        return 1;
+    }
+    if (!nblocks || nblocks > total - start_block)
+        nblocks = total - start_block;
+    if (!seq_len || seq_len > info.erasesize || info.erasesize % seq_len ||
+        seq_len % info.writesize)
+        seq_len = info.erasesize;
+
+    printf("%s: size %u erasesize %u writesize %u, blocks %u-%u\n", dev,
+        info.size, info.erasesize, info.writesize, start_block,
+        start_block + nblocks - 1);
+
+    if (tests & TEST_ERASE)
+        test_erase();
+    if (tests & TEST_WRITE)
+        test_write();
+    if (tests & TEST_SEQREAD)
+        test_seqread();
+    if (tests & TEST_RANDREAD)
+        test_randread();
+
+    close(fd);
+    return 0;
+}
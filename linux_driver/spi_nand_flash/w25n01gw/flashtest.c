@@ -7,8 +7,13 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <errno.h>
 #include <mtd/mtd-user.h>
 
+#include "calib.h"
+#include "calstore.h"
+
 #define SPI_FLASH_COLUMN_SIZE (512)
 #define SPI_FLASH_PAGE_SIZE   (4 * SPI_FLASH_COLUMN_SIZE) // 2048B/page
 #define SPI_FLASH_BLOCK_SIZE  (64 * SPI_FLASH_PAGE_SIZE)  //64page
@@ -20,50 +25,6 @@ struct band{
     unsigned int band4;
 };
 
-struct calibration{
-    double          RadiometricCalibration1;
-    int             RadiometricCalibration2;
-    int             RadiometricCalibration3;
-
-    unsigned int    DarkRowValue1;
-    unsigned int    DarkRowValue2;
-    unsigned int    DarkRowValue3;
-    unsigned int    DarkRowValue4;
-
-    float           VignettingCenter1;
-    float           VignettingCenter2;
-
-    double          VignettingPolynomial0;
-    double          VignettingPolynomial1;
-    double          VignettingPolynomial2;
-    double          VignettingPolynomial3;
-
-    double          PerspectiveFocalLength;
-
-    double          PerspectiveDistortion1;
-    double          PerspectiveDistortion2;
-    double          PerspectiveDistortion3;
-    double          PerspectiveDistortion4;
-    double          PerspectiveDistortion5;
-
-    int             BootTimeStamp;
-
-    long            TimeStamp;
-
-    double          BandSensitivity;
-
-    double          RawMeasurement;
-
-    double          OffMeasurement;
-
-    int             BlackLevel;
-
-    double          PrincipalPoint1;
-    double          PrincipalPoint2;
-    double          RelativeOpticalCenterX;
-    double          RelativeOpticalCenterY;
-};
-
 struct message {
     struct band         stBand;
     struct calibration  stCalibration1;
@@ -72,45 +33,99 @@ struct message {
     struct calibration  stCalibration4;
 };
 
-int load_ini_file(const char *file, char *buf, int *buf_size) {
-	FILE *in = NULL;
-	int i = 0;
-	*buf_size = 0;
+/**
+ * 按块擦除整个分区, 跳过坏块和驱动保留的BBT块.
+ * 整片一次MEMERASE遇到坏块就会失败.
+ */
+int erase_flash(int fd)
+{
+    struct mtd_info_user info;
+    struct erase_info_user erase;
+    loff_t ofs;
+    int failed = 0;
+
+    if (ioctl(fd, MEMGETINFO, &info) != 0)
+        return -1;
+
+    erase.length = info.erasesize;
+    for (erase.start = 0; erase.start < info.size;
+         erase.start += info.erasesize) {
+        ofs = erase.start;
+        if (ioctl(fd, MEMGETBADBLOCK, &ofs) > 0)
+            continue;
+
+        if (ioctl(fd, MEMERASE, &erase) != 0) {
+            printf("erase block %u failed\n", erase.start / info.erasesize);
+            failed++;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+/* 把4个波段转成一条标定记录 */
+static void message_to_record(const struct message *msg,
+        struct calib_record *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->nbands = 4;
+    rec->band[0] = msg->stBand.band1;
+    rec->band[1] = msg->stBand.band2;
+    rec->band[2] = msg->stBand.band3;
+    rec->band[3] = msg->stBand.band4;
+    rec->cal[0] = msg->stCalibration1;
+    rec->cal[1] = msg->stCalibration2;
+    rec->cal[2] = msg->stCalibration3;
+    rec->cal[3] = msg->stCalibration4;
+}
 
-	in = fopen(file, "r");
-	if (NULL == in) {
-		return 0;
-	}
+/* 让w25n01gw_calib重新读取标定分区, 再从映射的记录中取一个波段 */
+static int read_calib_map(unsigned int band, struct calibration *cal)
+{
+    unsigned char *map;
+    int fd;
+    int ret;
 
-	buf[i] = fgetc(in);
+    fd = open("/dev/w25n_calib", O_RDWR);
+    if (fd < 0)
+        return -errno;
 
-	//load initialization file
-	while (buf[i] != (char) EOF) {
-		i++;
-		if (i >= (1024*9)) { //file too big, you can redefine MAX_FILE_SIZE to fit the big file
-			return -1;
-		}
-		buf[i] = fgetc(in);
-	}
+    if (write(fd, "1", 1) != 1) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
 
-	buf[i] = '\0';
-	*buf_size = i;
+    map = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
 
-	fclose(in);
-	return 1;
+    ret = calib_decode_band(map, getpagesize(), band, cal);
+    munmap(map, getpagesize());
+    return ret;
 }
 
 #if 1
-int main()
+/**
+ * flashtest [-e]
+ * 在/dev/mtd3的标定存储中更新标定记录并读回校验,
+ * -e先擦除整个分区(恢复出厂, 平时不需要)
+ */
+int main(int argc, char *argv[])
 {
-    int fd, fd1;
-    struct erase_info_user erase;
-    loff_t offset;
+    int fd;
     struct message stMessage;
-    char buf[SPI_FLASH_PAGE_SIZE * 3];
-    int bufCfgLen;
+    struct calib_record rec;
+    struct calstore cs;
+    struct calibration cal;
+    unsigned char *page;
+    unsigned int free_blocks;
+    uint32_t min_erase, max_erase;
+    int len;
+    int ret;
 
-    printf("sizeof = %d\n", sizeof(stMessage));
+    printf("sizeof = %d\n", (int)sizeof(stMessage));
 
     stMessage.stBand.band1 = 555;
     stMessage.stBand.band2 = 660;
@@ -264,50 +279,70 @@ int main()
     stMessage.stCalibration4.RelativeOpticalCenterX = 0.00000;
     stMessage.stCalibration4.RelativeOpticalCenterY = 0.00000;
 
-    fd = open("/dev/mtd3", O_SYNC | O_RDWR);
-    if(fd < 0) {
-        printf("file open failured!\n");
-    }
-
-    fd1 = open("/opt/dgp/app/calibrationDatatest.ini", O_SYNC | O_RDWR);
-    if(fd < 0) {
-        printf("calibrationDatatest file open failured!\n");
-    }
-
 #if 1
     //擦除
-    erase.start = 0;
-    erase.length = 1024 * SPI_FLASH_BLOCK_SIZE;
-
-    if (ioctl(fd, MEMERASE, &erase) != 0) //执行擦除操作
-    {
-        //fprintf(stderr, "\n%s: MTD Erase failure: %s\n", DevInfo->dir,strerror(errno));
-        printf("MTD Erase failure\n");
+    if (argc > 1 && !strcmp(argv[1], "-e")) {
+        fd = open("/dev/mtd3", O_SYNC | O_RDWR);
+        if(fd < 0) {
+            printf("file open failured!\n");
+            return 1;
+        }
+        if (erase_flash(fd) != 0) //执行擦除操作
+        {
+            printf("MTD Erase failure\n");
+        }
+        close(fd);
     }
 #endif
 
-#if 1
-    offset = 0;
-    lseek(fd, offset, SEEK_SET);
-
-    memcpy(buf, &stMessage.stBand, sizeof(stMessage.stBand));
-
-    load_ini_file("/opt/dgp/app/calibrationDatatest.ini",
-        buf + sizeof(stMessage.stBand), &bufCfgLen);
-
-    write(fd, buf, SPI_FLASH_PAGE_SIZE * 3);
-#endif
-
-#if 0
-    memset(buf, 0x0, SPI_FLASH_PAGE_SIZE * 3);
-
-    offset = 0;
-    lseek(fd, offset, SEEK_SET);
+    ret = calstore_open(&cs, "/dev/mtd3");
+    if (ret) {
+        printf("calstore open failed: %s\n", strerror(-ret));
+        return 1;
+    }
 
-    read(fd, buf, SPI_FLASH_PAGE_SIZE * 3);
-    memcpy(&stMessage, buf, sizeof(stMessage));
-    printf("band1 = %d.\n", stMessage.stBand.band1);
-#endif
+    //追加, 一次页编程, 不需要擦除
+    message_to_record(&stMessage, &rec);
+    page = malloc(calstore_max_value(&cs));
+    if (!page) {
+        calstore_close(&cs);
+        return 1;
+    }
+    len = calib_encode(&rec, page, calstore_max_value(&cs));
+    if (len < 0)
+        ret = len;
+    else
+        ret = calstore_put(&cs, CALSTORE_KEY_CALIB, page, len);
+    if (ret)
+        printf("calstore put failed: %s\n", strerror(-ret));
+
+    //按key读回, 一次页读
+    len = calstore_get(&cs, CALSTORE_KEY_CALIB, page, calstore_max_value(&cs));
+    if (len < 0)
+        ret = len;
+    else
+        ret = calib_decode_band(page, len, stMessage.stBand.band1, &cal);
+    if (ret)
+        printf("calib read failed: %s\n", strerror(-ret));
+    else
+        printf("band %u: BlackLevel = %d, VignettingPolynomial0 = %g\n",
+            stMessage.stBand.band1, cal.BlackLevel,
+            cal.VignettingPolynomial0);
+
+    //从内核缓存的记录读, 不经过flash
+    ret = read_calib_map(stMessage.stBand.band1, &cal);
+    if (ret)
+        printf("calib map failed: %s\n", strerror(-ret));
+    else
+        printf("mapped band %u: BlackLevel = %d\n",
+            stMessage.stBand.band1, cal.BlackLevel);
+
+    calstore_wear(&cs, &free_blocks, &min_erase, &max_erase);
+    printf("free blocks %u, erase count %u..%u\n",
+        free_blocks, min_erase, max_erase);
+
+    free(page);
+    calstore_close(&cs);
     return 0;
 }
 #else
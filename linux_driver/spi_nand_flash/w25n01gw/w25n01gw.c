@@ -9,6 +9,13 @@
 #include <asm/uaccess.h>
 #include <linux/timer.h>
 #include <linux/platform_device.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/crc32.h>
 
 #include <linux/gpio.h>
 
@@ -17,24 +24,258 @@
 #include <linux/mtd/partitions.h>
 #include <linux/spi/spi.h>
 #include <linux/device.h>
+#include <linux/of.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/dma-mapping.h>
 
-static unsigned bus_num = 2;
+#define CREATE_TRACE_POINTS
+#include "w25n01gw_trace.h"
+
+/* 没有设备树节点的旧板子用bus_num.csn指定芯片, -1表示只用设备树/板级信息 */
+static int bus_num = 2;
 static unsigned csn = 0;
-module_param(bus_num, uint, S_IRUGO);
-MODULE_PARM_DESC(bus_num, "spi bus number");
+module_param(bus_num, int, S_IRUGO);
+MODULE_PARM_DESC(bus_num, "spi bus number of a chip without DT node, -1 - none");
 module_param(csn, uint, S_IRUGO);
 MODULE_PARM_DESC(csn, "chip select number");
 
+/**
+ * 忙等待方式
+ * 0 - 每次休眠一个10ms tick(旧方式)
+ * 1 - 纯轮询状态寄存器
+ * 2 - 自适应: 按手册典型时间休眠, 再短轮询, 最后hrtimer退避
+ */
+#define W25N_WAIT_TICK      0
+#define W25N_WAIT_SPIN      1
+#define W25N_WAIT_ADAPTIVE  2
+static unsigned wait_mode = W25N_WAIT_ADAPTIVE;
+module_param(wait_mode, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wait_mode, "busy wait mode: 0 - 10ms tick, 1 - spin, 2 - adaptive");
+
+/* 页对齐且不少于stream_pages页的读使用连续读模式(BUF=0), 0关闭 */
+static unsigned stream_pages = 4;
+module_param(stream_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(stream_pages, "min pages for continuous read mode, 0 - disable");
+
+/* 驱动内页缓存的页数, 0关闭 */
+static unsigned cache_pages = 32;
+module_param(cache_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(cache_pages, "driver page cache size in pages, 0 - disable");
+
+/* 顺序读命中时一次预读的页数, 不超过cache_pages */
+static unsigned ra_pages = 8;
+module_param(ra_pages, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ra_pages, "read-ahead window in pages, 0/1 - disable");
+
+/* 芯片BBM LUT重映射用的备用块数(0-20), 0表示坏块只记入BBT. 已有BBT时以BBT为准 */
+static unsigned bbm_spares = 0;
+module_param(bbm_spares, uint, S_IRUGO);
+MODULE_PARM_DESC(bbm_spares, "spare blocks reserved for 0xA1 remapping, 0 - disable");
+
+/* 数据线宽度上限: 0 - 按控制器能力自动协商, 1 - 单线, 2 - 双线, 4 - 四线 */
+static unsigned io_width = 0;
+module_param(io_width, uint, S_IRUGO);
+MODULE_PARM_DESC(io_width, "max data lines: 0 - auto, 1 - single, 2 - dual, 4 - quad");
+
+/* 前stripe_chips个芯片条带化为一个mtd设备, 这些芯片不再单独注册, 0关闭 */
+static unsigned stripe_chips = 0;
+module_param(stripe_chips, uint, S_IRUGO);
+MODULE_PARM_DESC(stripe_chips, "chips combined into one striped mtd, 0 - disable");
+
 #define SPI_FLASH_COLUMN_SIZE (512)
 #define SPI_FLASH_PAGE_SIZE   (4 * SPI_FLASH_COLUMN_SIZE) // 2048B/page
 #define SPI_FLASH_BLOCK_SIZE  (64 * SPI_FLASH_PAGE_SIZE)  //64page
+#define SPI_FLASH_OOB_SIZE    (64)                        //spare区64B/page
+#define SPI_FLASH_PAGES_PER_BLOCK (SPI_FLASH_BLOCK_SIZE / SPI_FLASH_PAGE_SIZE)
+
+#define W25N_BLOCKS         1024
+
+/* 片上ECC: 每512B扇区最多纠正4bit */
+#define W25N_ECC_STEP       512
+#define W25N_ECC_STRENGTH   4
+
+/* 状态寄存器3(0xc0)的位定义 */
+#define W25N_SR3_BUSY   (1 << 0)
+#define W25N_SR3_WEL    (1 << 1)
+#define W25N_SR3_EFAIL  (1 << 2)
+#define W25N_SR3_PFAIL  (1 << 3)
+#define W25N_SR3_ECC(sr)    (((sr) >> 4) & 0x3)
+
+/* 状态寄存器2(0xb0)的位定义 */
+#define W25N_SR2_BUF    (1 << 3)
+#define W25N_SR2_ECCE   (1 << 4)
+
+/**
+ * 坏块表: 每块2bit, 存在最后W25N_BBT_BLOCKS块中的某一块的第0页,
+ * 带版本号和CRC, 启动时取版本最新且校验正确的一份
+ */
+#define W25N_BLOCK_GOOD     0
+#define W25N_BLOCK_WORN     1   /* 使用中变坏 */
+#define W25N_BLOCK_RESERVED 2   /* BBT块和重映射备用块 */
+#define W25N_BLOCK_FACTORY  3   /* 出厂坏块 */
+
+#define W25N_BBT_BLOCKS     4
+#define W25N_BBT_MAGIC      "W25B"
+#define W25N_LUT_ENTRIES    20  /* 芯片BBM LUT的条目数 */
+
+struct w25n_bbt_hdr {
+    char    magic[4];
+    __le32  version;
+    __le16  nblocks;
+    __le16  spares;
+    __le32  crc;        /* 覆盖其后的坏块表 */
+} __packed;
+
+/**
+ * 手册时间参数(us): 典型值, 最大值, 以及典型值之后的短轮询窗口.
+ * 典型值小于W25N_SLEEP_MIN_US的操作不休眠, 直接轮询.
+ */
+#define W25N_SLEEP_MIN_US   100
+static const struct {
+    const char     *name;
+    unsigned int    typ_us;
+    unsigned int    max_us;
+    unsigned int    poll_us;
+} w25n_timing[W25N_OP_NR] = {
+    [W25N_OP_READ]  = { "read",  25,   60,    60 },
+    [W25N_OP_LOAD]  = { "load",  0,    10,    10 },
+    [W25N_OP_PROG]  = { "prog",  250,  700,   50 },
+    [W25N_OP_ERASE] = { "erase", 2000, 10000, 50 },
+};
+
+/* 每种操作的忙等待延时直方图, 第i个桶统计[2^(i-1), 2^i) us */
+#define W25N_LAT_BUCKETS 16
+struct w25n_lat_hist {
+    u64 count;
+    u64 sum_us;
+    u64 max_us;
+    u64 bucket[W25N_LAT_BUCKETS];
+};
+static struct dentry *w25n_debugfs;
+
+/* 每种队列请求的计数, 通过debugfs的stats查看 */
+struct w25n_req_stats {
+    u64 count;
+    u64 bytes;
+    u64 errors;
+    u64 ns;
+};
+
+/* 驱动内页缓存, 按页地址查找, LRU替换 */
+struct w25n_cache_page {
+    int             page;       /* -1表示空闲 */
+    unsigned long   stamp;
+    int             bitflips;   /* 读入时纠正的位翻转数, 命中时返回 */
+    int             ecc_new;    /* 预读的页, 还没有计入ecc_stats */
+    unsigned char  *data;
+};
+
+#define W25N_RA_MAX 64
+
+/**
+ * 每个芯片的状态, probe时分配, 保存在spi_device的drvdata和mtd->priv中.
+ * 除统计外只在本芯片的工作线程和probe中访问
+*/
+struct w25n_chip {
+    struct spi_device  *spi;
+    struct mtd_info     mtd;
+    struct w25n_stripe *stripe;     /* 所属的条带, NULL表示单独注册了mtd */
+    char                name[32];   /* 设备树没有label时的mtd名字 */
+    unsigned char       reg2_val;   /* 状态寄存器2的缓存 */
+
+    /* probe时协商出的读/装载指令及数据线宽度 */
+    struct {
+        unsigned char read_op;      /* 0x03, 0x3b(双线输出), 0x6b(四线输出) */
+        unsigned char read_nbits;
+        unsigned char load_op;      /* 0x02, 0x32(四线装载) */
+        unsigned char load_nbits;
+    } io;
+
+    /* 芯片内部数据缓冲区中当前的页, -1表示未知 */
+    int                 buf_page;
+    int                 buf_bitflips;   /* 装载buf_page时纠正的位翻转数 */
+
+    /* 含spare区的整页缓冲, OOB读写和坏块标记使用 */
+    unsigned char      *page_buf;
+
+    /* 内存中的坏块表及其在flash上的位置 */
+    unsigned char       bbt[W25N_BLOCKS / 4];
+    unsigned int        bbt_block;
+    u32                 bbt_version;
+    unsigned int        bbt_spares;
+
+    /* 擦除后还没有编程过的块, 再次擦除时跳过. 上电时未知, 全部清零 */
+    DECLARE_BITMAP(blank_map, W25N_BLOCKS);
+
+    /* 芯片BBM LUT的镜像: 逻辑块 -> 物理块 */
+    struct {
+        u16 lba;
+        u16 pba;
+    } bbm_lut[W25N_LUT_ENTRIES];
 
-struct spi_master *hi_master;
-struct spi_device *hi_spi;
-static struct mtd_info spi_flash_dev;
+    struct w25n_cache_page *page_cache;
+    unsigned long       cache_clock;
+    unsigned int        ra_next;    /* 顺序读时期望的下一页 */
+
+    /* 预读用的传输描述, 避免占用过多内核栈 */
+    struct w25n_cache_page *ra_slot[W25N_RA_MAX];
+    struct spi_transfer ra_xfer[W25N_RA_MAX + 1];
+
+    /* 请求队列, 每个芯片一个有序工作队列, 不同芯片可以并行 */
+    struct workqueue_struct *wq;
+    struct work_struct  work;
+    spinlock_t          queue_lock;
+    struct list_head    read_queue;
+    struct list_head    write_queue;
+    u64                 queue_seq;
+    unsigned int        overtaken;  /* 读已连续越过写请求的次数 */
+    u64                 busy_ns;    /* 当前请求累计的忙等待时间 */
+
+    struct w25n_lat_hist lat_hist[W25N_OP_NR];
+    spinlock_t          lat_lock;
+    struct w25n_req_stats req_stats[W25N_REQ_NR];
+    spinlock_t          stats_lock;
+    u64                 stat_merged;        /* 合并进连续读的请求数 */
+    u64                 stat_overtaken;     /* 越过写/擦除先执行的读请求数 */
+    u64                 stat_erase_skipped; /* 已是空白而跳过的擦除 */
+    u64                 stat_bounced;       /* 经中转页复制的数据传输 */
+    struct dentry      *debugfs;
+
+    /**
+     * 热点指令预先构造好的spi_message, 每次只改地址和数据指针.
+     * 与dma中的指令缓冲一样只在本芯片的工作线程和probe中使用
+    */
+    struct spi_message  sr3_msg;            /* 0x05 0xc0 */
+    struct spi_transfer sr3_xfer[2];
+    struct spi_message  page_read_msg;      /* 0x13 */
+    struct spi_transfer page_read_xfer;
+    struct spi_message  read_msg;           /* 0x03/0x3b/0x6b + 数据 */
+    struct spi_transfer read_xfer[2];
+    struct spi_message  prog_msg;           /* 0x06, 0x02/0x32 + 数据, 0x10 */
+    struct spi_transfer prog_xfer[4];
+
+    /* 调用者的缓冲不能直接DMA时使用的中转页, 含spare区 */
+    unsigned char      *bounce;
+
+    /**
+     * 指令和状态字节, 与结构体其他成员不共用cacheline, 可以直接DMA.
+     * 接收的状态字节再单独占一个cacheline
+    */
+    struct {
+        unsigned char   we;
+        unsigned char   cmd[8];             /* 非热点指令 */
+        unsigned char   sr3_cmd[2];
+        unsigned char   page_read_cmd[4];
+        unsigned char   read_cmd[4];
+        unsigned char   load_cmd[3];
+        unsigned char   exec_cmd[4];
+        unsigned char   sr3 ____cacheline_aligned;
+    } dma ____cacheline_aligned;
+};
 
 /* 读出设备ID */
-void SPIFlashReadID(void)
+void SPIFlashReadID(struct w25n_chip *chip)
 {
     unsigned char tx_buf[2];
     unsigned char rx_buf[4];
@@ -42,7 +283,7 @@ void SPIFlashReadID(void)
     tx_buf[0] = 0x9f;
     tx_buf[1] = 0x00;
 
-    spi_write_then_read(hi_spi, tx_buf, 2, rx_buf, 4);
+    spi_write_then_read(chip->spi, tx_buf, 2, rx_buf, 4);
     printk("[0] = %02x...[1] = %02x...[2] = %02x\n",
         rx_buf[0], rx_buf[1], rx_buf[2]);
 }
@@ -50,7 +291,7 @@ void SPIFlashReadID(void)
 /**
  * 读状态寄存器
 */
-unsigned char readReg(unsigned char reg)
+unsigned char readReg(struct w25n_chip *chip, unsigned char reg)
 {
     unsigned char tx_buf[2];
     unsigned char rx_buf[1];
@@ -58,7 +299,7 @@ unsigned char readReg(unsigned char reg)
     tx_buf[0] = 0x05;
     tx_buf[1] = reg;
 
-    spi_write_then_read(hi_spi, tx_buf, 2, rx_buf, 1);
+    spi_write_then_read(chip->spi, tx_buf, 2, rx_buf, 1);
     //printk("val = %02x\n", rx_buf[0]);
 
     return rx_buf[0];
@@ -67,218 +308,683 @@ unsigned char readReg(unsigned char reg)
 /**
  * 写状态寄存器
 */
-void writeReg(unsigned char reg, unsigned char val)
+void writeReg(struct w25n_chip *chip, unsigned char reg, unsigned char val)
 {
-    unsigned char tx_bufl[3];
+    unsigned char *tx_bufl = chip->dma.cmd;
 
     tx_bufl[0] = 0x01;
     tx_bufl[1] = reg;
     tx_bufl[2] = val;
 
-    spi_write(hi_spi, tx_bufl, 3);
+    spi_write(chip->spi, tx_bufl, 3);
 }
 
-unsigned char SPIChangeReg3Buf(void)
+unsigned char SPIChangeReg3Buf(struct w25n_chip *chip)
 {
-    unsigned char tx_buf[2];
-    unsigned char rx_buf[1];
-    
-    tx_buf[0] = 0x05;
-    tx_buf[1] = 0xc0;
+    spi_sync(chip->spi, &chip->sr3_msg);
+    //printk("status reg3 = 0x%02x\n", chip->dma.sr3);
 
-    spi_write_then_read(hi_spi, tx_buf, 2, rx_buf, 1);
-    //printk("status reg3 = 0x%02x\n", rx_buf[0]);
+    return chip->dma.sr3;
+}
 
-    return rx_buf[0];
+static void w25n_lat_record(struct w25n_chip *chip, int op, s64 us)
+{
+    struct w25n_lat_hist *h = &chip->lat_hist[op];
+    unsigned long flags;
+    int i;
+
+    if (us < 0)
+        us = 0;
+    i = min_t(int, fls64(us), W25N_LAT_BUCKETS - 1);
+
+    spin_lock_irqsave(&chip->lat_lock, flags);
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+    h->bucket[i]++;
+    spin_unlock_irqrestore(&chip->lat_lock, flags);
 }
 
-static void SPIFlashWaitWhenBusy(void)
+/**
+ * 等待flash空闲, op决定使用的手册时间参数.
+ * 返回最后一次读到的状态寄存器3, 超时返回-ETIMEDOUT
+ */
+static int SPIFlashWaitWhenBusy(struct w25n_chip *chip, int op)
 {
-    while (SPIChangeReg3Buf() & 1)
-    {
-        //printk("flash is busy! reg3 = 0x%02x\n", SPIChangeReg3Buf());
+    unsigned int typ = w25n_timing[op].typ_us;
+    unsigned int max = w25n_timing[op].max_us;
+    unsigned int delay_us;
+    ktime_t start, deadline, poll_end, elapsed;
+    unsigned char sr;
+    int ret = 0;
+
+    start = ktime_get();
+    /* 超过手册最大值4倍仍忙认为器件异常 */
+    deadline = ktime_add_us(start, max * 4 + 1000);
+
+    sr = SPIChangeReg3Buf(chip);
+    if (!(sr & W25N_SR3_BUSY))
+        goto out;
+
+    switch (wait_mode) {
+    case W25N_WAIT_TICK:
+        while ((sr = SPIChangeReg3Buf(chip)) & W25N_SR3_BUSY) {
+            if (ktime_after(ktime_get(), deadline)) {
+                ret = -ETIMEDOUT;
+                break;
+            }
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_timeout(HZ/100);  /* 休眠10MS后再次判断 */
+        }
+        break;
+
+    case W25N_WAIT_SPIN:
+        while ((sr = SPIChangeReg3Buf(chip)) & W25N_SR3_BUSY) {
+            if (ktime_after(ktime_get(), deadline)) {
+                ret = -ETIMEDOUT;
+                break;
+            }
+            cpu_relax();
+        }
+        break;
+
+    default:
+        /* 1. 先休眠到典型时间附近 */
+        if (typ >= W25N_SLEEP_MIN_US)
+            usleep_range(typ * 3 / 4, typ);
 
-        set_current_state(TASK_INTERRUPTIBLE);
-        schedule_timeout(HZ/100);  /* 休眠10MS后再次判断 */
+        /* 2. 典型时间附近短轮询 */
+        poll_end = ktime_add_us(ktime_get(), w25n_timing[op].poll_us);
+        while ((sr = SPIChangeReg3Buf(chip)) & W25N_SR3_BUSY) {
+            if (ktime_after(ktime_get(), poll_end))
+                break;
+            cpu_relax();
+        }
+
+        /* 3. 仍忙则用hrtimer指数退避, 上限为最大时间的1/8 */
+        delay_us = max_t(unsigned int, w25n_timing[op].poll_us, 10);
+        while (sr & W25N_SR3_BUSY) {
+            if (ktime_after(ktime_get(), deadline)) {
+                ret = -ETIMEDOUT;
+                break;
+            }
+            usleep_range(delay_us, delay_us * 2);
+            delay_us = min_t(unsigned int, delay_us * 2,
+                             max_t(unsigned int, max / 8, 10));
+            sr = SPIChangeReg3Buf(chip);
+        }
+        break;
     }
+
+    if (ret)
+        printk("[%s]%s timeout, reg3 = 0x%02x\n", __func__,
+            w25n_timing[op].name, sr);
+
+out:
+    elapsed = ktime_sub(ktime_get(), start);
+    w25n_lat_record(chip, op, ktime_to_us(elapsed));
+    chip->busy_ns += ktime_to_ns(elapsed);
+    trace_w25n_wait(op, ktime_to_us(elapsed), sr, ret);
+    return ret ? ret : sr;
 }
 
-static void SPIFlashWriteEnable(int enable)
+static void SPIFlashWriteEnable(struct w25n_chip *chip, int enable)
 {
-    unsigned char val = enable ? 0x06 : 0x04;
-    spi_write(hi_spi, &val, 1);
+    chip->dma.we = enable ? 0x06 : 0x04;
+    spi_write(chip->spi, &chip->dma.we, 1);
 }
 
-void SPIFlashEraseSector(unsigned int addr)
+int SPIFlashEraseSector(struct w25n_chip *chip, unsigned int addr)
 {
-    unsigned char tx_buf[4];
+    unsigned char *tx_buf = chip->dma.cmd;
+    int ret;
+
     tx_buf[0] = 0xd8;
     tx_buf[1] = 0x00;
     tx_buf[2] = addr >> 8;
     tx_buf[3] = addr & 0xff;
 
-    SPIFlashWriteEnable(1);
+    SPIFlashWriteEnable(chip, 1);
+
+    spi_write(chip->spi, tx_buf, 4);
+
+    ret = SPIFlashWaitWhenBusy(chip, W25N_OP_ERASE);
+    if (ret < 0)
+        return ret;
+    if (ret & W25N_SR3_EFAIL)
+        return -EIO;
 
-    spi_write(hi_spi, tx_buf, 4);
+    set_bit(addr / SPI_FLASH_PAGES_PER_BLOCK, chip->blank_map);
+    return 0;
+}
 
-    SPIFlashWaitWhenBusy();
+/**
+ * 解析状态寄存器3的ECC位, 返回纠正的位翻转数或-EBADMSG.
+ * 芯片不报告具体纠正了几位, 有纠正时按最大纠错能力上报,
+ * 让UBI等上层尽快搬移数据.
+*/
+static int w25n_ecc_decode(unsigned char sr)
+{
+    switch (W25N_SR3_ECC(sr)) {
+    case 0:
+        return 0;
+    case 1:
+        return W25N_ECC_STRENGTH;
+    default:
+        /* 2 - 单页不可纠正, 3 - 连续读时多页不可纠正 */
+        return -EBADMSG;
+    }
 }
 
-static int my_flash_erase(struct mtd_info *mtd, struct erase_info *instr)
+/**
+ * 把读请求页的ECC结果计入ecc_stats, 原样返回ret.
+ * 连续读在SPI完成回调中计入, 与工作线程并发, 用stats_lock保护
+ */
+static int w25n_ecc_account(struct w25n_chip *chip, int ret)
 {
-    unsigned int addr_start = instr->addr / SPI_FLASH_BLOCK_SIZE;
-    unsigned int addr_end;
-    unsigned int addr = instr->addr;
-    int i = 0;
+    unsigned long flags;
 
-    printk("***************************erase!\n");
+    if (ret != -EBADMSG && ret <= 0)
+        return ret;
 
-    if ((addr % SPI_FLASH_PAGE_SIZE) || (instr->len % SPI_FLASH_PAGE_SIZE))
-    {
-        printk("[%s]addr/len is not aligned\n", __func__);
-        return -EINVAL;
-    }
-    
-    addr_end = instr->len / SPI_FLASH_PAGE_SIZE;
-    addr = addr_start;
-    for (i = 0; i < addr_end; i++)
-    {
-        printk("erase %d page!\n", i);
-        SPIFlashEraseSector(addr);
-        addr += SPI_FLASH_PAGE_SIZE * i;
+    spin_lock_irqsave(&chip->stats_lock, flags);
+    if (ret == -EBADMSG)
+        chip->mtd.ecc_stats.failed++;
+    else
+        chip->mtd.ecc_stats.corrected += ret;
+    spin_unlock_irqrestore(&chip->stats_lock, flags);
+
+    return ret;
+}
+
+/* 同SPIFlashPageRead, 但不计入ecc_stats, 预读的页由调用者决定何时计入 */
+static int __SPIFlashPageRead(struct w25n_chip *chip, unsigned int addr)
+{
+    int ret;
+
+    chip->dma.page_read_cmd[2] = addr >> 8;
+    chip->dma.page_read_cmd[3] = addr & 0xff;
+    spi_sync(chip->spi, &chip->page_read_msg);
+
+    ret = SPIFlashWaitWhenBusy(chip, W25N_OP_READ);
+    if (ret < 0)
+        return ret;
+
+    return w25n_ecc_decode(ret);
+}
+
+/**
+ * 页数据读到芯片缓冲区, 返回纠正的位翻转数或错误码
+*/
+int SPIFlashPageRead(struct w25n_chip *chip, unsigned int addr)
+{
+    return w25n_ecc_account(chip, __SPIFlashPageRead(chip, addr));
+}
+
+/**
+ * 调用者的缓冲能否直接交给控制器DMA: 不在栈上; 接收时首尾还要按
+ * cacheline对齐, 否则无效化cache会破坏同一行里的相邻数据.
+ * vmalloc的缓冲由SPI核心按页映射
+*/
+static int w25n_dma_safe(const void *buf, size_t len, int rx)
+{
+    if (object_is_on_stack(buf))
+        return 0;
+
+    return !rx ||
+           !(((unsigned long)buf | len) & (dma_get_cache_alignment() - 1));
+}
+
+void SPIFlashRead(struct w25n_chip *chip,
+        unsigned int addr, unsigned char *buf, int len)
+{
+    int direct = w25n_dma_safe(buf, len, 1);
+
+    chip->dma.read_cmd[1] = addr >> 8;
+    chip->dma.read_cmd[2] = addr & 0xff;
+    chip->read_xfer[1].rx_buf = direct ? buf : chip->bounce;
+    chip->read_xfer[1].len = len;
+    spi_sync(chip->spi, &chip->read_msg);
+
+    if (!direct) {
+        memcpy(buf, chip->bounce, len);
+        chip->stat_bounced++;
     }
-    
-    instr->state = MTD_ERASE_DONE;
-    mtd_erase_callback(instr);
+}
 
-    return (((readReg(0xc0) >> 2) & 0x1) == 0 ? 0 : -1);
+/**
+ * 切换缓冲读模式(BUF=1)和连续读模式(BUF=0)
+*/
+static void SPIFlashSetBufMode(struct w25n_chip *chip, int buf)
+{
+    unsigned char val = buf ? (chip->reg2_val | W25N_SR2_BUF) :
+                              (chip->reg2_val & ~W25N_SR2_BUF);
+
+    if (val == chip->reg2_val)
+        return;
+
+    writeReg(chip, 0xb0, val);
+    chip->reg2_val = val;
 }
 
-void SPIFlashPageRead(unsigned int addr)
+/**
+ * 打开/关闭片上ECC, 只有原始(MTD_OPS_RAW)读写时关闭
+*/
+static void SPIFlashSetEcc(struct w25n_chip *chip, int on)
 {
-    unsigned char tx_buf[4];
-    tx_buf[0] = 0x13;
-    tx_buf[1] = 0x00;
-    tx_buf[2] = addr >> 8;
-    tx_buf[3] = addr & 0xff;
+    unsigned char val = on ? (chip->reg2_val | W25N_SR2_ECCE) :
+                             (chip->reg2_val & ~W25N_SR2_ECCE);
 
-    spi_write(hi_spi, tx_buf, 4);
+    if (val == chip->reg2_val)
+        return;
 
-    SPIFlashWaitWhenBusy();
+    writeReg(chip, 0xb0, val);
+    chip->reg2_val = val;
+    chip->buf_page = -1;
 }
 
-void SPIFlashRead(unsigned int addr, unsigned char *buf, int len)
+/**
+ * 连续读: 从page开始读出, t[0]留给指令, t[1..n-1]由调用者填好rx.
+ * BUF=0时0x03后跟3个dummy字节, 0x3b/0x6b后跟4个dummy字节,
+ * 芯片在内部自动装载下一页, 整个过程是一个spi_message, 片选一直有效.
+ * 返回所有页汇总的ECC结果, account为0时不计入ecc_stats(预读)
+*/
+static int SPIFlashStreamRead(struct w25n_chip *chip,
+        unsigned int page, struct spi_transfer *t, int n, int account)
 {
-    unsigned char tx_buf[4];   
-    struct spi_transfer	t[] = {
-            {
-                .tx_buf		= tx_buf,
-                .len		= 4,
-            },
-            {
-                .rx_buf		= buf,
-                .len		= len,
-            },
-        };
-    struct spi_message	m;
+    unsigned char *tx_buf = chip->dma.cmd;
+    struct spi_message m;
+    int first;
+    int i;
+    int ret;
 
-    tx_buf[0] = 0x03;
-    tx_buf[1] = addr >> 8;
-    tx_buf[2] = addr & 0xff;
-    tx_buf[3] = 0x00;
+    SPIFlashSetBufMode(chip, 0);
+
+    /* 装载第一页, 之后的页在读出时由芯片流水装载 */
+    first = __SPIFlashPageRead(chip, page);
+    if (first < 0 && first != -EBADMSG) {
+        SPIFlashSetBufMode(chip, 1);
+        return first;
+    }
+
+    memset(tx_buf, 0, 5);
+    tx_buf[0] = chip->io.read_op;
 
     spi_message_init(&m);
-    spi_message_add_tail(&t[0], &m);
-    spi_message_add_tail(&t[1], &m);
-    spi_sync(hi_spi, &m);
+    t[0].tx_buf = tx_buf;
+    t[0].len = (chip->io.read_op == 0x03) ? 4 : 5;
+    for (i = 0; i < n; i++) {
+        if (i)
+            t[i].rx_nbits = chip->io.read_nbits;
+        spi_message_add_tail(&t[i], &m);
+    }
+    ret = spi_sync(chip->spi, &m);
+
+    /* 片选无效后连续读结束, ECC位汇总了本次读出的所有页 */
+    if (!ret) {
+        ret = w25n_ecc_decode(SPIChangeReg3Buf(chip));
+        if (ret >= 0)
+            ret = (first < 0) ? first : max(ret, first);
+        if (account)
+            w25n_ecc_account(chip, ret);
+    }
+
+    /* 恢复缓冲读模式, 缓冲区内容已不确定 */
+    SPIFlashSetBufMode(chip, 1);
+    chip->buf_page = -1;
 
-    SPIFlashWaitWhenBusy();
+    return ret;
 }
 
-static int my_flash_read(struct mtd_info *mtd, loff_t from, size_t len,
-        size_t *retlen, u_char *buf)
+/**
+ * 连续读len字节(页的整数倍)到线性缓冲区, 只按控制器的最大传输长度切分
+*/
+static int SPIFlashContinuousRead(struct w25n_chip *chip,
+        unsigned int page, unsigned char *buf,
+        size_t len)
 {
-    unsigned int addr = from;
-    unsigned int addr_page = 0;
-    unsigned int rlen = 0;
-    int i = 0;
+    struct spi_transfer *t;
+    size_t max_len = spi_max_transfer_size(chip->spi);
+    size_t chunk;
+    int n, i;
+    int ret;
 
-    if ((addr % SPI_FLASH_PAGE_SIZE) || (len % SPI_FLASH_PAGE_SIZE))
-    {
-        printk("[%s]addr/len is not aligned\n", __func__);
-        return -EINVAL;
+    n = DIV_ROUND_UP(len, max_len) + 1;
+    t = kcalloc(n, sizeof(*t), GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+
+    for (i = 1; i < n; i++) {
+        chunk = min(len, max_len);
+        t[i].rx_buf = buf;
+        t[i].len = chunk;
+        buf += chunk;
+        len -= chunk;
     }
+    ret = SPIFlashStreamRead(chip, page, t, n, 1);
 
-    addr_page = addr / SPI_FLASH_PAGE_SIZE;
-    rlen = len / SPI_FLASH_PAGE_SIZE;
+    kfree(t);
+    return ret;
+}
 
-    for (i = 0; i < rlen; i++) {
-        printk("page = %d\n", addr_page);
-        SPIFlashPageRead(addr_page);
-        addr_page += 1;
+/**
+ * 把页装入芯片数据缓冲区, 已在缓冲区中则省掉0x13和tRD.
+ * 返回纠正的位翻转数或错误码, ECC失败的页不记为已缓冲.
+ * 已缓冲时返回装载时的位翻转数, ecc_stats只在装载时计入一次
+*/
+static int SPIFlashLoadPage(struct w25n_chip *chip, unsigned int page)
+{
+    int ret;
 
-        SPIFlashRead(0x0, buf, SPI_FLASH_PAGE_SIZE);
-        printk("1 = %d\n", buf[1]);
-        buf += SPI_FLASH_PAGE_SIZE;
+    if (chip->buf_page == page)
+        return chip->buf_bitflips;
+
+    ret = SPIFlashPageRead(chip, page);
+    chip->buf_page = (ret >= 0) ? page : -1;
+    chip->buf_bitflips = max(ret, 0);
+
+    return ret;
+}
+
+static struct w25n_cache_page *w25n_cache_lookup(struct w25n_chip *chip,
+        unsigned int page)
+{
+    int i;
+
+    for (i = 0; i < cache_pages; i++) {
+        if (chip->page_cache[i].page == page) {
+            chip->page_cache[i].stamp = ++chip->cache_clock;
+            return &chip->page_cache[i];
+        }
     }
 
-    *retlen = len;
-    return 0;
+    return NULL;
+}
+
+/* 取一个缓存页用于存放page, 已缓存则复用原来的位置, 否则替换最久未用的 */
+static struct w25n_cache_page *w25n_cache_victim(struct w25n_chip *chip,
+        unsigned int page)
+{
+    struct w25n_cache_page *victim = w25n_cache_lookup(chip, page);
+    int i;
+
+    if (!victim) {
+        victim = &chip->page_cache[0];
+        for (i = 1; i < cache_pages; i++) {
+            if (chip->page_cache[i].stamp < victim->stamp)
+                victim = &chip->page_cache[i];
+        }
+    }
+
+    victim->page = -1;
+    victim->stamp = ++chip->cache_clock;
+    return victim;
+}
+
+static void w25n_cache_invalidate(struct w25n_chip *chip,
+        unsigned int page, unsigned int count)
+{
+    int i;
+
+    if (!chip->page_cache)
+        return;
+
+    for (i = 0; i < cache_pages; i++) {
+        if (chip->page_cache[i].page >= 0 &&
+            chip->page_cache[i].page - page < count)
+            chip->page_cache[i].page = -1;
+    }
+}
+
+/**
+ * 缓存未命中时从flash读入page, 成功时*cpp指向该页的缓存, 返回位翻转数.
+ * 访问是顺序的(page == ra_next)时用连续读一次预读ra_pages页,
+ * 芯片装载下一页与SPI读出当前页重叠进行.
+ * 连续读只报告所有页汇总的ECC结果, 有纠正时每页都按纠正记录, 让上层
+ * 搬移; 预读的页第一次被读到时才计入ecc_stats. 有页不可纠正时都不缓存,
+ * 由调用者单独读请求的页.
+*/
+static int w25n_cache_fill(struct w25n_chip *chip,
+        unsigned int page, struct w25n_cache_page **cpp)
+{
+    struct w25n_cache_page **slot = chip->ra_slot;
+    struct spi_transfer *t = chip->ra_xfer;
+    unsigned int total = chip->mtd.size / SPI_FLASH_PAGE_SIZE;
+    unsigned int n = 1;
+    int ret;
+    int i;
+
+    if (page == chip->ra_next && ra_pages > 1 &&
+        spi_max_transfer_size(chip->spi) >= SPI_FLASH_PAGE_SIZE)
+        n = min3(ra_pages, cache_pages, (unsigned int)W25N_RA_MAX);
+    n = min(n, total - page);
+
+    for (i = 0; i < n; i++)
+        slot[i] = w25n_cache_victim(chip, page + i);
+
+    if (n > 1) {
+        memset(t, 0, sizeof(t[0]) * (n + 1));
+        for (i = 0; i < n; i++) {
+            t[i + 1].rx_buf = slot[i]->data;
+            t[i + 1].len = SPI_FLASH_PAGE_SIZE;
+        }
+        ret = SPIFlashStreamRead(chip, page, t, n + 1, 0);
+        if (ret < 0)
+            return ret;
+        for (i = 0; i < n; i++)
+            slot[i]->ecc_new = 1;
+    } else if (chip->buf_page == page) {
+        /* 已在芯片缓冲区, 装载时已计入ecc_stats */
+        ret = chip->buf_bitflips;
+        SPIFlashRead(chip, 0, slot[0]->data, SPI_FLASH_PAGE_SIZE);
+        slot[0]->ecc_new = 0;
+    } else {
+        /* 失败时由调用者单独重读并计入, 这里不计 */
+        ret = __SPIFlashPageRead(chip, page);
+        chip->buf_page = (ret >= 0) ? page : -1;
+        chip->buf_bitflips = max(ret, 0);
+        if (ret < 0)
+            return ret;
+        SPIFlashRead(chip, 0, slot[0]->data, SPI_FLASH_PAGE_SIZE);
+        slot[0]->ecc_new = 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        slot[i]->page = page + i;
+        slot[i]->bitflips = ret;
+    }
+    chip->ra_next = page + n;
+
+    *cpp = slot[0];
+    return ret;
+}
+
+/**
+ * 读页内column开始的len字节, 返回纠正的位翻转数或错误码
+*/
+static int w25n_read_page(struct w25n_chip *chip,
+        unsigned int page, unsigned int column,
+        u_char *buf, size_t len)
+{
+    struct w25n_cache_page *cp = NULL;
+    int ret = 0;
+
+    if (chip->page_cache) {
+        cp = w25n_cache_lookup(chip, page);
+        /* 预读中有页ECC失败时不缓存, 下面单独读这一页以准确上报 */
+        if (!cp && w25n_cache_fill(chip, page, &cp) < 0)
+            cp = NULL;
+        if (cp) {
+            memcpy(buf, cp->data + column, len);
+            if (cp->ecc_new) {
+                w25n_ecc_account(chip, cp->bitflips);
+                cp->ecc_new = 0;
+            }
+            return cp->bitflips;
+        }
+    }
+
+    ret = SPIFlashLoadPage(chip, page);
+    if (ret >= 0 || ret == -EBADMSG)
+        SPIFlashRead(chip, column, buf, len);
+
+    return ret;
+}
+
+static int do_flash_read(struct mtd_info *mtd, loff_t from, size_t len,
+        size_t *retlen, u_char *buf)
+{
+    struct w25n_chip *chip = mtd->priv;
+    unsigned int page, column;
+    unsigned int max_bitflips = 0;
+    int ecc_failed = 0;
+    size_t rlen;
+    int ret = 0;
+
+    *retlen = 0;
+    while (len) {
+        page = from / SPI_FLASH_PAGE_SIZE;
+        column = from % SPI_FLASH_PAGE_SIZE;
+
+        if (!column && stream_pages &&
+            len >= stream_pages * SPI_FLASH_PAGE_SIZE &&
+            w25n_dma_safe(buf, round_down(len, SPI_FLASH_PAGE_SIZE), 1)) {
+            /* 大块顺序读走连续读模式, 不经过页缓存 */
+            rlen = round_down(len, SPI_FLASH_PAGE_SIZE);
+            ret = SPIFlashContinuousRead(chip, page, buf, rlen);
+            chip->ra_next = page + rlen / SPI_FLASH_PAGE_SIZE;
+        } else {
+            /* 短读或不对齐的读走页缓存/缓冲模式, 按列地址取页内数据 */
+            rlen = min_t(size_t, len, SPI_FLASH_PAGE_SIZE - column);
+            ret = w25n_read_page(chip, page, column, buf, rlen);
+        }
+
+        /* ECC失败时继续读完, 最后返回-EBADMSG */
+        if (ret == -EBADMSG)
+            ecc_failed = 1;
+        else if (ret < 0)
+            break;
+        else
+            max_bitflips = max_t(unsigned int, max_bitflips, ret);
+        ret = 0;
+
+        from += rlen;
+        buf += rlen;
+        len -= rlen;
+        *retlen += rlen;
+    }
+
+    if (ret)
+        return ret;
+    return ecc_failed ? -EBADMSG : max_bitflips;
 }
 
-void SPIFlashProgram(unsigned int addr, unsigned char *buf, int len)
+/**
+ * 写使能和装载放在同一个spi_message中, 用cs_change分隔.
+ * 装载不置BUSY, 之后不需要等待
+*/
+void SPIFlashProgram(struct w25n_chip *chip,
+        unsigned int addr, unsigned char *buf, int len)
 {
-    unsigned char tx_buf[3];   
+    unsigned char *tx_buf = chip->dma.cmd;
     struct spi_transfer	t[] = {
+            {
+                .tx_buf		= &chip->dma.we,
+                .len		= 1,
+                .cs_change	= 1,
+            },
             {
                 .tx_buf		= tx_buf,
                 .len		= 3,
             },
             {
                 .tx_buf		= buf,
-                .len		= 2112,
+                .len		= len,
+                .tx_nbits	= chip->io.load_nbits,
             },
         };
     struct spi_message	m;
 
-    tx_buf[0] = 0x02;
+    chip->dma.we = 0x06;
+    tx_buf[0] = chip->io.load_op;
     tx_buf[1] = addr >> 8;
     tx_buf[2] = addr & 0xff;
 
-    SPIFlashWriteEnable(1);
-
     spi_message_init(&m);
     spi_message_add_tail(&t[0], &m);
     spi_message_add_tail(&t[1], &m);
-    spi_sync(hi_spi, &m);
-
-    SPIFlashWaitWhenBusy();
+    spi_message_add_tail(&t[2], &m);
+    spi_sync(chip->spi, &m);
 }
 
-void SPIFlashProgramExecute(unsigned int addr)
+int SPIFlashProgramExecute(struct w25n_chip *chip, unsigned int addr)
 {
-    unsigned char tx_buf[4];
+    unsigned char *tx_buf = chip->dma.cmd;
+    int ret;
 
     tx_buf[0] = 0x10;
     tx_buf[1] = 0x00;
     tx_buf[2] = addr >> 8;
     tx_buf[3] = addr & 0xff;
 
-    spi_write(hi_spi, tx_buf, 4);
+    /* 编程失败时块内容也已改变 */
+    clear_bit(addr / SPI_FLASH_PAGES_PER_BLOCK, chip->blank_map);
+    spi_write(chip->spi, tx_buf, 4);
+
+    ret = SPIFlashWaitWhenBusy(chip, W25N_OP_PROG);
+    if (ret < 0)
+        return ret;
 
-    SPIFlashWaitWhenBusy();
+    return (ret & W25N_SR3_PFAIL) ? -EIO : 0;
 }
 
-static int my_flash_write(struct mtd_info *mtd, loff_t to, size_t len,
+/**
+ * 编程一整页: 写使能, 装载和0x10在同一个spi_message中, 每页只有一次
+ * 同步传输加上tPP的忙等待.
+ * W25N01GW没有cache program, tPP期间数据缓冲区不可用,
+ * 同一芯片上无法在编程时装载下一页, 并行只能靠条带化的多个芯片
+*/
+static int SPIFlashProgramPage(struct w25n_chip *chip,
+        unsigned int page, const unsigned char *buf)
+{
+    int ret;
+
+    if (!w25n_dma_safe(buf, SPI_FLASH_PAGE_SIZE, 0)) {
+        memcpy(chip->bounce, buf, SPI_FLASH_PAGE_SIZE);
+        buf = chip->bounce;
+        chip->stat_bounced++;
+    }
+
+    chip->dma.we = 0x06;
+    chip->dma.exec_cmd[2] = page >> 8;
+    chip->dma.exec_cmd[3] = page & 0xff;
+    chip->prog_xfer[2].tx_buf = buf;
+
+    /* 编程失败时块内容也已改变 */
+    clear_bit(page / SPI_FLASH_PAGES_PER_BLOCK, chip->blank_map);
+    ret = spi_sync(chip->spi, &chip->prog_msg);
+    if (ret)
+        return ret;
+
+    ret = SPIFlashWaitWhenBusy(chip, W25N_OP_PROG);
+    if (ret < 0)
+        return ret;
+
+    return (ret & W25N_SR3_PFAIL) ? -EIO : 0;
+}
+
+static int do_flash_write(struct mtd_info *mtd, loff_t to, size_t len,
         size_t *retlen, const u_char *buf)
 {
+    struct w25n_chip *chip = mtd->priv;
     unsigned int addr = to;
     unsigned int wlen  = 0;
     unsigned int addr_page = 0;
+    int ret = 0;
     int i = 0;
 #if 1
     /* 判断参数 */
-    printk("addr = %d.len = %d\n", addr, len);
     if ((addr % SPI_FLASH_PAGE_SIZE) || (len % SPI_FLASH_PAGE_SIZE))
     {
         printk("[%s]addr/len is not aligned\n", __func__);
@@ -288,81 +994,2025 @@ static int my_flash_write(struct mtd_info *mtd, loff_t to, size_t len,
     addr_page = addr / SPI_FLASH_PAGE_SIZE;
     wlen = len / SPI_FLASH_PAGE_SIZE;
 
+    /* 装载编程数据会覆盖芯片数据缓冲区 */
+    chip->buf_page = -1;
+    w25n_cache_invalidate(chip, addr_page, wlen);
+
     for (i = 0; i < wlen; i++)
     {
-        SPIFlashProgram(0x00, (unsigned char *)buf, SPI_FLASH_PAGE_SIZE); 
-        printk("1 = %d. 5 = %d\n", buf[1], buf[5]);
+        ret = SPIFlashProgramPage(chip, addr_page, buf);
+        if (ret)
+            break;
         buf += SPI_FLASH_PAGE_SIZE;
-
-        SPIFlashProgramExecute(addr_page);
         addr_page += 1;
     }
 
-    *retlen = len;
-    return (((readReg(0xc0) >> 3) & 0x1) == 0 ? 0 : -1);
+    *retlen = i * SPI_FLASH_PAGE_SIZE;
+    return ret;
 }
 
-static int __init w25n01gw_init(void)
+/**
+ * spare区布局(ECC-E=1): 4个16字节的段, 每段
+ * 0-1 坏块标记(第0段)/用户数据, 2-7 用户数据(4-7受ECC保护), 8-15 ECC
+*/
+static int w25n_ooblayout_ecc(struct mtd_info *mtd, int section,
+        struct mtd_oob_region *region)
 {
-    int status = 0;
-    struct device *d;
-    char spi_name[12];
+    if (section > 3)
+        return -ERANGE;
 
-    hi_master = spi_busnum_to_master(bus_num);
-    if(hi_master) {
-        sprintf(spi_name, "%s.%u", dev_name(&hi_master->dev), csn);
-        printk("spi_name = %s\n", spi_name);
-        d = bus_find_device_by_name(&spi_bus_type, NULL, spi_name);
-        if(d == NULL) {
-            status = -ENXIO;
-            goto end0;
-        }
+    region->offset = 16 * section + 8;
+    region->length = 8;
 
-        hi_spi = to_spi_device(d);
-        if(hi_spi == NULL) {
-            status = -ENXIO;
-            goto end1;
-        }
-    } else {
-        status = -ENXIO;
-        goto end0;
-    }
-    status = 0;
+    return 0;
+}
 
-    SPIFlashReadID();
-    //SPIChangeReg1Buf();
-    //SPIChangeBuf();
-    writeReg(0xa0, 0x00);
-    //readReg(0xa0);
-    //readReg(0xb0);
-    //readReg(0xc0);
+static int w25n_ooblayout_free(struct mtd_info *mtd, int section,
+        struct mtd_oob_region *region)
+{
+    if (section > 3)
+        return -ERANGE;
 
-    //构造mtd_info
-    memset(&spi_flash_dev, 0, sizeof(spi_flash_dev));
-    spi_flash_dev.name = "yusense_spi_flash";
-    spi_flash_dev.type = MTD_NANDFLASH;
-    spi_flash_dev.flags = MTD_CAP_NANDFLASH;
-    spi_flash_dev.size = 0x8000000;  /* 128M */
-    spi_flash_dev.writesize = SPI_FLASH_PAGE_SIZE;
-    spi_flash_dev.writebufsize = SPI_FLASH_PAGE_SIZE;
-    spi_flash_dev.erasesize = 1024 * SPI_FLASH_BLOCK_SIZE;
-
-    spi_flash_dev.owner = THIS_MODULE;
-    spi_flash_dev._erase = my_flash_erase;
-    spi_flash_dev._read  = my_flash_read;
-    spi_flash_dev._write = my_flash_write;
-
-    mtd_device_register(&spi_flash_dev, NULL, 0);
-
-end1:
-    put_device(d);
-    
-end0:
-    return status;
+    region->offset = 16 * section + 2;
+    region->length = 6;
+
+    return 0;
 }
-static void __exit w25n01gw_exit(void)
+
+static const struct mtd_ooblayout_ops w25n_ooblayout = {
+    .ecc    = w25n_ooblayout_ecc,
+    .free   = w25n_ooblayout_free,
+};
+
+static int do_flash_read_oob(struct mtd_info *mtd, loff_t from,
+        struct mtd_oob_ops *ops)
 {
-    
+    struct w25n_chip *chip = mtd->priv;
+    unsigned int page = from / SPI_FLASH_PAGE_SIZE;
+    unsigned int column = from % SPI_FLASH_PAGE_SIZE;
+    unsigned int oobsize = (ops->mode == MTD_OPS_AUTO_OOB) ?
+                           mtd->oobavail : mtd->oobsize;
+    size_t len = ops->datbuf ? ops->len : 0;
+    size_t ooblen = ops->oobbuf ? ops->ooblen : 0;
+    unsigned int max_bitflips = 0;
+    int ecc_failed = 0;
+    size_t dlen, olen;
+    int ret = 0;
+
+    ops->retlen = ops->oobretlen = 0;
+    if (ooblen && ops->ooboffs >= oobsize)
+        return -EINVAL;
+
+    /* 原始读不经过页缓存, 也不让芯片纠错 */
+    if (ops->mode == MTD_OPS_RAW)
+        SPIFlashSetEcc(chip, 0);
+
+    while (len || ooblen) {
+        if (page >= mtd->size / SPI_FLASH_PAGE_SIZE) {
+            ret = -EINVAL;
+            break;
+        }
+
+        dlen = min_t(size_t, len, SPI_FLASH_PAGE_SIZE - column);
+        olen = min_t(size_t, ooblen, oobsize - ops->ooboffs);
+
+        if (ops->mode != MTD_OPS_RAW && dlen && !olen) {
+            ret = w25n_read_page(chip, page, column, ops->datbuf + ops->retlen,
+                dlen);
+        } else {
+            ret = SPIFlashLoadPage(chip, page);
+            if (ret >= 0 || ret == -EBADMSG) {
+                if (dlen)
+                    SPIFlashRead(chip, column, ops->datbuf + ops->retlen, dlen);
+                if (olen)
+                    SPIFlashRead(chip, SPI_FLASH_PAGE_SIZE,
+                        chip->page_buf + SPI_FLASH_PAGE_SIZE, SPI_FLASH_OOB_SIZE);
+            }
+        }
+
+        if (ret == -EBADMSG)
+            ecc_failed = 1;
+        else if (ret < 0)
+            break;
+        else
+            max_bitflips = max_t(unsigned int, max_bitflips, ret);
+        ret = 0;
+
+        if (olen) {
+            if (ops->mode == MTD_OPS_AUTO_OOB)
+                mtd_ooblayout_get_databytes(mtd,
+                    ops->oobbuf + ops->oobretlen,
+                    chip->page_buf + SPI_FLASH_PAGE_SIZE, ops->ooboffs, olen);
+            else
+                memcpy(ops->oobbuf + ops->oobretlen,
+                    chip->page_buf + SPI_FLASH_PAGE_SIZE + ops->ooboffs, olen);
+        }
+
+        ops->retlen += dlen;
+        ops->oobretlen += olen;
+        len -= dlen;
+        ooblen -= olen;
+        column = 0;
+        page++;
+    }
+
+    if (ops->mode == MTD_OPS_RAW) {
+        SPIFlashSetEcc(chip, 1);
+        chip->buf_page = -1;
+    }
+
+    if (ret)
+        return ret;
+    return ecc_failed ? -EBADMSG : max_bitflips;
+}
+
+static int do_flash_write_oob(struct mtd_info *mtd, loff_t to,
+        struct mtd_oob_ops *ops)
+{
+    struct w25n_chip *chip = mtd->priv;
+    unsigned int page = to / SPI_FLASH_PAGE_SIZE;
+    unsigned int column = to % SPI_FLASH_PAGE_SIZE;
+    unsigned int oobsize = (ops->mode == MTD_OPS_AUTO_OOB) ?
+                           mtd->oobavail : mtd->oobsize;
+    size_t len = ops->datbuf ? ops->len : 0;
+    size_t ooblen = ops->oobbuf ? ops->ooblen : 0;
+    size_t dlen, olen;
+    int ret = 0;
+
+    ops->retlen = ops->oobretlen = 0;
+    if (ooblen && ops->ooboffs >= oobsize)
+        return -EINVAL;
+
+    if (ops->mode == MTD_OPS_RAW)
+        SPIFlashSetEcc(chip, 0);
+    chip->buf_page = -1;
+
+    while (len || ooblen) {
+        if (page >= mtd->size / SPI_FLASH_PAGE_SIZE) {
+            ret = -EINVAL;
+            break;
+        }
+
+        dlen = min_t(size_t, len, SPI_FLASH_PAGE_SIZE - column);
+        olen = min_t(size_t, ooblen, oobsize - ops->ooboffs);
+
+        /* 组装整页, 未写的部分保持0xff */
+        memset(chip->page_buf, 0xff, SPI_FLASH_PAGE_SIZE + SPI_FLASH_OOB_SIZE);
+        if (dlen)
+            memcpy(chip->page_buf + column, ops->datbuf + ops->retlen, dlen);
+        if (olen) {
+            if (ops->mode == MTD_OPS_AUTO_OOB)
+                mtd_ooblayout_set_databytes(mtd,
+                    ops->oobbuf + ops->oobretlen,
+                    chip->page_buf + SPI_FLASH_PAGE_SIZE, ops->ooboffs, olen);
+            else
+                memcpy(chip->page_buf + SPI_FLASH_PAGE_SIZE + ops->ooboffs,
+                    ops->oobbuf + ops->oobretlen, olen);
+        }
+
+        w25n_cache_invalidate(chip, page, 1);
+        SPIFlashProgram(chip, 0, chip->page_buf, SPI_FLASH_PAGE_SIZE + SPI_FLASH_OOB_SIZE);
+        ret = SPIFlashProgramExecute(chip, page);
+        if (ret)
+            break;
+
+        ops->retlen += dlen;
+        ops->oobretlen += olen;
+        len -= dlen;
+        ooblen -= olen;
+        column = 0;
+        page++;
+    }
+
+    if (ops->mode == MTD_OPS_RAW)
+        SPIFlashSetEcc(chip, 1);
+
+    return ret;
+}
+
+static int w25n_bbt_get(struct w25n_chip *chip, unsigned int block)
+{
+    return (chip->bbt[block >> 2] >> ((block & 3) * 2)) & 0x3;
+}
+
+static void w25n_bbt_set(struct w25n_chip *chip, unsigned int block, int state)
+{
+    int shift = (block & 3) * 2;
+
+    chip->bbt[block >> 2] = (chip->bbt[block >> 2] & ~(0x3 << shift)) | (state << shift);
+}
+
+/**
+ * 出厂坏块标记: 块内第一页spare区第0字节不为0xff
+*/
+static int w25n_block_checkbad(struct w25n_chip *chip, unsigned int block)
+{
+    int ret;
+
+    ret = SPIFlashLoadPage(chip, block * SPI_FLASH_PAGES_PER_BLOCK);
+    if (ret >= 0 || ret == -EBADMSG) {
+        SPIFlashRead(chip, SPI_FLASH_PAGE_SIZE, chip->page_buf, 2);
+        ret = (chip->page_buf[0] != 0xff);
+    }
+
+    return ret;
+}
+
+/**
+ * 在块的第一页spare区写坏块标记, 以便BBT丢失后重新扫描还能识别
+*/
+static int w25n_block_write_marker(struct w25n_chip *chip, unsigned int block)
+{
+    unsigned int page = block * SPI_FLASH_PAGES_PER_BLOCK;
+
+    /* 只装载spare区前2字节, 缓冲区其余部分由芯片置为0xff */
+    chip->page_buf[0] = 0x00;
+    chip->page_buf[1] = 0x00;
+    chip->buf_page = -1;
+    w25n_cache_invalidate(chip, page, SPI_FLASH_PAGES_PER_BLOCK);
+    SPIFlashProgram(chip, SPI_FLASH_PAGE_SIZE, chip->page_buf, 2);
+
+    return SPIFlashProgramExecute(chip, page);
+}
+
+static u32 w25n_crc32(const unsigned char *p, size_t len)
+{
+    return crc32_le(~0, p, len) ^ ~0;
+}
+
+/**
+ * 从最后几块中读出版本最新且CRC正确的BBT, 每块只读第0页开头的几百字节
+*/
+static int w25n_bbt_read(struct w25n_chip *chip)
+{
+    struct w25n_bbt_hdr *hdr = (struct w25n_bbt_hdr *)chip->page_buf;
+    unsigned char *table = chip->page_buf + sizeof(*hdr);
+    unsigned int block;
+    int found = 0;
+    u32 version;
+    int i;
+
+    for (i = 0; i < W25N_BBT_BLOCKS; i++) {
+        block = W25N_BLOCKS - 1 - i;
+        if (SPIFlashLoadPage(chip, block * SPI_FLASH_PAGES_PER_BLOCK) < 0)
+            continue;
+        SPIFlashRead(chip, 0, chip->page_buf, sizeof(*hdr) + sizeof(chip->bbt));
+
+        if (memcmp(hdr->magic, W25N_BBT_MAGIC, 4) ||
+            le16_to_cpu(hdr->nblocks) != W25N_BLOCKS ||
+            le32_to_cpu(hdr->crc) != w25n_crc32(table, sizeof(chip->bbt)))
+            continue;
+
+        version = le32_to_cpu(hdr->version);
+        if (found && version <= chip->bbt_version)
+            continue;
+
+        found = 1;
+        memcpy(chip->bbt, table, sizeof(chip->bbt));
+        chip->bbt_version = version;
+        chip->bbt_block = block;
+        chip->bbt_spares = le16_to_cpu(hdr->spares);
+    }
+
+    return found ? 0 : -ENOENT;
+}
+
+/**
+ * 把BBT写到下一个BBT块(轮换使用), 版本号加1.
+ * 新的一份写成功之前旧的一份一直有效.
+*/
+static int w25n_bbt_write(struct w25n_chip *chip)
+{
+    struct w25n_bbt_hdr *hdr = (struct w25n_bbt_hdr *)chip->page_buf;
+    unsigned int cur = W25N_BLOCKS - 1 - chip->bbt_block;
+    unsigned int block;
+    int ret = -EIO;
+    int i;
+
+    for (i = 1; i <= W25N_BBT_BLOCKS; i++) {
+        block = W25N_BLOCKS - 1 - (cur + i) % W25N_BBT_BLOCKS;
+        if (w25n_bbt_get(chip, block) != W25N_BLOCK_RESERVED)
+            continue;
+
+        ret = SPIFlashEraseSector(chip, block * SPI_FLASH_PAGES_PER_BLOCK);
+        if (!ret) {
+            memset(chip->page_buf, 0xff, SPI_FLASH_PAGE_SIZE);
+            memcpy(hdr->magic, W25N_BBT_MAGIC, 4);
+            hdr->version = cpu_to_le32(chip->bbt_version + 1);
+            hdr->nblocks = cpu_to_le16(W25N_BLOCKS);
+            hdr->spares = cpu_to_le16(chip->bbt_spares);
+            memcpy(chip->page_buf + sizeof(*hdr), chip->bbt, sizeof(chip->bbt));
+            hdr->crc = cpu_to_le32(w25n_crc32(chip->bbt, sizeof(chip->bbt)));
+
+            chip->buf_page = -1;
+            w25n_cache_invalidate(chip, block * SPI_FLASH_PAGES_PER_BLOCK,
+                SPI_FLASH_PAGES_PER_BLOCK);
+            SPIFlashProgram(chip, 0, chip->page_buf, sizeof(*hdr) + sizeof(chip->bbt));
+            ret = SPIFlashProgramExecute(chip, block * SPI_FLASH_PAGES_PER_BLOCK);
+        }
+        if (!ret) {
+            chip->bbt_block = block;
+            chip->bbt_version++;
+            return 0;
+        }
+
+        printk("[%s]bbt block %u failed\n", __func__, block);
+        w25n_bbt_set(chip, block, W25N_BLOCK_WORN);
+    }
+
+    return ret;
+}
+
+/**
+ * 读芯片的BBM LUT(0xa5): 每条4字节, LBA[15]为有效位, LBA[9:0]/PBA[9:0]为块号
+*/
+static void SPIFlashReadLUT(struct w25n_chip *chip)
+{
+    unsigned char tx_buf[2] = { 0xa5, 0x00 };
+    int i;
+
+    spi_write_then_read(chip->spi, tx_buf, 2, chip->page_buf, W25N_LUT_ENTRIES * 4);
+
+    for (i = 0; i < W25N_LUT_ENTRIES; i++) {
+        chip->bbm_lut[i].lba = (chip->page_buf[i * 4] << 8) | chip->page_buf[i * 4 + 1];
+        chip->bbm_lut[i].pba = (chip->page_buf[i * 4 + 2] << 8) | chip->page_buf[i * 4 + 3];
+    }
+}
+
+static int w25n_lut_used(struct w25n_chip *chip, unsigned int pba)
+{
+    int i;
+
+    for (i = 0; i < W25N_LUT_ENTRIES; i++) {
+        if ((chip->bbm_lut[i].lba & 0x8000) && (chip->bbm_lut[i].pba & 0x3ff) == pba)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * 用0xa1把坏的逻辑块映射到一个空闲的备用块, 成功后逻辑块可以继续使用
+*/
+static int SPIFlashRemapBlock(struct w25n_chip *chip, unsigned int block)
+{
+    unsigned int first = W25N_BLOCKS - W25N_BBT_BLOCKS - chip->bbt_spares;
+    unsigned char *tx_buf = chip->dma.cmd;
+    unsigned int pba;
+    int ret;
+
+    if (readReg(chip, 0xc0) & (1 << 6))   /* LUT-F: LUT已满 */
+        return -ENOSPC;
+
+    for (pba = first; pba < first + chip->bbt_spares; pba++) {
+        if (w25n_bbt_get(chip, pba) == W25N_BLOCK_RESERVED && !w25n_lut_used(chip, pba))
+            break;
+    }
+    if (pba == first + chip->bbt_spares)
+        return -ENOSPC;
+
+    tx_buf[0] = 0xa1;
+    tx_buf[1] = block >> 8;
+    tx_buf[2] = block & 0xff;
+    tx_buf[3] = pba >> 8;
+    tx_buf[4] = pba & 0xff;
+
+    SPIFlashWriteEnable(chip, 1);
+    spi_write(chip->spi, tx_buf, 5);
+    ret = SPIFlashWaitWhenBusy(chip, W25N_OP_LOAD);
+    if (ret < 0)
+        return ret;
+
+    SPIFlashReadLUT(chip);
+    if (!w25n_lut_used(chip, pba))
+        return -EIO;
+
+    printk("w25n01gw: block %u remapped to %u\n", block, pba);
+
+    /* 映射后的逻辑块从干净的备用块开始使用 */
+    chip->buf_page = -1;
+    w25n_cache_invalidate(chip, block * SPI_FLASH_PAGES_PER_BLOCK,
+        SPI_FLASH_PAGES_PER_BLOCK);
+    return SPIFlashEraseSector(chip, block * SPI_FLASH_PAGES_PER_BLOCK);
+}
+
+/**
+ * 没有有效BBT时扫描全部块的出厂坏块标记并建立BBT
+*/
+static int w25n_bbt_scan(struct w25n_chip *chip)
+{
+    unsigned int block;
+    int ret;
+
+    printk("w25n01gw: no valid bbt, scanning %d blocks\n", W25N_BLOCKS);
+
+    memset(chip->bbt, 0, sizeof(chip->bbt));
+    chip->bbt_version = 0;
+    chip->bbt_block = W25N_BLOCKS - 1;
+    chip->bbt_spares = min_t(unsigned int, bbm_spares, W25N_LUT_ENTRIES);
+
+    for (block = 0; block < W25N_BLOCKS; block++) {
+        ret = w25n_block_checkbad(chip, block);
+        if (ret < 0)
+            return ret;
+        if (ret)
+            w25n_bbt_set(chip, block, W25N_BLOCK_FACTORY);
+        else if (block >= W25N_BLOCKS - W25N_BBT_BLOCKS - chip->bbt_spares)
+            w25n_bbt_set(chip, block, W25N_BLOCK_RESERVED);
+    }
+
+    return w25n_bbt_write(chip);
+}
+
+static int w25n_bbt_init(struct w25n_chip *chip)
+{
+    unsigned int block;
+    int ret;
+
+    SPIFlashReadLUT(chip);
+
+    ret = w25n_bbt_read(chip);
+    if (ret)
+        ret = w25n_bbt_scan(chip);
+    if (ret)
+        return ret;
+
+    for (block = 0; block < W25N_BLOCKS; block++) {
+        if (w25n_bbt_get(chip, block) == W25N_BLOCK_FACTORY ||
+            w25n_bbt_get(chip, block) == W25N_BLOCK_WORN)
+            chip->mtd.ecc_stats.badblocks++;
+        else if (w25n_bbt_get(chip, block) == W25N_BLOCK_RESERVED)
+            chip->mtd.ecc_stats.bbtblocks++;
+    }
+
+    printk("w25n01gw: bbt v%u in block %u, %u bad, %u spares\n",
+        chip->bbt_version, chip->bbt_block, chip->mtd.ecc_stats.badblocks,
+        chip->bbt_spares);
+    return 0;
+}
+
+static int my_flash_block_isbad(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_chip *chip = mtd->priv;
+    return w25n_bbt_get(chip, ofs / SPI_FLASH_BLOCK_SIZE) != W25N_BLOCK_GOOD;
+}
+
+static int my_flash_block_isreserved(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_chip *chip = mtd->priv;
+    return w25n_bbt_get(chip, ofs / SPI_FLASH_BLOCK_SIZE) == W25N_BLOCK_RESERVED;
+}
+
+static int do_flash_block_markbad(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_chip *chip = mtd->priv;
+    unsigned int block = ofs / SPI_FLASH_BLOCK_SIZE;
+    int ret;
+
+    if (w25n_bbt_get(chip, block) != W25N_BLOCK_GOOD)
+        return 0;
+
+    /* 有空闲备用块时先尝试由芯片LUT重映射 */
+    if (chip->bbt_spares && !SPIFlashRemapBlock(chip, block))
+        return 0;
+
+    w25n_bbt_set(chip, block, W25N_BLOCK_WORN);
+    w25n_block_write_marker(chip, block);
+    ret = w25n_bbt_write(chip);
+
+    mtd->ecc_stats.badblocks++;
+    return ret;
+}
+
+/**
+ * 请求队列: 所有对芯片的操作由一个有序工作队列串行执行, 调用者睡眠等待完成.
+ * 读请求单独排队, 与先提交的写/擦除请求页范围不重叠时可以越过它们先执行;
+ * 页对齐的相邻读请求合并成一次连续读, 用spi_async提交后工作线程不等数据
+ * 传完就继续处理下一个请求, 在spi_message的完成回调中唤醒读请求.
+*/
+#define W25N_MERGE_MAX      16  /* 一次连续读合并的最大请求数 */
+#define W25N_OVERTAKE_MAX   32  /* 读连续越过写请求的上限, 防止写饿死 */
+
+struct w25n_req {
+    struct list_head    list;
+    u64                 seq;        /* 提交顺序 */
+    int                 op;         /* W25N_REQ_*, 用于跟踪和统计 */
+    int               (*fn)(struct w25n_chip *chip, struct w25n_req *req);
+    unsigned int        page;       /* 涉及的页范围[page, page + count) */
+    unsigned int        count;
+    loff_t              addr;
+    size_t              len;
+    size_t             *retlen;
+    u_char             *buf;
+    void               *priv;       /* mtd_oob_ops */
+    int                 result;
+    struct completion   done;
+};
+
+/**
+ * 合并后的一次连续读: 指令, 各请求的rx, 片选无效后读状态寄存器3,
+ * 再恢复BUF=1, 都在同一个spi_message中, 用cs_change分隔
+*/
+struct w25n_batch {
+    struct w25n_chip   *chip;
+    struct spi_message  msg;
+    unsigned char       cmd[5];
+    unsigned char       sr_cmd[2];
+    unsigned char       buf_cmd[3];
+    int                 first_ecc;  /* 第一页0x13后的ECC结果 */
+    ktime_t             start;
+    u64                 busy_ns;    /* 第一页tRD */
+    size_t              len;
+    int                 nreq;
+    struct w25n_req    *reqs[W25N_MERGE_MAX];
+    unsigned char       sr ____cacheline_aligned;   /* DMA接收, 独占cacheline */
+    struct spi_transfer xfer[0] ____cacheline_aligned;
+};
+
+static int w25n_req_read(struct w25n_chip *chip, struct w25n_req *req)
+{
+    return do_flash_read(&chip->mtd, req->addr, req->len, req->retlen,
+        req->buf);
+}
+
+/* 页对齐的整页读, 且缓冲可以直接DMA时可以合并成连续读 */
+static int w25n_req_streamable(struct w25n_req *req)
+{
+    return req->fn == w25n_req_read && req->len &&
+           !(req->addr % SPI_FLASH_PAGE_SIZE) &&
+           !(req->len % SPI_FLASH_PAGE_SIZE) &&
+           w25n_dma_safe(req->buf, req->len, 1);
+}
+
+/* 读与更早提交的写/擦除请求页范围重叠时不能越过, 调用时持有queue_lock */
+static int w25n_req_blocked(struct w25n_chip *chip, struct w25n_req *req)
+{
+    struct w25n_req *w;
+
+    list_for_each_entry(w, &chip->write_queue, list) {
+        if (w->seq > req->seq)
+            break;
+        if (req->page < w->page + w->count && w->page < req->page + req->count)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* 取出下一个要执行的请求, 读优先, 调用时持有queue_lock */
+static struct w25n_req *w25n_next_req(struct w25n_chip *chip)
+{
+    struct w25n_req *w = list_first_entry_or_null(&chip->write_queue,
+                                                  struct w25n_req, list);
+    struct w25n_req *r;
+
+    if (!w || chip->overtaken < W25N_OVERTAKE_MAX) {
+        list_for_each_entry(r, &chip->read_queue, list) {
+            if (w25n_req_blocked(chip, r))
+                continue;
+            if (w && w->seq < r->seq) {
+                chip->overtaken++;
+                chip->stat_overtaken++;
+            }
+            list_del(&r->list);
+            return r;
+        }
+    }
+
+    if (w) {
+        chip->overtaken = 0;
+        list_del(&w->list);
+    }
+    return w;
+}
+
+/* 从读队列中找出紧接在req之后的可合并请求, 调用时持有queue_lock */
+static struct w25n_req *w25n_next_adjacent(struct w25n_chip *chip,
+        struct w25n_req *req)
+{
+    struct w25n_req *r;
+
+    list_for_each_entry(r, &chip->read_queue, list) {
+        if (r->addr == req->addr + req->len && w25n_req_streamable(r) &&
+            !w25n_req_blocked(chip, r)) {
+            list_del(&r->list);
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+/* 请求完成时记录跟踪事件和统计, 在请求被唤醒之前调用 */
+static void w25n_req_done(struct w25n_chip *chip,
+        int op, unsigned int page, size_t len,
+        ktime_t start, u64 busy, int ret)
+{
+    struct w25n_req_stats *st = &chip->req_stats[op];
+    u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    unsigned long flags;
+
+    trace_w25n_request(op, page, len, ns > busy ? ns - busy : 0, busy, ret);
+
+    spin_lock_irqsave(&chip->stats_lock, flags);
+    st->count++;
+    st->bytes += len;
+    st->ns += ns;
+    if (ret < 0)
+        st->errors++;
+    spin_unlock_irqrestore(&chip->stats_lock, flags);
+}
+
+static void w25n_batch_complete(void *context)
+{
+    struct w25n_batch *b = context;
+    struct w25n_chip *chip = b->chip;
+    struct w25n_req *req;
+    int ret = b->msg.status;
+    int i;
+
+    /**
+     * 连续读的ECC位汇总了所有页, 无法区分是哪个请求的页出错.
+     * 第一页的结果合并进来后一起计入一次
+     */
+    if (!ret) {
+        ret = w25n_ecc_decode(b->sr);
+        if (ret >= 0)
+            ret = (b->first_ecc < 0) ? b->first_ecc : max(ret, b->first_ecc);
+        w25n_ecc_account(chip, ret);
+    }
+    w25n_req_done(chip, W25N_REQ_STREAM, b->reqs[0]->page, b->len, b->start,
+        b->busy_ns, ret);
+
+    for (i = 0; i < b->nreq; i++) {
+        req = b->reqs[i];
+        *req->retlen = (ret >= 0 || ret == -EBADMSG) ? req->len : 0;
+        req->result = ret;
+        complete(&req->done);
+    }
+
+    kfree(b);
+}
+
+/**
+ * 把合并好的读请求作为一个连续读异步提交. 之后的同步操作在控制器队列中
+ * 排在它后面, reg2_val和buf_page在提交时就按完成后的状态更新.
+*/
+static void w25n_submit_batch(struct w25n_chip *chip,
+        struct w25n_req **reqs, int nreq)
+{
+    size_t max_len = spi_max_transfer_size(chip->spi);
+    struct w25n_batch *b;
+    struct spi_transfer *t;
+    unsigned char *buf;
+    size_t len, chunk;
+    int n = 4;      /* 读指令, 读SR3的指令和数据, 写SR2 */
+    int ret;
+    int i;
+
+    for (i = 0; i < nreq; i++)
+        n += DIV_ROUND_UP(reqs[i]->len, max_len);
+
+    b = kzalloc(sizeof(*b) + n * sizeof(*t), GFP_KERNEL);
+    if (!b) {
+        for (i = 0; i < nreq; i++) {
+            reqs[i]->result = reqs[i]->fn(chip, reqs[i]);
+            complete(&reqs[i]->done);
+        }
+        return;
+    }
+    memcpy(b->reqs, reqs, nreq * sizeof(*reqs));
+    b->chip = chip;
+    b->nreq = nreq;
+    for (i = 0; i < nreq; i++)
+        b->len += reqs[i]->len;
+    chip->stat_merged += nreq - 1;
+
+    b->start = ktime_get();
+    chip->busy_ns = 0;
+    SPIFlashSetBufMode(chip, 0);
+    b->first_ecc = __SPIFlashPageRead(chip, reqs[0]->page);
+    b->busy_ns = chip->busy_ns;
+    if (b->first_ecc < 0 && b->first_ecc != -EBADMSG) {
+        ret = b->first_ecc;
+        goto fail;
+    }
+
+    spi_message_init(&b->msg);
+    t = b->xfer;
+
+    b->cmd[0] = chip->io.read_op;
+    t->tx_buf = b->cmd;
+    t->len = (chip->io.read_op == 0x03) ? 4 : 5;
+    spi_message_add_tail(t++, &b->msg);
+
+    for (i = 0; i < nreq; i++) {
+        buf = reqs[i]->buf;
+        for (len = reqs[i]->len; len; len -= chunk) {
+            chunk = min(len, max_len);
+            t->rx_buf = buf;
+            t->len = chunk;
+            t->rx_nbits = chip->io.read_nbits;
+            spi_message_add_tail(t++, &b->msg);
+            buf += chunk;
+        }
+    }
+    /* 片选无效结束连续读 */
+    t[-1].cs_change = 1;
+
+    b->sr_cmd[0] = 0x05;
+    b->sr_cmd[1] = 0xc0;
+    t->tx_buf = b->sr_cmd;
+    t->len = 2;
+    spi_message_add_tail(t++, &b->msg);
+    t->rx_buf = &b->sr;
+    t->len = 1;
+    t->cs_change = 1;
+    spi_message_add_tail(t++, &b->msg);
+
+    b->buf_cmd[0] = 0x01;
+    b->buf_cmd[1] = 0xb0;
+    b->buf_cmd[2] = chip->reg2_val | W25N_SR2_BUF;
+    t->tx_buf = b->buf_cmd;
+    t->len = 3;
+    spi_message_add_tail(t, &b->msg);
+
+    b->msg.complete = w25n_batch_complete;
+    b->msg.context = b;
+
+    ret = spi_async(chip->spi, &b->msg);
+    if (ret)
+        goto fail;
+
+    chip->reg2_val |= W25N_SR2_BUF;
+    chip->buf_page = -1;
+    chip->ra_next = reqs[nreq - 1]->page + reqs[nreq - 1]->count;
+    return;
+
+fail:
+    SPIFlashSetBufMode(chip, 1);
+    chip->buf_page = -1;
+    w25n_req_done(chip, W25N_REQ_STREAM, reqs[0]->page, b->len, b->start,
+        b->busy_ns, ret);
+    for (i = 0; i < nreq; i++) {
+        *reqs[i]->retlen = 0;
+        reqs[i]->result = ret;
+        complete(&reqs[i]->done);
+    }
+    kfree(b);
+}
+
+static void w25n_work_fn(struct work_struct *work)
+{
+    struct w25n_chip *chip = container_of(work, struct w25n_chip, work);
+    struct w25n_req *batch[W25N_MERGE_MAX];
+    struct w25n_req *req;
+    ktime_t start;
+    size_t total;
+    int n;
+
+    for (;;) {
+        spin_lock(&chip->queue_lock);
+        req = w25n_next_req(chip);
+        n = 0;
+        if (req && stream_pages && w25n_req_streamable(req)) {
+            batch[n++] = req;
+            total = req->len;
+            while (n < W25N_MERGE_MAX &&
+                   (req = w25n_next_adjacent(chip, batch[n - 1])) != NULL) {
+                batch[n++] = req;
+                total += req->len;
+            }
+            req = batch[0];
+        }
+        spin_unlock(&chip->queue_lock);
+
+        if (!req)
+            break;
+
+        /* 单个短读仍走页缓存和预读 */
+        if (n > 1 || (n && total >= stream_pages * SPI_FLASH_PAGE_SIZE)) {
+            w25n_submit_batch(chip, batch, n);
+            continue;
+        }
+
+        start = ktime_get();
+        chip->busy_ns = 0;
+        req->result = req->fn(chip, req);
+        w25n_req_done(chip, req->op, req->page, req->len, start, chip->busy_ns,
+            req->result);
+        complete(&req->done);
+    }
+}
+
+/* 请求入队并唤醒工作线程, 不等待完成 */
+static void w25n_queue(struct w25n_chip *chip,
+        struct w25n_req *req, int is_read)
+{
+    init_completion(&req->done);
+
+    spin_lock(&chip->queue_lock);
+    req->seq = chip->queue_seq++;
+    list_add_tail(&req->list, is_read ? &chip->read_queue : &chip->write_queue);
+    spin_unlock(&chip->queue_lock);
+
+    queue_work(chip->wq, &chip->work);
+}
+
+static int w25n_submit(struct w25n_chip *chip,
+        struct w25n_req *req, int is_read)
+{
+    w25n_queue(chip, req, is_read);
+    wait_for_completion(&req->done);
+
+    return req->result;
+}
+
+static int w25n_req_write(struct w25n_chip *chip, struct w25n_req *req)
+{
+    return do_flash_write(&chip->mtd, req->addr, req->len, req->retlen,
+        req->buf);
+}
+
+/**
+ * 擦除一块. 坏块和保留块拒绝擦除, 上次擦除后没有编程过的块直接跳过
+*/
+static int w25n_req_erase(struct w25n_chip *chip, struct w25n_req *req)
+{
+    unsigned int block = req->page / SPI_FLASH_PAGES_PER_BLOCK;
+
+    if (w25n_bbt_get(chip, block) != W25N_BLOCK_GOOD) {
+        printk("[%s]block %u is bad or reserved\n", __func__, block);
+        return -EIO;
+    }
+
+    if (test_bit(block, chip->blank_map)) {
+        chip->stat_erase_skipped++;
+        return 0;
+    }
+
+    chip->buf_page = -1;
+    w25n_cache_invalidate(chip, req->page, SPI_FLASH_PAGES_PER_BLOCK);
+    return SPIFlashEraseSector(chip, req->page);
+}
+
+static int w25n_req_read_oob(struct w25n_chip *chip, struct w25n_req *req)
+{
+    return do_flash_read_oob(&chip->mtd, req->addr, req->priv);
+}
+
+static int w25n_req_write_oob(struct w25n_chip *chip, struct w25n_req *req)
+{
+    return do_flash_write_oob(&chip->mtd, req->addr, req->priv);
+}
+
+static int w25n_req_markbad(struct w25n_chip *chip, struct w25n_req *req)
+{
+    return do_flash_block_markbad(&chip->mtd, req->addr);
+}
+
+/* OOB操作涉及的页数, 数据和spare区取较多的一个 */
+static unsigned int w25n_oob_pages(struct mtd_info *mtd, loff_t addr,
+        struct mtd_oob_ops *ops)
+{
+    unsigned int oobsize = (ops->mode == MTD_OPS_AUTO_OOB) ?
+                           mtd->oobavail : mtd->oobsize;
+    unsigned int pages = 1;
+
+    if (ops->datbuf)
+        pages = max_t(unsigned int, pages,
+            DIV_ROUND_UP(addr % SPI_FLASH_PAGE_SIZE + ops->len,
+                         SPI_FLASH_PAGE_SIZE));
+    if (ops->oobbuf && ops->ooboffs < oobsize)
+        pages = max_t(unsigned int, pages,
+            DIV_ROUND_UP(ops->ooblen, oobsize - ops->ooboffs));
+
+    return pages;
+}
+
+static int my_flash_read(struct mtd_info *mtd, loff_t from, size_t len,
+        size_t *retlen, u_char *buf)
+{
+    struct w25n_req req = {
+        .op     = W25N_REQ_READ,
+        .fn     = w25n_req_read,
+        .page   = from / SPI_FLASH_PAGE_SIZE,
+        .count  = DIV_ROUND_UP(from % SPI_FLASH_PAGE_SIZE + len,
+                               SPI_FLASH_PAGE_SIZE),
+        .addr   = from,
+        .len    = len,
+        .retlen = retlen,
+        .buf    = buf,
+    };
+
+    return w25n_submit(mtd->priv, &req, 1);
+}
+
+static int my_flash_write(struct mtd_info *mtd, loff_t to, size_t len,
+        size_t *retlen, const u_char *buf)
+{
+    struct w25n_req req = {
+        .op     = W25N_REQ_WRITE,
+        .fn     = w25n_req_write,
+        .page   = to / SPI_FLASH_PAGE_SIZE,
+        .count  = DIV_ROUND_UP(to % SPI_FLASH_PAGE_SIZE + len,
+                               SPI_FLASH_PAGE_SIZE),
+        .addr   = to,
+        .len    = len,
+        .retlen = retlen,
+        .buf    = (u_char *)buf,
+    };
+
+    return w25n_submit(mtd->priv, &req, 0);
+}
+
+/**
+ * 逐块提交擦除请求. W25N01GW没有擦除暂停指令, 每块是一个独立请求,
+ * 擦除期间到达的读最多等待一块的tBE就能插到下一块之前执行
+*/
+static int my_flash_erase(struct mtd_info *mtd, struct erase_info *instr)
+{
+    struct w25n_req req;
+    loff_t addr = instr->addr;
+    loff_t end = instr->addr + instr->len;
+    int ret = 0;
+
+    if ((addr % SPI_FLASH_BLOCK_SIZE) || (instr->len % SPI_FLASH_BLOCK_SIZE))
+    {
+        printk("[%s]addr/len is not aligned\n", __func__);
+        return -EINVAL;
+    }
+
+    instr->fail_addr = MTD_FAIL_ADDR_UNKNOWN;
+    for (; addr < end; addr += SPI_FLASH_BLOCK_SIZE) {
+        memset(&req, 0, sizeof(req));
+        req.op = W25N_REQ_ERASE;
+        req.fn = w25n_req_erase;
+        req.len = SPI_FLASH_BLOCK_SIZE;
+        req.page = addr / SPI_FLASH_PAGE_SIZE;
+        req.count = SPI_FLASH_PAGES_PER_BLOCK;
+
+        ret = w25n_submit(mtd->priv, &req, 0);
+        if (ret) {
+            instr->fail_addr = addr;
+            break;
+        }
+    }
+
+    instr->state = ret ? MTD_ERASE_FAILED : MTD_ERASE_DONE;
+    if (!ret)
+        mtd_erase_callback(instr);
+
+    return ret;
+}
+
+static int my_flash_read_oob(struct mtd_info *mtd, loff_t from,
+        struct mtd_oob_ops *ops)
+{
+    struct w25n_req req = {
+        .op     = W25N_REQ_READ_OOB,
+        .fn     = w25n_req_read_oob,
+        .page   = from / SPI_FLASH_PAGE_SIZE,
+        .count  = w25n_oob_pages(mtd, from, ops),
+        .addr   = from,
+        .len    = (ops->datbuf ? ops->len : 0) +
+                  (ops->oobbuf ? ops->ooblen : 0),
+        .priv   = ops,
+    };
+
+    return w25n_submit(mtd->priv, &req, 1);
+}
+
+static int my_flash_write_oob(struct mtd_info *mtd, loff_t to,
+        struct mtd_oob_ops *ops)
+{
+    struct w25n_req req = {
+        .op     = W25N_REQ_WRITE_OOB,
+        .fn     = w25n_req_write_oob,
+        .page   = to / SPI_FLASH_PAGE_SIZE,
+        .count  = w25n_oob_pages(mtd, to, ops),
+        .addr   = to,
+        .len    = (ops->datbuf ? ops->len : 0) +
+                  (ops->oobbuf ? ops->ooblen : 0),
+        .priv   = ops,
+    };
+
+    return w25n_submit(mtd->priv, &req, 0);
+}
+
+static int my_flash_block_markbad(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_req req = {
+        .op     = W25N_REQ_MARKBAD,
+        .fn     = w25n_req_markbad,
+        .page   = ofs / SPI_FLASH_BLOCK_SIZE * SPI_FLASH_PAGES_PER_BLOCK,
+        .count  = SPI_FLASH_PAGES_PER_BLOCK,
+        .addr   = ofs,
+    };
+
+    return w25n_submit(mtd->priv, &req, 0);
+}
+
+/**
+ * 条带化(RAID-0): 多个芯片组成一个mtd设备. 逻辑页P在芯片P % N的第P / N页,
+ * 逻辑擦除块b由各芯片的第b块组成. 一次读写按页拆成各芯片的请求,
+ * 全部入队后再等待, 不同总线上的芯片并行传输和编程;
+ * 同一芯片上相邻的页仍由工作线程合并成连续读.
+ * 芯片按设备名排序, 与probe顺序无关.
+*/
+#define W25N_STRIPE_MAX     8
+
+struct w25n_stripe {
+    struct mtd_info     mtd;
+    int                 registered;
+    int                 nchips;
+    struct w25n_chip   *chips[W25N_STRIPE_MAX];
+};
+
+/* 拆分后落在一个芯片一页内的请求 */
+struct w25n_stripe_io {
+    struct w25n_chip   *chip;
+    struct w25n_req     req;
+    size_t              retlen;
+};
+
+static struct w25n_stripe w25n_stripe;
+static DEFINE_MUTEX(w25n_stripe_lock);
+/* 保护条带mtd的ecc_stats, 多个读者并发计入 */
+static DEFINE_SPINLOCK(w25n_stripe_stats_lock);
+
+/**
+ * 芯片只把ECC结果计入各自的ecc_stats, 用户打开的是条带的mtd,
+ * 条带读路径把每页的结果再计入条带, ECCGETSTATS才有意义
+ */
+static void w25n_stripe_ecc_account(struct w25n_stripe *st, int ret)
+{
+    unsigned long flags;
+
+    if (ret != -EBADMSG && ret <= 0)
+        return;
+
+    spin_lock_irqsave(&w25n_stripe_stats_lock, flags);
+    if (ret == -EBADMSG)
+        st->mtd.ecc_stats.failed++;
+    else
+        st->mtd.ecc_stats.corrected += ret;
+    spin_unlock_irqrestore(&w25n_stripe_stats_lock, flags);
+}
+
+/* 逻辑地址所在的芯片, chip_ofs返回芯片内地址 */
+static struct w25n_chip *w25n_stripe_map(struct w25n_stripe *st, loff_t ofs,
+        loff_t *chip_ofs)
+{
+    unsigned int page = ofs / SPI_FLASH_PAGE_SIZE;
+
+    *chip_ofs = (loff_t)(page / st->nchips) * SPI_FLASH_PAGE_SIZE +
+                ofs % SPI_FLASH_PAGE_SIZE;
+    return st->chips[page % st->nchips];
+}
+
+/* 逻辑擦除块号, 也是各芯片上的块号 */
+static unsigned int w25n_stripe_block(struct w25n_stripe *st, loff_t ofs)
+{
+    unsigned int page = ofs / SPI_FLASH_PAGE_SIZE;
+
+    return page / (st->nchips * SPI_FLASH_PAGES_PER_BLOCK);
+}
+
+/**
+ * 按页拆分[ofs, ofs + len)并提交到各芯片, 等待全部完成后返回.
+ * 按芯片依次入队, 使每个工作线程一次拿到一串相邻页
+*/
+static struct w25n_stripe_io *w25n_stripe_run(struct w25n_stripe *st,
+        int op, int (*fn)(struct w25n_chip *, struct w25n_req *),
+        loff_t ofs, size_t len, u_char *buf, int *count)
+{
+    struct w25n_stripe_io *io;
+    struct w25n_req *req;
+    loff_t chip_ofs;
+    size_t piece;
+    int n = DIV_ROUND_UP(ofs % SPI_FLASH_PAGE_SIZE + len, SPI_FLASH_PAGE_SIZE);
+    int i, c;
+
+    io = kcalloc(n, sizeof(*io), GFP_KERNEL);
+    if (!io)
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        piece = min_t(size_t, len,
+            SPI_FLASH_PAGE_SIZE - ofs % SPI_FLASH_PAGE_SIZE);
+        io[i].chip = w25n_stripe_map(st, ofs, &chip_ofs);
+        req = &io[i].req;
+        req->op = op;
+        req->fn = fn;
+        req->page = chip_ofs / SPI_FLASH_PAGE_SIZE;
+        req->count = 1;
+        req->addr = chip_ofs;
+        req->len = piece;
+        req->retlen = &io[i].retlen;
+        req->buf = buf;
+
+        ofs += piece;
+        buf += piece;
+        len -= piece;
+    }
+
+    for (c = 0; c < st->nchips; c++) {
+        for (i = 0; i < n; i++) {
+            if (io[i].chip == st->chips[c])
+                w25n_queue(io[i].chip, &io[i].req, fn == w25n_req_read);
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        wait_for_completion(&io[i].req.done);
+
+    *count = n;
+    return io;
+}
+
+static int w25n_stripe_read(struct mtd_info *mtd, loff_t from, size_t len,
+        size_t *retlen, u_char *buf)
+{
+    struct w25n_stripe_io *io;
+    unsigned int max_bitflips = 0;
+    int ecc_failed = 0;
+    int ret = 0;
+    int n, i;
+
+    io = w25n_stripe_run(mtd->priv, W25N_REQ_READ, w25n_req_read,
+        from, len, buf, &n);
+    if (!io)
+        return -ENOMEM;
+
+    for (i = 0; i < n; i++)
+        w25n_stripe_ecc_account(mtd->priv, io[i].req.result);
+
+    /* retlen只计算第一个错误之前连续读到的部分 */
+    for (i = 0; i < n; i++) {
+        ret = io[i].req.result;
+        if (ret == -EBADMSG)
+            ecc_failed = 1;
+        else if (ret < 0)
+            break;
+        else
+            max_bitflips = max_t(unsigned int, max_bitflips, ret);
+        ret = 0;
+        *retlen += io[i].retlen;
+    }
+
+    kfree(io);
+    if (ret)
+        return ret;
+    return ecc_failed ? -EBADMSG : max_bitflips;
+}
+
+static int w25n_stripe_write(struct mtd_info *mtd, loff_t to, size_t len,
+        size_t *retlen, const u_char *buf)
+{
+    struct w25n_stripe_io *io;
+    int ret = 0;
+    int n, i;
+
+    if ((to % SPI_FLASH_PAGE_SIZE) || (len % SPI_FLASH_PAGE_SIZE))
+    {
+        printk("[%s]addr/len is not aligned\n", __func__);
+        return -EINVAL;
+    }
+
+    io = w25n_stripe_run(mtd->priv, W25N_REQ_WRITE, w25n_req_write,
+        to, len, (u_char *)buf, &n);
+    if (!io)
+        return -ENOMEM;
+
+    for (i = 0; i < n; i++) {
+        ret = io[i].req.result;
+        if (ret)
+            break;
+        *retlen += io[i].retlen;
+    }
+
+    kfree(io);
+    return ret;
+}
+
+/* 逻辑块在各芯片上的同号块同时擦除 */
+static int w25n_stripe_erase(struct mtd_info *mtd, struct erase_info *instr)
+{
+    struct w25n_stripe *st = mtd->priv;
+    struct w25n_req reqs[W25N_STRIPE_MAX];
+    loff_t addr = instr->addr;
+    loff_t end = instr->addr + instr->len;
+    unsigned int block;
+    int ret = 0;
+    int c;
+
+    if ((addr % SPI_FLASH_PAGE_SIZE) || (instr->len % SPI_FLASH_PAGE_SIZE) ||
+        w25n_stripe_block(st, addr) * mtd->erasesize != addr ||
+        w25n_stripe_block(st, end) * mtd->erasesize != end)
+    {
+        printk("[%s]addr/len is not aligned\n", __func__);
+        return -EINVAL;
+    }
+
+    instr->fail_addr = MTD_FAIL_ADDR_UNKNOWN;
+    for (; addr < end; addr += mtd->erasesize) {
+        block = w25n_stripe_block(st, addr);
+        for (c = 0; c < st->nchips; c++) {
+            memset(&reqs[c], 0, sizeof(reqs[c]));
+            reqs[c].op = W25N_REQ_ERASE;
+            reqs[c].fn = w25n_req_erase;
+            reqs[c].len = SPI_FLASH_BLOCK_SIZE;
+            reqs[c].page = block * SPI_FLASH_PAGES_PER_BLOCK;
+            reqs[c].count = SPI_FLASH_PAGES_PER_BLOCK;
+            w25n_queue(st->chips[c], &reqs[c], 0);
+        }
+
+        for (c = 0; c < st->nchips; c++) {
+            wait_for_completion(&reqs[c].done);
+            if (reqs[c].result && !ret)
+                ret = reqs[c].result;
+        }
+
+        if (ret) {
+            instr->fail_addr = addr;
+            break;
+        }
+    }
+
+    instr->state = ret ? MTD_ERASE_FAILED : MTD_ERASE_DONE;
+    if (!ret)
+        mtd_erase_callback(instr);
+
+    return ret;
+}
+
+/**
+ * OOB操作按页转给所在芯片, 逐页执行. 与nand_base一致,
+ * 每页的spare区都从ooboffs开始取
+*/
+static int w25n_stripe_oob(struct mtd_info *mtd, loff_t ofs,
+        struct mtd_oob_ops *ops, int write)
+{
+    struct w25n_stripe *st = mtd->priv;
+    struct w25n_chip *chip;
+    struct mtd_oob_ops sub;
+    unsigned int oobsize = (ops->mode == MTD_OPS_AUTO_OOB) ?
+                           mtd->oobavail : mtd->oobsize;
+    unsigned int max_bitflips = 0;
+    int ecc_failed = 0;
+    loff_t chip_ofs;
+    int ret = 0;
+
+    while ((ops->datbuf && ops->retlen < ops->len) ||
+           (ops->oobbuf && ops->oobretlen < ops->ooblen)) {
+        chip = w25n_stripe_map(st, ofs, &chip_ofs);
+
+        memset(&sub, 0, sizeof(sub));
+        sub.mode = ops->mode;
+        sub.ooboffs = ops->ooboffs;
+        if (ops->datbuf && ops->retlen < ops->len) {
+            sub.datbuf = ops->datbuf + ops->retlen;
+            sub.len = min_t(size_t, ops->len - ops->retlen,
+                SPI_FLASH_PAGE_SIZE - ofs % SPI_FLASH_PAGE_SIZE);
+        }
+        if (ops->oobbuf && ops->oobretlen < ops->ooblen &&
+            ops->ooboffs < oobsize) {
+            sub.oobbuf = ops->oobbuf + ops->oobretlen;
+            sub.ooblen = min_t(size_t, ops->ooblen - ops->oobretlen,
+                oobsize - ops->ooboffs);
+        }
+
+        ret = write ? my_flash_write_oob(&chip->mtd, chip_ofs, &sub) :
+                      my_flash_read_oob(&chip->mtd, chip_ofs, &sub);
+        ops->retlen += sub.retlen;
+        ops->oobretlen += sub.oobretlen;
+        if (!write)
+            w25n_stripe_ecc_account(st, ret);
+
+        if (ret == -EBADMSG)
+            ecc_failed = 1;
+        else if (ret < 0)
+            return ret;
+        else
+            max_bitflips = max_t(unsigned int, max_bitflips, ret);
+        ret = 0;
+
+        if (!sub.retlen && !sub.oobretlen)
+            break;
+        ofs = round_down(ofs, SPI_FLASH_PAGE_SIZE) + SPI_FLASH_PAGE_SIZE;
+    }
+
+    if (write)
+        return 0;
+    return ecc_failed ? -EBADMSG : max_bitflips;
+}
+
+static int w25n_stripe_read_oob(struct mtd_info *mtd, loff_t from,
+        struct mtd_oob_ops *ops)
+{
+    return w25n_stripe_oob(mtd, from, ops, 0);
+}
+
+static int w25n_stripe_write_oob(struct mtd_info *mtd, loff_t to,
+        struct mtd_oob_ops *ops)
+{
+    return w25n_stripe_oob(mtd, to, ops, 1);
+}
+
+/* 任一芯片上的同号块是坏块, 逻辑块就是坏块 */
+static int w25n_stripe_block_isbad(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_stripe *st = mtd->priv;
+    loff_t chip_ofs = (loff_t)w25n_stripe_block(st, ofs) * SPI_FLASH_BLOCK_SIZE;
+    int c;
+
+    for (c = 0; c < st->nchips; c++) {
+        if (my_flash_block_isbad(&st->chips[c]->mtd, chip_ofs))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int w25n_stripe_block_isreserved(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_stripe *st = mtd->priv;
+    loff_t chip_ofs = (loff_t)w25n_stripe_block(st, ofs) * SPI_FLASH_BLOCK_SIZE;
+    int c;
+
+    for (c = 0; c < st->nchips; c++) {
+        if (my_flash_block_isreserved(&st->chips[c]->mtd, chip_ofs))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* 无法知道是哪个芯片出的错, 所有芯片上的同号块都标记 */
+static int w25n_stripe_block_markbad(struct mtd_info *mtd, loff_t ofs)
+{
+    struct w25n_stripe *st = mtd->priv;
+    loff_t chip_ofs = (loff_t)w25n_stripe_block(st, ofs) * SPI_FLASH_BLOCK_SIZE;
+    unsigned long flags;
+    int isbad = w25n_stripe_block_isbad(mtd, ofs);
+    int ret = 0;
+    int status;
+    int c;
+
+    for (c = 0; c < st->nchips; c++) {
+        status = my_flash_block_markbad(&st->chips[c]->mtd, chip_ofs);
+        if (status && !ret)
+            ret = status;
+    }
+
+    /* 与mtdconcat相同, 新标记的坏块计入条带的统计 */
+    if (!ret && !isbad) {
+        spin_lock_irqsave(&w25n_stripe_stats_lock, flags);
+        mtd->ecc_stats.badblocks++;
+        spin_unlock_irqrestore(&w25n_stripe_stats_lock, flags);
+    }
+
+    return ret;
+}
+
+/**
+ * 按控制器/设备树声明的线宽协商读写指令.
+ * W25N01GW没有QE位, 四线指令期间/WP和/HOLD自动作为IO2/IO3.
+*/
+static void SPIFlashSetupIO(struct w25n_chip *chip)
+{
+    unsigned int width = io_width ? io_width : 4;
+
+    if (width >= 4 && (chip->spi->mode & SPI_RX_QUAD)) {
+        chip->io.read_op = 0x6b;
+        chip->io.read_nbits = SPI_NBITS_QUAD;
+    } else if (width >= 2 && (chip->spi->mode & (SPI_RX_DUAL | SPI_RX_QUAD))) {
+        chip->io.read_op = 0x3b;
+        chip->io.read_nbits = SPI_NBITS_DUAL;
+    }
+
+    /* 装载编程数据只有单线和四线两种 */
+    if (width >= 4 && (chip->spi->mode & SPI_TX_QUAD)) {
+        chip->io.load_op = 0x32;
+        chip->io.load_nbits = SPI_NBITS_QUAD;
+    }
+
+    printk("w25n01gw: read 0x%02x x%d, load 0x%02x x%d\n",
+        chip->io.read_op, chip->io.read_nbits,
+        chip->io.load_op, chip->io.load_nbits);
+}
+
+/**
+ * 构造热点指令的spi_message, 在SPIFlashSetupIO之后调用.
+ * 4.9没有spi_optimize_message, 控制器仍会逐次检查和映射,
+ * 这里省去的是每次的消息构造和栈上指令缓冲
+*/
+static void w25n_msgs_init(struct w25n_chip *chip)
+{
+    struct spi_transfer *t;
+
+    chip->dma.sr3_cmd[0] = 0x05;
+    chip->dma.sr3_cmd[1] = 0xc0;
+    t = chip->sr3_xfer;
+    t[0].tx_buf = chip->dma.sr3_cmd;
+    t[0].len = 2;
+    t[1].rx_buf = &chip->dma.sr3;
+    t[1].len = 1;
+    spi_message_init_with_transfers(&chip->sr3_msg, t, 2);
+
+    chip->dma.page_read_cmd[0] = 0x13;
+    t = &chip->page_read_xfer;
+    t->tx_buf = chip->dma.page_read_cmd;
+    t->len = 4;
+    spi_message_init_with_transfers(&chip->page_read_msg, t, 1);
+
+    /* 缓冲读模式: 指令, 2字节列地址, 1个dummy字节 */
+    chip->dma.read_cmd[0] = chip->io.read_op;
+    t = chip->read_xfer;
+    t[0].tx_buf = chip->dma.read_cmd;
+    t[0].len = 4;
+    t[1].rx_nbits = chip->io.read_nbits;
+    spi_message_init_with_transfers(&chip->read_msg, t, 2);
+
+    /* 写使能, 从列0装载一整页, 编程执行, 用cs_change分隔 */
+    chip->dma.load_cmd[0] = chip->io.load_op;
+    chip->dma.exec_cmd[0] = 0x10;
+    t = chip->prog_xfer;
+    t[0].tx_buf = &chip->dma.we;
+    t[0].len = 1;
+    t[0].cs_change = 1;
+    t[1].tx_buf = chip->dma.load_cmd;
+    t[1].len = 3;
+    t[2].len = SPI_FLASH_PAGE_SIZE;
+    t[2].tx_nbits = chip->io.load_nbits;
+    t[2].cs_change = 1;
+    t[3].tx_buf = chip->dma.exec_cmd;
+    t[3].len = 4;
+    spi_message_init_with_transfers(&chip->prog_msg, t, 4);
+}
+
+static int w25n_cache_alloc(struct w25n_chip *chip)
+{
+    int i;
+
+    if (!cache_pages)
+        return 0;
+
+    chip->page_cache = kcalloc(cache_pages, sizeof(*chip->page_cache), GFP_KERNEL);
+    if (!chip->page_cache)
+        return -ENOMEM;
+
+    for (i = 0; i < cache_pages; i++) {
+        chip->page_cache[i].page = -1;
+        chip->page_cache[i].data = kmalloc(SPI_FLASH_PAGE_SIZE, GFP_KERNEL);
+        if (!chip->page_cache[i].data)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void w25n_cache_free(struct w25n_chip *chip)
+{
+    int i;
+
+    if (!chip->page_cache)
+        return;
+
+    for (i = 0; i < cache_pages; i++)
+        kfree(chip->page_cache[i].data);
+    kfree(chip->page_cache);
+    chip->page_cache = NULL;
+}
+
+static int w25n_latency_show(struct seq_file *s, void *unused)
+{
+    struct w25n_chip *chip = s->private;
+    struct w25n_lat_hist h;
+    unsigned long flags;
+    int op, i;
+
+    for (op = 0; op < W25N_OP_NR; op++) {
+        spin_lock_irqsave(&chip->lat_lock, flags);
+        h = chip->lat_hist[op];
+        spin_unlock_irqrestore(&chip->lat_lock, flags);
+
+        seq_printf(s, "%s: count %llu avg %llu us max %llu us\n",
+            w25n_timing[op].name, h.count,
+            h.count ? div64_u64(h.sum_us, h.count) : 0, h.max_us);
+        for (i = 0; i < W25N_LAT_BUCKETS; i++) {
+            if (!h.bucket[i])
+                continue;
+            seq_printf(s, "  < %6u us: %llu\n", 1u << i, h.bucket[i]);
+        }
+    }
+
+    return 0;
+}
+
+static int w25n_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, w25n_latency_show, inode->i_private);
+}
+
+/* 写任意内容清空直方图 */
+static ssize_t w25n_latency_write(struct file *file, const char __user *buf,
+        size_t count, loff_t *ppos)
+{
+    struct seq_file *s = file->private_data;
+    struct w25n_chip *chip = s->private;
+    unsigned long flags;
+
+    spin_lock_irqsave(&chip->lat_lock, flags);
+    memset(chip->lat_hist, 0, sizeof(chip->lat_hist));
+    spin_unlock_irqrestore(&chip->lat_lock, flags);
+
+    return count;
+}
+
+static int w25n_stats_show(struct seq_file *s, void *unused)
+{
+    struct w25n_chip *chip = s->private;
+    static const char * const name[W25N_REQ_NR] = {
+        "read", "write", "erase", "read_oob", "write_oob", "markbad", "stream",
+    };
+    struct w25n_req_stats st[W25N_REQ_NR];
+    struct mtd_ecc_stats ecc;
+    unsigned long flags;
+    int op;
+
+    spin_lock_irqsave(&chip->stats_lock, flags);
+    memcpy(st, chip->req_stats, sizeof(st));
+    ecc = chip->mtd.ecc_stats;
+    spin_unlock_irqrestore(&chip->stats_lock, flags);
+
+    seq_printf(s, "%-10s %10s %12s %8s %10s\n",
+        "op", "count", "bytes", "errors", "avg us");
+    for (op = 0; op < W25N_REQ_NR; op++) {
+        seq_printf(s, "%-10s %10llu %12llu %8llu %10llu\n", name[op],
+            st[op].count, st[op].bytes, st[op].errors,
+            st[op].count ? div64_u64(st[op].ns, st[op].count * 1000) : 0);
+    }
+
+    seq_printf(s, "merged %llu overtaken %llu erase skipped %llu bounced %llu\n",
+        chip->stat_merged, chip->stat_overtaken, chip->stat_erase_skipped,
+        chip->stat_bounced);
+    seq_printf(s, "ecc corrected %u failed %u\n",
+        ecc.corrected, ecc.failed);
+
+    return 0;
+}
+
+static int w25n_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, w25n_stats_show, inode->i_private);
+}
+
+/* 写任意内容清空计数 */
+static ssize_t w25n_stats_write(struct file *file, const char __user *buf,
+        size_t count, loff_t *ppos)
+{
+    struct seq_file *s = file->private_data;
+    struct w25n_chip *chip = s->private;
+    unsigned long flags;
+
+    spin_lock_irqsave(&chip->stats_lock, flags);
+    memset(chip->req_stats, 0, sizeof(chip->req_stats));
+    chip->stat_merged = chip->stat_overtaken = chip->stat_erase_skipped = 0;
+    chip->stat_bounced = 0;
+    spin_unlock_irqrestore(&chip->stats_lock, flags);
+
+    return count;
+}
+
+static int w25n_bbt_show(struct seq_file *s, void *unused)
+{
+    static const char * const state[] = { "good", "worn", "reserved", "factory" };
+    struct w25n_chip *chip = s->private;
+    unsigned int block;
+    int i;
+
+    seq_printf(s, "version %u block %u spares %u\n",
+        chip->bbt_version, chip->bbt_block, chip->bbt_spares);
+    for (block = 0; block < W25N_BLOCKS; block++) {
+        if (w25n_bbt_get(chip, block) != W25N_BLOCK_GOOD)
+            seq_printf(s, "%4u: %s\n", block, state[w25n_bbt_get(chip, block)]);
+    }
+
+    seq_puts(s, "lut:\n");
+    for (i = 0; i < W25N_LUT_ENTRIES; i++) {
+        if (chip->bbm_lut[i].lba & 0x8000)
+            seq_printf(s, "  %4u -> %4u%s\n", chip->bbm_lut[i].lba & 0x3ff,
+                chip->bbm_lut[i].pba & 0x3ff,
+                (chip->bbm_lut[i].lba & 0x4000) ? " invalid" : "");
+    }
+
+    return 0;
+}
+
+static int w25n_bbt_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, w25n_bbt_show, inode->i_private);
+}
+
+static const struct file_operations w25n_bbt_fops = {
+    .owner      = THIS_MODULE,
+    .open       = w25n_bbt_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static const struct file_operations w25n_stats_fops = {
+    .owner      = THIS_MODULE,
+    .open       = w25n_stats_open,
+    .read       = seq_read,
+    .write      = w25n_stats_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static const struct file_operations w25n_latency_fops = {
+    .owner      = THIS_MODULE,
+    .open       = w25n_latency_open,
+    .read       = seq_read,
+    .write      = w25n_latency_write,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+/* 没有label属性时第一个芯片沿用原来的名字, 之后的加序号 */
+static atomic_t w25n_chip_count = ATOMIC_INIT(0);
+
+/* 旧板子没有设备树节点时由模块参数指定的芯片 */
+static struct w25n_chip *legacy_chip;
+
+/* 按第一个芯片的参数构造条带化的mtd, 调用时持有w25n_stripe_lock */
+static int w25n_stripe_register(struct w25n_stripe *st)
+{
+    struct w25n_chip *chip = st->chips[0];
+    struct mtd_info *mtd = &st->mtd;
+    int c;
+
+    memset(mtd, 0, sizeof(*mtd));
+    /* 坏块和BBT保留块数是各芯片之和, 与mtdconcat相同 */
+    for (c = 0; c < st->nchips; c++) {
+        mtd->ecc_stats.badblocks += st->chips[c]->mtd.ecc_stats.badblocks;
+        mtd->ecc_stats.bbtblocks += st->chips[c]->mtd.ecc_stats.bbtblocks;
+    }
+    mtd->name = "yusense_spi_stripe";
+    mtd->type = MTD_NANDFLASH;
+    mtd->flags = MTD_CAP_NANDFLASH;
+    mtd->size = chip->mtd.size * st->nchips;
+    mtd->writesize = SPI_FLASH_PAGE_SIZE;
+    mtd->writebufsize = SPI_FLASH_PAGE_SIZE;
+    mtd->erasesize = SPI_FLASH_BLOCK_SIZE * st->nchips;
+    mtd->oobsize = SPI_FLASH_OOB_SIZE;
+    mtd->ecc_step_size = W25N_ECC_STEP;
+    mtd->ecc_strength = W25N_ECC_STRENGTH;
+    mtd->bitflip_threshold = W25N_ECC_STRENGTH;
+    mtd_set_ooblayout(mtd, &w25n_ooblayout);
+    mtd->oobavail = chip->mtd.oobavail;
+
+    mtd->owner = THIS_MODULE;
+    mtd->priv = st;
+    mtd->dev.parent = &chip->spi->dev;
+    mtd->_erase = w25n_stripe_erase;
+    mtd->_read  = w25n_stripe_read;
+    mtd->_write = w25n_stripe_write;
+    mtd->_read_oob  = w25n_stripe_read_oob;
+    mtd->_write_oob = w25n_stripe_write_oob;
+    mtd->_block_isbad   = w25n_stripe_block_isbad;
+    mtd->_block_markbad = w25n_stripe_block_markbad;
+    mtd->_block_isreserved = w25n_stripe_block_isreserved;
+
+    printk("[%s]%s: %d chips, %llu bytes\n", __func__, mtd->name,
+        st->nchips, (unsigned long long)mtd->size);
+    return mtd_device_register(mtd, NULL, 0);
+}
+
+/* 条带未满时芯片加入条带, 凑齐后注册条带的mtd; 否则单独注册 */
+static int w25n_chip_add(struct w25n_chip *chip)
+{
+    struct w25n_stripe *st = &w25n_stripe;
+    int status = 0;
+    int i;
+
+    mutex_lock(&w25n_stripe_lock);
+    if (st->registered || st->nchips >= stripe_chips) {
+        mutex_unlock(&w25n_stripe_lock);
+        return mtd_device_register(&chip->mtd, NULL, 0);
+    }
+
+    /* 按设备名插入 */
+    for (i = st->nchips; i > 0; i--) {
+        if (strcmp(dev_name(&st->chips[i - 1]->spi->dev),
+                   dev_name(&chip->spi->dev)) < 0)
+            break;
+        st->chips[i] = st->chips[i - 1];
+    }
+    st->chips[i] = chip;
+    st->nchips++;
+    chip->stripe = st;
+
+    if (st->nchips == stripe_chips) {
+        status = w25n_stripe_register(st);
+        if (status) {
+            memmove(&st->chips[i], &st->chips[i + 1],
+                (st->nchips - i - 1) * sizeof(st->chips[0]));
+            st->nchips--;
+            chip->stripe = NULL;
+        } else {
+            st->registered = 1;
+        }
+    }
+    mutex_unlock(&w25n_stripe_lock);
+
+    return status;
+}
+
+/**
+ * 条带中的任一芯片移除时注销整个条带, 剩下的芯片等待重新凑齐.
+ * 驱动禁止了sysfs unbind, 只有rmmod或SPI控制器移除时才会走到这里,
+ * 前者有模块引用计数保证mtd没有使用者. 注销失败也要继续释放,
+ * remove的返回值驱动核心不理会, 设备照样解绑
+ */
+static void w25n_chip_del(struct w25n_chip *chip)
+{
+    struct w25n_stripe *st = chip->stripe;
+    int i;
+
+    if (!st) {
+        WARN_ON(mtd_device_unregister(&chip->mtd));
+        return;
+    }
+
+    mutex_lock(&w25n_stripe_lock);
+    if (st->registered) {
+        WARN_ON(mtd_device_unregister(&st->mtd));
+        st->registered = 0;
+    }
+    for (i = 0; st->chips[i] != chip; i++)
+        ;
+    memmove(&st->chips[i], &st->chips[i + 1],
+        (st->nchips - i - 1) * sizeof(st->chips[0]));
+    st->nchips--;
+    chip->stripe = NULL;
+    mutex_unlock(&w25n_stripe_lock);
+}
+
+static struct w25n_chip *w25n_chip_create(struct spi_device *spi)
+{
+    struct w25n_chip *chip;
+    const char *name = NULL;
+    int index;
+    int status = 0;
+
+    chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+    if (!chip)
+        return ERR_PTR(-ENOMEM);
+
+    chip->spi = spi;
+    chip->buf_page = -1;
+    chip->io.read_op = 0x03;
+    chip->io.read_nbits = SPI_NBITS_SINGLE;
+    chip->io.load_op = 0x02;
+    chip->io.load_nbits = SPI_NBITS_SINGLE;
+    spin_lock_init(&chip->queue_lock);
+    spin_lock_init(&chip->lat_lock);
+    spin_lock_init(&chip->stats_lock);
+    INIT_LIST_HEAD(&chip->read_queue);
+    INIT_LIST_HEAD(&chip->write_queue);
+    INIT_WORK(&chip->work, w25n_work_fn);
+
+    SPIFlashReadID(chip);
+    //SPIChangeReg1Buf();
+    //SPIChangeBuf();
+    writeReg(chip, 0xa0, 0x00);
+    chip->reg2_val = readReg(chip, 0xb0);
+    SPIFlashSetBufMode(chip, 1);
+    SPIFlashSetEcc(chip, 1);
+    SPIFlashSetupIO(chip);
+    w25n_msgs_init(chip);
+
+    chip->page_buf = kmalloc(SPI_FLASH_PAGE_SIZE + SPI_FLASH_OOB_SIZE, GFP_KERNEL);
+    chip->bounce = kmalloc(SPI_FLASH_PAGE_SIZE + SPI_FLASH_OOB_SIZE, GFP_KERNEL);
+    if (!chip->page_buf || !chip->bounce) {
+        status = -ENOMEM;
+        goto end2;
+    }
+
+    /* 页缓存分配失败时退化为不带缓存 */
+    if (w25n_cache_alloc(chip)) {
+        printk("[%s]page cache disabled\n", __func__);
+        w25n_cache_free(chip);
+    }
+
+    //构造mtd_info
+    index = atomic_inc_return(&w25n_chip_count) - 1;
+    if (of_property_read_string(spi->dev.of_node, "label", &name)) {
+        if (index)
+            snprintf(chip->name, sizeof(chip->name),
+                "yusense_spi_flash.%d", index);
+        else
+            strcpy(chip->name, "yusense_spi_flash");
+        name = chip->name;
+    }
+    chip->mtd.name = name;
+    chip->mtd.type = MTD_NANDFLASH;
+    chip->mtd.flags = MTD_CAP_NANDFLASH;
+    chip->mtd.size = 0x8000000;  /* 128M */
+    chip->mtd.writesize = SPI_FLASH_PAGE_SIZE;
+    chip->mtd.writebufsize = SPI_FLASH_PAGE_SIZE;
+    chip->mtd.erasesize = SPI_FLASH_BLOCK_SIZE;
+    chip->mtd.oobsize = SPI_FLASH_OOB_SIZE;
+    chip->mtd.ecc_step_size = W25N_ECC_STEP;
+    chip->mtd.ecc_strength = W25N_ECC_STRENGTH;
+    chip->mtd.bitflip_threshold = W25N_ECC_STRENGTH;
+    mtd_set_ooblayout(&chip->mtd, &w25n_ooblayout);
+    chip->mtd.oobavail = mtd_ooblayout_count_freebytes(&chip->mtd);
+
+    chip->mtd.owner = THIS_MODULE;
+    chip->mtd.priv = chip;
+    chip->mtd.dev.parent = &spi->dev;
+    mtd_set_of_node(&chip->mtd, spi->dev.of_node);
+    chip->mtd._erase = my_flash_erase;
+    chip->mtd._read  = my_flash_read;
+    chip->mtd._write = my_flash_write;
+    chip->mtd._read_oob  = my_flash_read_oob;
+    chip->mtd._write_oob = my_flash_write_oob;
+    chip->mtd._block_isbad   = my_flash_block_isbad;
+    chip->mtd._block_markbad = my_flash_block_markbad;
+    chip->mtd._block_isreserved = my_flash_block_isreserved;
+
+    status = w25n_bbt_init(chip);
+    if (status) {
+        printk("[%s]bbt init failed %d\n", __func__, status);
+        goto end2;
+    }
+
+    /* 读写都在这个工作队列中执行, 回写内存时也要能推进 */
+    chip->wq = alloc_ordered_workqueue("w25n01gw/%s",
+        WQ_HIGHPRI | WQ_MEM_RECLAIM, dev_name(&spi->dev));
+    if (!chip->wq) {
+        status = -ENOMEM;
+        goto end2;
+    }
+
+    status = w25n_chip_add(chip);
+    if (status)
+        goto end3;
+
+    /* debugfs不是必须的, 创建失败不影响驱动 */
+    chip->debugfs = debugfs_create_dir(dev_name(&spi->dev), w25n_debugfs);
+    if (!IS_ERR_OR_NULL(chip->debugfs)) {
+        debugfs_create_file("latency", S_IRUGO | S_IWUSR, chip->debugfs,
+            chip, &w25n_latency_fops);
+        debugfs_create_file("bbt", S_IRUGO, chip->debugfs,
+            chip, &w25n_bbt_fops);
+        debugfs_create_file("stats", S_IRUGO | S_IWUSR, chip->debugfs,
+            chip, &w25n_stats_fops);
+    }
+
+    return chip;
+
+end3:
+    destroy_workqueue(chip->wq);
+end2:
+    w25n_cache_free(chip);
+    kfree(chip->bounce);
+    kfree(chip->page_buf);
+    kfree(chip);
+    return ERR_PTR(status);
+}
+
+static void w25n_chip_destroy(struct w25n_chip *chip)
+{
+    debugfs_remove_recursive(chip->debugfs);
+    w25n_chip_del(chip);
+    destroy_workqueue(chip->wq);
+    w25n_cache_free(chip);
+    kfree(chip->bounce);
+    kfree(chip->page_buf);
+    kfree(chip);
+}
+
+static int w25n01gw_probe(struct spi_device *spi)
+{
+    struct w25n_chip *chip;
+
+    chip = w25n_chip_create(spi);
+    if (IS_ERR(chip))
+        return PTR_ERR(chip);
+
+    spi_set_drvdata(spi, chip);
+    return 0;
+}
+
+static int w25n01gw_remove(struct spi_device *spi)
+{
+    w25n_chip_destroy(spi_get_drvdata(spi));
+    return 0;
+}
+
+static const struct of_device_id w25n01gw_of_match[] = {
+    { .compatible = "winbond,w25n01gw" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, w25n01gw_of_match);
+
+static const struct spi_device_id w25n01gw_ids[] = {
+    { "w25n01gw", 0 },
+    { }
+};
+MODULE_DEVICE_TABLE(spi, w25n01gw_ids);
+
+static struct spi_driver w25n01gw_driver = {
+    .driver = {
+        .name           = "w25n01gw",
+        .of_match_table = of_match_ptr(w25n01gw_of_match),
+        /* mtd可能正在使用, 不允许通过sysfs解绑 */
+        .suppress_bind_attrs = true,
+    },
+    .id_table   = w25n01gw_ids,
+    .probe      = w25n01gw_probe,
+    .remove     = w25n01gw_remove,
+};
+
+/**
+ * 旧板子的设备树里没有w25n01gw节点, 直接使用bus_num.csn上已有的spi设备,
+ * 该设备可能已绑定到spidev等其他驱动, 所以不使用drvdata
+*/
+static void w25n_legacy_attach(void)
+{
+    struct spi_master *master;
+    struct w25n_chip *chip;
+    struct device *d;
+    char spi_name[12];
+
+    master = spi_busnum_to_master(bus_num);
+    if (!master)
+        return;
+
+    sprintf(spi_name, "%s.%u", dev_name(&master->dev), csn);
+    printk("spi_name = %s\n", spi_name);
+    d = bus_find_device_by_name(&spi_bus_type, NULL, spi_name);
+    put_device(&master->dev);
+    if (d == NULL)
+        return;
+
+    /* 已经由本驱动probe过 */
+    if (d->driver == &w25n01gw_driver.driver) {
+        put_device(d);
+        return;
+    }
+
+    chip = w25n_chip_create(to_spi_device(d));
+    if (IS_ERR(chip)) {
+        printk("[%s]%s: %ld\n", __func__, spi_name, PTR_ERR(chip));
+        put_device(d);
+        return;
+    }
+    legacy_chip = chip;
+}
+
+static int __init w25n01gw_init(void)
+{
+    int status;
+
+    if (stripe_chips > W25N_STRIPE_MAX) {
+        printk("[%s]stripe_chips %u > %d\n", __func__, stripe_chips,
+            W25N_STRIPE_MAX);
+        return -EINVAL;
+    }
+
+    w25n_debugfs = debugfs_create_dir("w25n01gw", NULL);
+
+    status = spi_register_driver(&w25n01gw_driver);
+    if (status) {
+        debugfs_remove_recursive(w25n_debugfs);
+        return status;
+    }
+
+    if (bus_num >= 0)
+        w25n_legacy_attach();
+
+    return 0;
+}
+
+static void __exit w25n01gw_exit(void)
+{
+    struct spi_device *spi;
+
+    if (legacy_chip) {
+        spi = legacy_chip->spi;
+        w25n_chip_destroy(legacy_chip);
+        put_device(&spi->dev);
+    }
+
+    spi_unregister_driver(&w25n01gw_driver);
+    debugfs_remove_recursive(w25n_debugfs);
 }
 
 module_init(w25n01gw_init);
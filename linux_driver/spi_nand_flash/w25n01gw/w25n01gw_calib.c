@@ -0,0 +1,360 @@
+/**
+ * 标定记录缓存: 标定分区出现时按calstore格式找到最新的标定记录,
+ * 校验后缓存在一页内核内存中, 通过/dev/w25n_calib只读导出.
+ * 应用程序mmap后直接用calib_decode/calib_decode_band解析, 不再产生SPI传输,
+ * 多个进程共享同一页.
+ *
+ * 用法:
+ *   insmod w25n01gw_calib.ko mtd_index=3
+ *   read()/mmap() /dev/w25n_calib     长度为记录长度, 格式见calib.h
+ *   echo 1 > /dev/w25n_calib           flashtest更新标定后重新读取(需要root)
+ * 重新读取时换一个新页, 已有的映射仍指向旧记录, 重新mmap后看到新记录.
+*/
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/crc32.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/mtd/mtd.h>
+
+#include "calib.h"
+#include "calstore.h"
+#include "calib_le.h"
+
+/* 标定分区的mtd编号, 与应用程序原来使用的/dev/mtd3一致 */
+static int mtd_index = 3;
+module_param(mtd_index, int, S_IRUGO);
+MODULE_PARM_DESC(mtd_index, "mtd device holding the calibration store");
+
+static DEFINE_MUTEX(wcal_lock);
+static struct page *wcal_page;      /* 当前记录, 没有为NULL */
+static size_t wcal_len;
+
+/* 与calib_crc32相同(zlib crc32) */
+static u32 wcal_crc32(u32 crc, const void *buf, size_t len)
+{
+    return crc32_le(crc ^ ~0U, buf, len) ^ ~0U;
+}
+
+static int wcal_read_page(struct mtd_info *mtd, loff_t ofs, u8 *buf)
+{
+    size_t retlen;
+    int ret;
+
+    ret = mtd_read(mtd, ofs, mtd->writesize, &retlen, buf);
+    if (ret < 0 && !mtd_is_bitflip(ret))
+        return ret;
+    return retlen == mtd->writesize ? 0 : -EIO;
+}
+
+static int wcal_blank(const u8 *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+/* 校验calstore记录, 返回数据长度, 无效返回-1 */
+static int wcal_parse_rec(struct mtd_info *mtd, const u8 *p, u32 *key,
+        u32 *seq)
+{
+    unsigned int len;
+    u32 crc;
+
+    if (get_le32(p) != CALSTORE_MAGIC_REC)
+        return -1;
+
+    len = get_le16(p + 12);
+    if (len > mtd->writesize - CALSTORE_REC_HDR)
+        return -1;
+
+    crc = wcal_crc32(0, p, 16);
+    crc = wcal_crc32(crc, p + CALSTORE_REC_HDR, len);
+    if (crc != get_le32(p + 16))
+        return -1;
+
+    *key = get_le32(p + 4);
+    *seq = get_le32(p + 8);
+    return len;
+}
+
+/* 校验标定记录本身的头和CRC, 与calib_decode一致 */
+static int wcal_check_calib(const u8 *p, size_t len)
+{
+    unsigned int hdr_size, size;
+    u32 crc;
+
+    if (len < CALIB_HDR_SIZE || get_le32(p) != CALIB_MAGIC)
+        return -EBADMSG;
+
+    hdr_size = get_le16(p + 6);
+    size = hdr_size + get_le16(p + 16) * get_le16(p + 18);
+    if (hdr_size < CALIB_HDR_SIZE || size > len)
+        return -EBADMSG;
+
+    crc = wcal_crc32(0, p, 20);
+    crc = wcal_crc32(crc, p + hdr_size, size - hdr_size);
+    return crc == get_le32(p + 20) ? 0 : -EBADMSG;
+}
+
+/**
+ * 找key为CALSTORE_KEY_CALIB且seq最大的记录所在页.
+ * 写满的块只读摘要页, 未写满的块读块头和已写的页, 与calstore_open相同
+*/
+static loff_t wcal_find(struct mtd_info *mtd, u8 *buf, u32 *best_seq)
+{
+    unsigned int ppb = mtd->erasesize / mtd->writesize;
+    unsigned int nblocks = mtd_div_by_eb(mtd->size, mtd);
+    loff_t best = -1;
+    loff_t base;
+    unsigned int b, i, n;
+    u32 key, seq;
+
+    *best_seq = 0;
+    for (b = 0; b < nblocks; b++) {
+        base = (loff_t)b * mtd->erasesize;
+        if (mtd_block_isbad(mtd, base) > 0)
+            continue;
+
+        if (!wcal_read_page(mtd, base + (ppb - 1) * mtd->writesize, buf) &&
+            get_le32(buf) == CALSTORE_MAGIC_SUM) {
+            n = get_le16(buf + 8);
+            if (n == ppb - 2 && 12 + n * 8 + 4 <= mtd->writesize &&
+                wcal_crc32(0, buf, 12 + n * 8) == get_le32(buf + 12 + n * 8)) {
+                for (i = 0; i < n; i++) {
+                    key = get_le32(buf + 12 + i * 8);
+                    seq = get_le32(buf + 16 + i * 8);
+                    if (seq && key == CALSTORE_KEY_CALIB && seq > *best_seq) {
+                        *best_seq = seq;
+                        best = base + (1 + i) * mtd->writesize;
+                    }
+                }
+                continue;
+            }
+        }
+
+        if (wcal_read_page(mtd, base, buf) ||
+            get_le32(buf) != CALSTORE_MAGIC_HDR ||
+            wcal_crc32(0, buf, 8) != get_le32(buf + 8))
+            continue;
+
+        for (i = 1; i < ppb - 1; i++) {
+            if (wcal_read_page(mtd, base + i * mtd->writesize, buf))
+                continue;
+            if (wcal_blank(buf, mtd->writesize))
+                break;
+            if (wcal_parse_rec(mtd, buf, &key, &seq) < 0)
+                continue;
+            if (key == CALSTORE_KEY_CALIB && seq > *best_seq) {
+                *best_seq = seq;
+                best = base + i * mtd->writesize;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* 读出并校验最新的标定记录, 换入新页 */
+static int wcal_load(struct mtd_info *mtd)
+{
+    struct page *page, *old;
+    loff_t ofs;
+    u8 *buf;
+    u32 key, seq;
+    int len;
+    int ret;
+
+    if (mtd->writesize > PAGE_SIZE || mtd->erasesize < 4 * mtd->writesize)
+        return -EINVAL;
+
+    buf = kmalloc(mtd->writesize, GFP_KERNEL);
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!buf || !page) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ofs = wcal_find(mtd, buf, &seq);
+    if (ofs < 0) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    ret = wcal_read_page(mtd, ofs, buf);
+    if (ret)
+        goto out;
+    len = wcal_parse_rec(mtd, buf, &key, &seq);
+    if (len < 0 || key != CALSTORE_KEY_CALIB) {
+        ret = -EBADMSG;
+        goto out;
+    }
+    ret = wcal_check_calib(buf + CALSTORE_REC_HDR, len);
+    if (ret)
+        goto out;
+
+    memcpy(page_address(page), buf + CALSTORE_REC_HDR, len);
+
+    mutex_lock(&wcal_lock);
+    old = wcal_page;
+    wcal_page = page;
+    wcal_len = len;
+    mutex_unlock(&wcal_lock);
+    page = old;
+
+    printk("[%s]%s: record %u at 0x%llx, %d bytes\n", __func__, mtd->name,
+        seq, (unsigned long long)ofs, len);
+
+out:
+    /* 映射持有自己的引用, 最后一个映射解除后旧页才释放 */
+    if (page)
+        put_page(page);
+    kfree(buf);
+    return ret;
+}
+
+/* 取当前记录页的引用 */
+static struct page *wcal_get(size_t *len)
+{
+    struct page *page;
+
+    mutex_lock(&wcal_lock);
+    page = wcal_page;
+    if (page) {
+        get_page(page);
+        *len = wcal_len;
+    }
+    mutex_unlock(&wcal_lock);
+
+    return page;
+}
+
+static ssize_t wcal_read(struct file *file, char __user *ubuf, size_t count,
+        loff_t *ppos)
+{
+    struct page *page;
+    size_t len;
+    ssize_t ret;
+
+    page = wcal_get(&len);
+    if (!page)
+        return -ENOENT;
+
+    ret = simple_read_from_buffer(ubuf, count, ppos, page_address(page), len);
+    put_page(page);
+    return ret;
+}
+
+/* 写任意内容重新读取分区 */
+static ssize_t wcal_write(struct file *file, const char __user *ubuf,
+        size_t count, loff_t *ppos)
+{
+    struct mtd_info *mtd;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    mtd = get_mtd_device(NULL, mtd_index);
+    if (IS_ERR(mtd))
+        return PTR_ERR(mtd);
+
+    ret = wcal_load(mtd);
+    put_mtd_device(mtd);
+
+    return ret ? ret : count;
+}
+
+static int wcal_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct page *page;
+    size_t len;
+    int ret;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EACCES;
+
+    page = wcal_get(&len);
+    if (!page)
+        return -ENOENT;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    ret = vm_insert_page(vma, vma->vm_start, page);
+    put_page(page);
+    return ret;
+}
+
+static const struct file_operations wcal_fops = {
+    .owner  = THIS_MODULE,
+    .read   = wcal_read,
+    .write  = wcal_write,
+    .mmap   = wcal_mmap,
+    .llseek = default_llseek,
+};
+
+static struct miscdevice wcal_misc = {
+    .minor  = MISC_DYNAMIC_MINOR,
+    .name   = "w25n_calib",
+    .fops   = &wcal_fops,
+    .mode   = 0644,
+};
+
+/* 加载本模块时分区已存在也会调用 */
+static void wcal_notify_add(struct mtd_info *mtd)
+{
+    int ret;
+
+    if (mtd->index != mtd_index)
+        return;
+
+    ret = wcal_load(mtd);
+    if (ret)
+        printk("[%s]%s: no calibration record: %d\n", __func__, mtd->name,
+            ret);
+}
+
+static void wcal_notify_remove(struct mtd_info *mtd)
+{
+}
+
+static struct mtd_notifier wcal_notifier = {
+    .add    = wcal_notify_add,
+    .remove = wcal_notify_remove,
+};
+
+static int __init wcal_init(void)
+{
+    int ret;
+
+    ret = misc_register(&wcal_misc);
+    if (ret)
+        return ret;
+
+    register_mtd_user(&wcal_notifier);
+    return 0;
+}
+
+static void __exit wcal_exit(void)
+{
+    unregister_mtd_user(&wcal_notifier);
+    misc_deregister(&wcal_misc);
+
+    if (wcal_page)
+        put_page(wcal_page);
+}
+
+module_init(wcal_init);
+module_exit(wcal_exit);
+
+MODULE_LICENSE("GPL");
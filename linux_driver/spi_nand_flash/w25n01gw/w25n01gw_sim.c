@@ -0,0 +1,681 @@
+/**
+ * W25N01GW模拟器: 注册chips个虚拟SPI控制器, 每个在片选0上挂一个按手册行为
+ * 响应指令的SPI NAND, 用于没有板子时在QEMU或普通PC上测试和评估w25n01gw驱动.
+ * 设备的modalias是w25n01gw, 驱动加载后自动probe.
+ *
+ * 用法(PC/QEMU上先 make -C /lib/modules/`uname -r`/build M=`pwd` modules
+ * 和 make tools TOOL_PREFIX= ):
+ *   insmod w25n01gw_sim.ko bus_num=9
+ *   insmod w25n01gw.ko bus_num=-1
+ *   ./flashbench -d /dev/mtdX -f
+ * 条带化(总线9-12上的4个芯片):
+ *   insmod w25n01gw_sim.ko bus_num=9 chips=4
+ *   insmod w25n01gw.ko bus_num=-1 stripe_chips=4
+ *
+ * 支持的指令: 0x9f 0x05/0x0f 0x01/0x1f 0x06 0x04 0xff 0x13 0x03 0x3b 0x6b
+ * 0x02 0x32 0x84 0x34 0x10 0xd8 0xa5 0xa1. BUSY时间按手册典型值,
+ * SPI传输时间按speed_hz和数据线宽度计算.
+ * 存储按块惰性分配, 未写过的块读出全0xff.
+*/
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/platform_device.h>
+#include <linux/spi/spi.h>
+
+static unsigned bus_num = 9;
+module_param(bus_num, uint, S_IRUGO);
+MODULE_PARM_DESC(bus_num, "spi bus number of the first simulated controller");
+
+/* 模拟的芯片数, 每个芯片一个控制器, 总线号从bus_num起递增 */
+#define SIM_CHIPS_MAX       8
+static unsigned chips = 1;
+module_param(chips, uint, S_IRUGO);
+MODULE_PARM_DESC(chips, "number of simulated chips, one controller each");
+
+static unsigned speed_hz = 50000000;
+module_param(speed_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(speed_hz, "simulated SCK frequency");
+
+/* 0 - 不模拟时间, 1 - 模拟BUSY时间和总线传输时间 */
+static unsigned realtime = 1;
+module_param(realtime, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(realtime, "emulate array and bus timing, 0 - disable");
+
+/* 数据线宽度上限, 决定控制器声明的mode_bits */
+static unsigned io_width = 4;
+module_param(io_width, uint, S_IRUGO);
+MODULE_PARM_DESC(io_width, "max data lines of the simulated controller: 1, 2, 4");
+
+/* 出厂坏块, 第一页spare区第0字节置0 */
+static int factory_bad[8];
+static int factory_bad_num;
+module_param_array(factory_bad, int, &factory_bad_num, S_IRUGO);
+MODULE_PARM_DESC(factory_bad, "factory bad blocks");
+
+/* 读这一页时报告ECC纠正/不可纠正, -1关闭 */
+static int ecc_fix_page = -1;
+module_param(ecc_fix_page, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ecc_fix_page, "page that reports corrected bitflips");
+static int ecc_fail_page = -1;
+module_param(ecc_fail_page, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ecc_fail_page, "page that reports an uncorrectable ECC error");
+
+#define SIM_PAGE_SIZE       2048
+#define SIM_OOB_SIZE        64
+#define SIM_PAGE_TOTAL      (SIM_PAGE_SIZE + SIM_OOB_SIZE)
+#define SIM_PAGES_PER_BLOCK 64
+#define SIM_BLOCKS          1024
+#define SIM_PAGES           (SIM_BLOCKS * SIM_PAGES_PER_BLOCK)
+#define SIM_LUT_ENTRIES     20
+
+/* 手册典型时间(us) */
+#define SIM_T_RD            25
+#define SIM_T_PP            250
+#define SIM_T_BE            2000
+
+#define SR2_BUF     (1 << 3)
+#define SR2_ECCE    (1 << 4)
+#define SR3_BUSY    (1 << 0)
+#define SR3_WEL     (1 << 1)
+#define SR3_EFAIL   (1 << 2)
+#define SR3_PFAIL   (1 << 3)
+#define SR3_ECC_MASK    (3 << 4)
+#define SR3_LUTF    (1 << 6)
+
+/* 一个片选周期内的解析状态 */
+enum {
+    SIM_OPCODE,
+    SIM_HDR,
+    SIM_DATA,
+};
+
+struct w25n_sim {
+    struct spi_master  *master;
+    u8                 *blocks[SIM_BLOCKS];    /* NULL表示整块为擦除状态 */
+    u8                  buf[SIM_PAGE_TOTAL];    /* 芯片数据缓冲区 */
+    u8                  sr1, sr2, sr3;
+    ktime_t             busy_until;
+    struct {
+        u16 lba;
+        u16 pba;
+    } lut[SIM_LUT_ENTRIES];
+    int                 lut_num;
+
+    /* 当前片选周期 */
+    int                 state;
+    int                 busy;       /* 片选有效时芯片是否忙 */
+    u8                  op;
+    u8                  hdr[4];
+    int                 hdr_len;
+    int                 hdr_need;
+    unsigned int        pos;        /* 数据阶段的列地址或字节序号 */
+    unsigned int        page;       /* 连续读的当前页 */
+};
+
+static struct platform_device *sim_pdev;
+static struct spi_device *sim_spi[SIM_CHIPS_MAX];
+
+static void sim_set_busy(struct w25n_sim *sim, unsigned int us)
+{
+    sim->busy_until = ktime_add_us(ktime_get(), realtime ? us : 0);
+}
+
+static int sim_is_busy(struct w25n_sim *sim)
+{
+    return ktime_before(ktime_get(), sim->busy_until);
+}
+
+/* 逻辑块经BBM LUT映射后的物理块 */
+static unsigned int sim_phys_block(struct w25n_sim *sim, unsigned int block)
+{
+    int i;
+
+    for (i = 0; i < sim->lut_num; i++) {
+        if (sim->lut[i].lba == block)
+            return sim->lut[i].pba;
+    }
+
+    return block;
+}
+
+static u8 *sim_page_data(struct w25n_sim *sim, unsigned int page, int alloc)
+{
+    unsigned int block = sim_phys_block(sim, page / SIM_PAGES_PER_BLOCK);
+
+    if (!sim->blocks[block] && alloc) {
+        sim->blocks[block] = vmalloc(SIM_PAGES_PER_BLOCK * SIM_PAGE_TOTAL);
+        if (sim->blocks[block])
+            memset(sim->blocks[block], 0xff,
+                SIM_PAGES_PER_BLOCK * SIM_PAGE_TOTAL);
+    }
+    if (!sim->blocks[block])
+        return NULL;
+
+    return sim->blocks[block] + (page % SIM_PAGES_PER_BLOCK) * SIM_PAGE_TOTAL;
+}
+
+/* 0x13: 页装入数据缓冲区, 设置ECC状态 */
+static void sim_load_page(struct w25n_sim *sim, unsigned int page, int accumulate)
+{
+    u8 *data = (page < SIM_PAGES) ? sim_page_data(sim, page, 0) : NULL;
+    u8 ecc = 0;
+
+    if (data)
+        memcpy(sim->buf, data, SIM_PAGE_TOTAL);
+    else
+        memset(sim->buf, 0xff, SIM_PAGE_TOTAL);
+
+    if (sim->sr2 & SR2_ECCE) {
+        if (page == ecc_fail_page)
+            ecc = 2;
+        else if (page == ecc_fix_page)
+            ecc = 1;
+    }
+
+    /* 连续读时ECC位汇总多页, 多页不可纠正报3 */
+    if (accumulate) {
+        u8 old = (sim->sr3 & SR3_ECC_MASK) >> 4;
+
+        if (ecc == 2 && old >= 2)
+            ecc = 3;
+        ecc = max(ecc, old);
+    }
+    sim->sr3 = (sim->sr3 & ~SR3_ECC_MASK) | (ecc << 4);
+}
+
+static void sim_program(struct w25n_sim *sim, unsigned int page)
+{
+    u8 *data;
+    int i;
+
+    sim->sr3 &= ~SR3_PFAIL;
+    if (page >= SIM_PAGES || (sim->sr1 & 0x7c) ||
+        !(data = sim_page_data(sim, page, 1))) {
+        sim->sr3 |= SR3_PFAIL;
+        return;
+    }
+
+    /* NAND编程只能把1变成0 */
+    for (i = 0; i < SIM_PAGE_TOTAL; i++)
+        data[i] &= sim->buf[i];
+
+    sim_set_busy(sim, SIM_T_PP);
+}
+
+static void sim_erase(struct w25n_sim *sim, unsigned int page)
+{
+    unsigned int block;
+
+    sim->sr3 &= ~SR3_EFAIL;
+    if (page >= SIM_PAGES || (sim->sr1 & 0x7c)) {
+        sim->sr3 |= SR3_EFAIL;
+        return;
+    }
+
+    block = sim_phys_block(sim, page / SIM_PAGES_PER_BLOCK);
+    vfree(sim->blocks[block]);
+    sim->blocks[block] = NULL;
+
+    sim_set_busy(sim, SIM_T_BE);
+}
+
+static void sim_remap(struct w25n_sim *sim, u16 lba, u16 pba)
+{
+    if (sim->lut_num == SIM_LUT_ENTRIES)
+        return;
+
+    sim->lut[sim->lut_num].lba = lba & 0x3ff;
+    sim->lut[sim->lut_num].pba = pba & 0x3ff;
+    if (++sim->lut_num == SIM_LUT_ENTRIES)
+        sim->sr3 |= SR3_LUTF;
+}
+
+static u8 sim_read_reg(struct w25n_sim *sim, u8 reg)
+{
+    switch (reg & 0xf0) {
+    case 0xa0:
+        return sim->sr1;
+    case 0xb0:
+        return sim->sr2;
+    case 0xc0:
+        return sim->sr3 | (sim_is_busy(sim) ? SR3_BUSY : 0);
+    default:
+        return 0;
+    }
+}
+
+/* 指令后到数据阶段之前的字节数: 地址, 列地址和dummy */
+static int sim_hdr_len(struct w25n_sim *sim, u8 op)
+{
+    switch (op) {
+    case 0x9f: case 0xa5:
+        return 1;
+    case 0x05: case 0x0f: case 0x01: case 0x1f:
+        return 1;
+    case 0x13: case 0x10: case 0xd8:
+        return 3;
+    case 0x02: case 0x32: case 0x84: case 0x34:
+        return 2;
+    case 0x03:
+        return 3;
+    case 0x3b: case 0x6b:
+        return (sim->sr2 & SR2_BUF) ? 3 : 4;
+    case 0xa1:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/* 片选有效后不需要地址的指令立即生效 */
+static void sim_begin(struct w25n_sim *sim)
+{
+    if (sim->busy && sim->op != 0x05 && sim->op != 0x0f &&
+        sim->op != 0x9f && sim->op != 0xff)
+        return;
+
+    switch (sim->op) {
+    case 0x06:
+        sim->sr3 |= SR3_WEL;
+        break;
+    case 0x04:
+        sim->sr3 &= ~SR3_WEL;
+        break;
+    case 0xff:
+        sim->sr2 |= SR2_BUF;
+        sim->sr3 &= SR3_LUTF;
+        sim_set_busy(sim, 500);
+        break;
+    }
+}
+
+/* 头部收齐, 进入数据阶段 */
+static void sim_start_data(struct w25n_sim *sim)
+{
+    sim->pos = 0;
+
+    switch (sim->op) {
+    case 0x03: case 0x3b: case 0x6b:
+        if (sim->sr2 & SR2_BUF) {
+            sim->pos = (sim->hdr[0] << 8) | sim->hdr[1];
+        } else {
+            /* 连续读从缓冲区中已装载的页开始 */
+            sim->pos = 0;
+        }
+        break;
+    case 0x02: case 0x32:
+        memset(sim->buf, 0xff, SIM_PAGE_TOTAL);
+        /* fall through */
+    case 0x84: case 0x34:
+        sim->pos = (sim->hdr[0] << 8) | sim->hdr[1];
+        break;
+    }
+}
+
+/* 数据阶段, 返回处理的字节数 */
+static unsigned int sim_data(struct w25n_sim *sim, const u8 *tx, u8 *rx,
+        unsigned int len)
+{
+    static const u8 jedec_id[3] = { 0xef, 0xba, 0x21 };
+    unsigned int n = len;
+    unsigned int i;
+
+    if (sim->busy && sim->op != 0x05 && sim->op != 0x0f && sim->op != 0x9f) {
+        if (rx)
+            memset(rx, 0xff, len);
+        return len;
+    }
+
+    switch (sim->op) {
+    case 0x9f:
+        for (i = 0; i < len && rx; i++)
+            rx[i] = (sim->pos + i < 3) ? jedec_id[sim->pos + i] : 0xff;
+        sim->pos += len;
+        break;
+
+    case 0x05: case 0x0f:
+        if (rx)
+            memset(rx, sim_read_reg(sim, sim->hdr[0]), len);
+        break;
+
+    case 0x01: case 0x1f:
+        if (tx && !sim->pos) {
+            if ((sim->hdr[0] & 0xf0) == 0xa0)
+                sim->sr1 = tx[0];
+            else if ((sim->hdr[0] & 0xf0) == 0xb0)
+                sim->sr2 = tx[0];
+        }
+        sim->pos += len;
+        break;
+
+    case 0x03: case 0x3b: case 0x6b:
+        if (sim->sr2 & SR2_BUF) {
+            if (sim->pos >= SIM_PAGE_TOTAL) {
+                if (rx)
+                    memset(rx, 0xff, len);
+                break;
+            }
+            n = min(len, SIM_PAGE_TOTAL - sim->pos);
+        } else {
+            /* 连续读只输出主数据区, 读完一页自动装载下一页 */
+            if (sim->pos == SIM_PAGE_SIZE) {
+                sim->page++;
+                sim_load_page(sim, sim->page, 1);
+                sim->pos = 0;
+            }
+            n = min(len, SIM_PAGE_SIZE - sim->pos);
+        }
+        if (rx)
+            memcpy(rx, sim->buf + sim->pos, n);
+        sim->pos += n;
+        break;
+
+    case 0x02: case 0x32: case 0x84: case 0x34:
+        if (!(sim->sr3 & SR3_WEL))
+            break;
+        if (sim->pos < SIM_PAGE_TOTAL && tx) {
+            n = min(len, SIM_PAGE_TOTAL - sim->pos);
+            memcpy(sim->buf + sim->pos, tx, n);
+            sim->pos += n;
+            n = len;
+        }
+        break;
+
+    case 0xa5:
+        for (i = 0; i < len && rx; i++) {
+            unsigned int e = (sim->pos + i) / 4;
+            unsigned int b = (sim->pos + i) % 4;
+            u16 v = 0;
+
+            if (e < sim->lut_num)
+                v = (b < 2) ? (sim->lut[e].lba | 0x8000) : sim->lut[e].pba;
+            rx[i] = (b & 1) ? (v & 0xff) : (v >> 8);
+        }
+        sim->pos += len;
+        break;
+    }
+
+    return n;
+}
+
+/* 片选无效时执行需要完整地址的指令 */
+static void sim_end(struct w25n_sim *sim)
+{
+    unsigned int page = (sim->hdr[1] << 8) | sim->hdr[2];
+
+    if (sim->state != SIM_DATA || sim->busy)
+        return;
+
+    switch (sim->op) {
+    case 0x13:
+        sim_load_page(sim, page, 0);
+        sim->page = page;
+        sim_set_busy(sim, SIM_T_RD);
+        break;
+
+    case 0x10:
+        if (sim->sr3 & SR3_WEL)
+            sim_program(sim, page);
+        sim->sr3 &= ~SR3_WEL;
+        break;
+
+    case 0xd8:
+        if (sim->sr3 & SR3_WEL)
+            sim_erase(sim, page);
+        sim->sr3 &= ~SR3_WEL;
+        break;
+
+    case 0xa1:
+        if (sim->sr3 & SR3_WEL)
+            sim_remap(sim, (sim->hdr[0] << 8) | sim->hdr[1],
+                (sim->hdr[2] << 8) | sim->hdr[3]);
+        sim->sr3 &= ~SR3_WEL;
+        break;
+
+    case 0x03: case 0x3b: case 0x6b:
+        /* 连续读结束后缓冲区保留最后一页 */
+        break;
+    }
+}
+
+static void sim_xfer(struct w25n_sim *sim, const u8 *tx, u8 *rx,
+        unsigned int len)
+{
+    unsigned int i = 0;
+
+    while (i < len) {
+        switch (sim->state) {
+        case SIM_OPCODE:
+            sim->op = tx ? tx[i] : 0;
+            sim->hdr_len = 0;
+            sim->hdr_need = sim_hdr_len(sim, sim->op);
+            sim->state = sim->hdr_need ? SIM_HDR : SIM_DATA;
+            sim_begin(sim);
+            if (sim->state == SIM_DATA)
+                sim_start_data(sim);
+            if (rx)
+                rx[i] = 0xff;
+            i++;
+            break;
+
+        case SIM_HDR:
+            sim->hdr[sim->hdr_len++] = tx ? tx[i] : 0;
+            if (rx)
+                rx[i] = 0xff;
+            i++;
+            if (sim->hdr_len == sim->hdr_need) {
+                sim->state = SIM_DATA;
+                sim_start_data(sim);
+            }
+            break;
+
+        default:
+            i += sim_data(sim, tx ? tx + i : NULL, rx ? rx + i : NULL,
+                len - i);
+            break;
+        }
+    }
+}
+
+/* 按时钟频率和数据线宽度模拟传输时间 */
+static void sim_bus_delay(struct spi_transfer *t)
+{
+    unsigned int nbits = max_t(unsigned int, t->tx_nbits, t->rx_nbits);
+    unsigned int hz = t->speed_hz ? t->speed_hz : speed_hz;
+    u64 ns;
+
+    if (!realtime || !hz)
+        return;
+    if (!nbits)
+        nbits = 1;
+
+    ns = div64_u64((u64)t->len * 8 * NSEC_PER_SEC, (u64)hz * nbits);
+    if (ns >= 20 * NSEC_PER_USEC)
+        usleep_range(div64_u64(ns, NSEC_PER_USEC),
+            div64_u64(ns, NSEC_PER_USEC) + 5);
+    else
+        ndelay(ns);
+}
+
+static void sim_cs(struct w25n_sim *sim, int active)
+{
+    if (active) {
+        sim->state = SIM_OPCODE;
+        sim->busy = sim_is_busy(sim);
+    } else {
+        sim_end(sim);
+        sim->state = SIM_OPCODE;
+    }
+}
+
+static int sim_transfer_one_message(struct spi_master *master,
+        struct spi_message *msg)
+{
+    struct w25n_sim *sim = spi_master_get_devdata(master);
+    struct spi_transfer *t;
+    int selected = 0;
+
+    msg->actual_length = 0;
+    list_for_each_entry(t, &msg->transfers, transfer_list) {
+        if (!selected) {
+            sim_cs(sim, 1);
+            selected = 1;
+        }
+
+        sim_xfer(sim, t->tx_buf, t->rx_buf, t->len);
+        sim_bus_delay(t);
+        msg->actual_length += t->len;
+
+        if (t->delay_usecs)
+            udelay(t->delay_usecs);
+
+        if (t->cs_change && !list_is_last(&t->transfer_list, &msg->transfers)) {
+            sim_cs(sim, 0);
+            selected = 0;
+        }
+    }
+    if (selected)
+        sim_cs(sim, 0);
+
+    msg->status = 0;
+    spi_finalize_current_message(master);
+    return 0;
+}
+
+static void sim_free(struct w25n_sim *sim)
+{
+    int i;
+
+    for (i = 0; i < SIM_BLOCKS; i++)
+        vfree(sim->blocks[i]);
+}
+
+/* 注册一个控制器和挂在上面的芯片 */
+static struct spi_device *sim_add(unsigned int bus)
+{
+    struct spi_board_info info = {
+        .modalias       = "w25n01gw",
+        .chip_select    = 0,
+        .mode           = SPI_MODE_0,
+    };
+    struct spi_master *master;
+    struct spi_device *spi;
+    struct w25n_sim *sim;
+    unsigned int page;
+    u8 *data;
+    int status;
+    int i;
+
+    master = spi_alloc_master(&sim_pdev->dev, sizeof(*sim));
+    if (!master)
+        return ERR_PTR(-ENOMEM);
+
+    sim = spi_master_get_devdata(master);
+    memset(sim, 0, sizeof(*sim));
+    sim->master = master;
+    sim->sr1 = 0x7c;    /* 上电默认所有块写保护 */
+    sim->sr2 = SR2_BUF | SR2_ECCE;
+    memset(sim->buf, 0xff, SIM_PAGE_TOTAL);
+
+    for (i = 0; i < factory_bad_num; i++) {
+        if (factory_bad[i] < 0 || factory_bad[i] >= SIM_BLOCKS)
+            continue;
+        page = factory_bad[i] * SIM_PAGES_PER_BLOCK;
+        data = sim_page_data(sim, page, 1);
+        if (data)
+            data[SIM_PAGE_SIZE] = 0x00;
+    }
+
+    master->bus_num = bus;
+    master->num_chipselect = 1;
+    master->mode_bits = SPI_CPOL | SPI_CPHA;
+    if (io_width >= 2)
+        master->mode_bits |= SPI_RX_DUAL;
+    if (io_width >= 4)
+        master->mode_bits |= SPI_RX_QUAD | SPI_TX_QUAD;
+    master->transfer_one_message = sim_transfer_one_message;
+
+    status = spi_register_master(master);
+    if (status) {
+        sim_free(sim);
+        spi_master_put(master);
+        return ERR_PTR(status);
+    }
+
+    info.max_speed_hz = speed_hz;
+    info.bus_num = bus;
+    if (io_width >= 2)
+        info.mode |= SPI_RX_DUAL;
+    if (io_width >= 4)
+        info.mode |= SPI_RX_QUAD | SPI_TX_QUAD;
+    spi = spi_new_device(master, &info);
+    if (!spi) {
+        spi_master_get(master);
+        spi_unregister_master(master);
+        sim_free(sim);
+        spi_master_put(master);
+        return ERR_PTR(-ENODEV);
+    }
+
+    printk("w25n01gw_sim: %s, %u Hz, x%u\n", dev_name(&spi->dev),
+        speed_hz, io_width);
+    return spi;
+}
+
+static void sim_del(struct spi_device *spi)
+{
+    struct spi_master *master = spi_master_get(spi->master);
+
+    /*
+     * 注销master时w25n01gw驱动解绑, 解绑过程中还要读写(写回BBT, 注销mtd),
+     * 存储要在注销之后释放; 持有引用, devdata在put之前不会随master释放
+     */
+    spi_unregister_master(master);
+    sim_free(spi_master_get_devdata(master));
+    spi_master_put(master);
+}
+
+static int __init w25n01gw_sim_init(void)
+{
+    struct spi_device *spi;
+    int i;
+
+    if (!chips || chips > SIM_CHIPS_MAX)
+        return -EINVAL;
+
+    sim_pdev = platform_device_register_simple("w25n01gw_sim", -1, NULL, 0);
+    if (IS_ERR(sim_pdev))
+        return PTR_ERR(sim_pdev);
+
+    for (i = 0; i < chips; i++) {
+        spi = sim_add(bus_num + i);
+        if (IS_ERR(spi)) {
+            while (i--)
+                sim_del(sim_spi[i]);
+            platform_device_unregister(sim_pdev);
+            return PTR_ERR(spi);
+        }
+        sim_spi[i] = spi;
+    }
+
+    return 0;
+}
+
+static void __exit w25n01gw_sim_exit(void)
+{
+    int i;
+
+    for (i = 0; i < chips; i++)
+        sim_del(sim_spi[i]);
+    platform_device_unregister(sim_pdev);
+}
+
+module_init(w25n01gw_sim_init);
+module_exit(w25n01gw_sim_exit);
+
+MODULE_LICENSE("GPL");
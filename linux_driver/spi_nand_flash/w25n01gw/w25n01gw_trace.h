@@ -0,0 +1,126 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM w25n01gw
+
+#if !defined(_W25N01GW_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _W25N01GW_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#ifndef _W25N01GW_OPS
+#define _W25N01GW_OPS
+
+/* 需要等待BUSY的操作类型 */
+enum {
+    W25N_OP_READ,   /* 0x13 page data read, tRD */
+    W25N_OP_LOAD,   /* 0x02 program data load, 不置BUSY */
+    W25N_OP_PROG,   /* 0x10 program execute, tPP */
+    W25N_OP_ERASE,  /* 0xd8 block erase, tBE */
+    W25N_OP_NR,
+};
+
+/* 队列请求类型 */
+enum {
+    W25N_REQ_READ,
+    W25N_REQ_WRITE,
+    W25N_REQ_ERASE,
+    W25N_REQ_READ_OOB,
+    W25N_REQ_WRITE_OOB,
+    W25N_REQ_MARKBAD,
+    W25N_REQ_STREAM,    /* 合并后异步提交的连续读 */
+    W25N_REQ_NR,
+};
+
+#endif
+
+TRACE_DEFINE_ENUM(W25N_OP_READ);
+TRACE_DEFINE_ENUM(W25N_OP_LOAD);
+TRACE_DEFINE_ENUM(W25N_OP_PROG);
+TRACE_DEFINE_ENUM(W25N_OP_ERASE);
+
+TRACE_DEFINE_ENUM(W25N_REQ_READ);
+TRACE_DEFINE_ENUM(W25N_REQ_WRITE);
+TRACE_DEFINE_ENUM(W25N_REQ_ERASE);
+TRACE_DEFINE_ENUM(W25N_REQ_READ_OOB);
+TRACE_DEFINE_ENUM(W25N_REQ_WRITE_OOB);
+TRACE_DEFINE_ENUM(W25N_REQ_MARKBAD);
+TRACE_DEFINE_ENUM(W25N_REQ_STREAM);
+
+#define show_w25n_op(op) __print_symbolic(op,   \
+    { W25N_OP_READ,         "read" },           \
+    { W25N_OP_LOAD,         "load" },           \
+    { W25N_OP_PROG,         "prog" },           \
+    { W25N_OP_ERASE,        "erase" })
+
+#define show_w25n_req(op) __print_symbolic(op,  \
+    { W25N_REQ_READ,        "read" },           \
+    { W25N_REQ_WRITE,       "write" },          \
+    { W25N_REQ_ERASE,       "erase" },          \
+    { W25N_REQ_READ_OOB,    "read_oob" },       \
+    { W25N_REQ_WRITE_OOB,   "write_oob" },      \
+    { W25N_REQ_MARKBAD,     "markbad" },        \
+    { W25N_REQ_STREAM,      "stream" })
+
+/**
+ * 一个队列请求完成. spi_ns是除去忙等待之外的时间(指令和数据传输),
+ * ret对读是纠正的位翻转数或-EBADMSG, 对写/擦除是0或错误码
+ */
+TRACE_EVENT(w25n_request,
+    TP_PROTO(int op, unsigned int page, size_t len, u64 spi_ns,
+             u64 busy_ns, int ret),
+
+    TP_ARGS(op, page, len, spi_ns, busy_ns, ret),
+
+    TP_STRUCT__entry(
+        __field(int,            op)
+        __field(unsigned int,   page)
+        __field(size_t,         len)
+        __field(u64,            spi_ns)
+        __field(u64,            busy_ns)
+        __field(int,            ret)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->page = page;
+        __entry->len = len;
+        __entry->spi_ns = spi_ns;
+        __entry->busy_ns = busy_ns;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s page=%u len=%zu spi=%lluns busy=%lluns ret=%d",
+        show_w25n_req(__entry->op), __entry->page, __entry->len,
+        __entry->spi_ns, __entry->busy_ns, __entry->ret)
+);
+
+/* 一次忙等待结束, sr是最后读到的状态寄存器3, 超时时ret为-ETIMEDOUT */
+TRACE_EVENT(w25n_wait,
+    TP_PROTO(int op, u64 us, unsigned char sr, int ret),
+
+    TP_ARGS(op, us, sr, ret),
+
+    TP_STRUCT__entry(
+        __field(int,            op)
+        __field(u64,            us)
+        __field(unsigned char,  sr)
+        __field(int,            ret)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->us = us;
+        __entry->sr = sr;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s %lluus sr3=0x%02x ret=%d",
+        show_w25n_op(__entry->op), __entry->us, __entry->sr, __entry->ret)
+);
+
+#endif /* _W25N01GW_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE w25n01gw_trace
+#include <trace/define_trace.h>
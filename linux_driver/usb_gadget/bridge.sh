@@ -1,5 +1,17 @@
 #!/bin/sh
 
+# 功能参数, 可用环境变量覆盖, 例如 MAX_BURST=7 ./bridge.sh start
+# MAX_BURST(0~15)和STREAMS(0~16, 流数为2的幂)只在SuperSpeed下生效,
+# BUFLEN不小于(MAX_BURST + 1) * 1024时一个请求才能用满一次突发
+# STREAMS非0时两个方向的请求各自按排队顺序轮流用流1, 2, ..., 2^STREAMS,
+# 主机必须按同样的顺序在各个流上提交传输, 否则管道会卡住.
+# 2^STREAMS超过QLEN时驱动自动减少流数
+QLEN=${QLEN:-16}
+BUFLEN=${BUFLEN:-65536}
+MAX_BURST=${MAX_BURST:-15}
+STREAMS=${STREAMS:-0}
+SELFTEST=${SELFTEST:-0}
+
 do_start() {
 	mount -t configfs none /sys/kernel/config
 	mkdir /sys/kernel/config/usb_gadget/g1
@@ -15,6 +27,11 @@ do_start() {
 	echo `hostname -s` > strings/0x409/product
 	
 	mkdir -p functions/Loopback.0
+	echo $QLEN > functions/Loopback.0/qlen
+	echo $BUFLEN > functions/Loopback.0/bulk_buflen
+	echo $MAX_BURST > functions/Loopback.0/max_burst
+	echo $STREAMS > functions/Loopback.0/bulk_streams
+	echo $SELFTEST > functions/Loopback.0/selftest
 	
 	mkdir -p configs/c.1
 	echo 120 > configs/c.1/MaxPower
@@ -26,17 +43,12 @@ do_stop() {
 	# 卸载USB
 	cd /sys/kernel/config/usb_gadget/g1
 	echo "" > UDC
-	rm configs/c.1/acm.gs0/
+	rm configs/c.1/Loopback.0
 	rmdir configs/c.1/
-	rmdir functions/acm.gs0/
+	rmdir functions/Loopback.0/
 	rmdir strings/0x409/
 	cd ..
 	rmdir g1/
-	
-	rmmod u_serial.ko
-	rmmod usb_f_serial.ko
-	rmmod usb_f_acm.ko 
-	rmmod libcomposite.ko
 }
 
 case $1 in
@@ -48,8 +60,14 @@ case $1 in
         echo "Stop usb gadget"
         do_stop
         ;;
+    selftest)
+        # 驱动自己收发, 主机端持续读写两个bulk端点, 吞吐率每秒打印到dmesg
+        echo "Start usb gadget in throughput selftest mode"
+        SELFTEST=1
+        do_start
+        ;;
     *)
-        echo "Usage: $0 (stop | start)"
+        echo "Usage: $0 (stop | start | selftest)"
         ;;
 esac
 
@@ -16,9 +16,14 @@
 #include <linux/usb/composite.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
 
 #include "g_zero.h"
 #include "u_f.h"
+#include "usb_bridge.h"
 
 /*
  * LOOPBACK FUNCTION ... a testing vehicle for USB peripherals,
@@ -35,6 +40,21 @@ struct f_loopback {
 
 	unsigned                qlen;
 	unsigned                buflen;
+	unsigned                max_burst;
+	unsigned                bulk_streams;
+	unsigned                selftest;
+};
+
+/*
+ * f_lb_opts在g_zero.h中, 本驱动的配置项放在外面一层.
+ * max_burst为SuperSpeed端点的bMaxBurst(0~15), bulk_streams为MaxStreams
+ * (0~16, 流数为2的幂), selftest非0时驱动自己收发测试吞吐率
+ */
+struct f_bridge_opts {
+	struct f_lb_opts	lb;
+	unsigned		max_burst;
+	unsigned		bulk_streams;
+	unsigned		selftest;
 };
 
 static inline struct f_loopback *func_to_loop(struct usb_function *f)
@@ -163,31 +183,97 @@ static struct usb_gadget_strings *loopback_strings[] = {
 	NULL,
 };
 
+/*
+ * qlen个IN请求和qlen个OUT请求在bind时分配, unbind时释放.
+ * 在线时OUT请求一直排在端点上, 收到数据后按完成顺序挂到rx_done,
+ * read读完一个再把它重新排队; 空闲的IN请求在tx_idle, write取一个
+ * 填好数据排队后即返回, 最多qlen个同时在传, fsync等它们发完.
+ * 以O_NONBLOCK打开时没有请求可用返回-EAGAIN, 用poll等待.
+ */
 struct bridge_dev {
+    spinlock_t lock;            /* 保护链表和tx_error, 完成回调在中断上下文 */
     wait_queue_head_t write_wq;
     wait_queue_head_t read_wq;
     atomic_t write_excl;
     atomic_t read_excl;
+    atomic_t tx_inflight;           /* 已排队未完成的IN请求 */
+    atomic_t active;                /* 正在使用请求的read/write/ioctl */
 
-    int rx_done;
-    int tx_done;
-
-    int tx_is_idle;
+    int is_bound;                   /* 请求已分配, unbind开始时清零 */
     int is_online;
 
     struct usb_ep *ep_in;
 	struct usb_ep *ep_out;
 
-    struct usb_request *req_in;
-    struct usb_request *req_out;
+    struct mutex buf_lock;          /* 保护请求的分配释放和mmap */
+    unsigned qlen;
+    unsigned buflen;
+    unsigned stride;                /* 缓冲区按页分配, mmap中的间隔 */
+    struct usb_request **reqs_in;   /* qlen个, 下标就是缓冲区编号 */
+    struct usb_request **reqs_out;
+    unsigned gen;                   /* 每次分配请求加1, 区分之前打开的文件 */
+
+    struct list_head tx_idle;       /* 空闲的IN请求 */
+    struct list_head rx_idle;       /* 没有排队的OUT请求 */
+    struct list_head rx_done;       /* 收到数据待读的OUT请求, 先进先出 */
+    struct usb_request *rx_cur;     /* 正在读的请求, 只由持有read_excl的读者访问 */
+    unsigned rx_off;                /* rx_cur中已读的字节数 */
+    int tx_error;                   /* 之前失败的IN请求状态, 下一次write报告 */
+
+    unsigned nstreams;              /* 本次连接使用的bulk流数, 0为不用 */
+    unsigned stream_seq[2];         /* 下一个排队请求的序号, 0: IN, 1: OUT */
+
+    /* 自测模式: 所有请求一直在端点上循环, 每秒打印一次吞吐率 */
+    int selftest;
+    u64 st_bytes[2];                /* 0: IN, 1: OUT */
+    ktime_t st_start;
 };
 static struct bridge_dev st_bridge_dev;
+
+/**
+ * 每个打开的文件DQBUF取走的缓冲区, QBUF只能还回自己取走的,
+ * release时还回剩下的. 两个位图各qlen位, 紧跟在结构体后面
+ */
+struct bridge_file {
+    unsigned gen;                   /* 打开时的dev->gen */
+    unsigned long *user_in;
+    unsigned long *user_out;
+    unsigned long bits[];
+};
+
+static inline unsigned bridge_req_index(struct usb_request *req)
+{
+    return (unsigned long)req->context;
+}
+
+/**
+ * 排队一个请求, 调用者持有dev->lock. 使用bulk流时每个方向按排队顺序
+ * 轮流用流1~nstreams, 主机按同样的顺序读各个流, 约定见usb_bridge.h.
+ * 序号在锁内分配, 与排队顺序一致, 排队失败的请求不占序号
+ */
+static int bridge_queue_locked(struct bridge_dev *dev, struct usb_ep *ep,
+        struct usb_request *req, int dir)
+{
+    unsigned seq = dev->stream_seq[dir];
+    int ret;
+
+    req->stream_id = dev->nstreams ? seq % dev->nstreams + 1 : 0;
+    ret = usb_ep_queue(ep, req, GFP_ATOMIC);
+    if (!ret)
+        dev->stream_seq[dir] = seq + 1;
+    return ret;
+}
+
+static int alloc_requests(struct usb_composite_dev *cdev,
+			  struct f_loopback *loop);
 /*-------------------------------------------------------------------------*/
 
 static int loopback_bind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct usb_composite_dev *cdev = c->cdev;
 	struct f_loopback	*loop = func_to_loop(f);
+	unsigned		streams;
+	unsigned		mps;
 	int			id;
 	int ret;
 
@@ -232,11 +318,53 @@ autoconf_fail:
 		fs_loop_source_desc.bEndpointAddress;
 	ss_loop_sink_desc.bEndpointAddress = fs_loop_sink_desc.bEndpointAddress;
 
+	/* 突发长度和bulk流数, UDC不支持那么多流时减少 */
+	streams = min3(loop->bulk_streams, (unsigned)loop->in_ep->max_streams,
+			(unsigned)loop->out_ep->max_streams);
+	if (streams != loop->bulk_streams && !streams)
+		printk("[%s]%s supports no streams\n", __func__,
+			cdev->gadget->name);
+	else if (streams != loop->bulk_streams)
+		printk("[%s]%s supports only %u streams\n", __func__,
+			cdev->gadget->name, 1U << streams);
+	/* 请求轮流用各个流, 流数超过qlen时有的流永远没有请求, 主机会卡住 */
+	if (streams && (1U << streams) > loop->qlen) {
+		while (streams && (1U << streams) > loop->qlen)
+			streams--;
+		printk("[%s]qlen %u, use %u streams\n", __func__,
+			loop->qlen, streams ? 1U << streams : 0);
+	}
+	loop->bulk_streams = streams;
+
+	/* 缓冲区小于包长时write切出的每段都是短包, 一次write会变成多次传输 */
+	mps = loop->in_ep->maxpacket;
+	if (gadget_is_dualspeed(cdev->gadget))
+		mps = le16_to_cpu(hs_loop_source_desc.wMaxPacketSize);
+	if (gadget_is_superspeed(cdev->gadget))
+		mps = le16_to_cpu(ss_loop_source_desc.wMaxPacketSize);
+	if (loop->buflen < mps) {
+		printk("[%s]bulk_buflen %u is less than max packet size %u\n",
+			__func__, loop->buflen, mps);
+		return -EINVAL;
+	}
+
+	ss_loop_source_comp_desc.bMaxBurst = loop->max_burst;
+	ss_loop_sink_comp_desc.bMaxBurst = loop->max_burst;
+	ss_loop_source_comp_desc.bmAttributes = streams;
+	ss_loop_sink_comp_desc.bmAttributes = streams;
+
 	ret = usb_assign_descriptors(f, fs_loopback_descs, hs_loopback_descs,
 			ss_loopback_descs, NULL);
 	if (ret)
 		return ret;
 
+	ret = alloc_requests(cdev, loop);
+	if (ret) {
+		usb_free_all_descriptors(f);
+		return ret;
+	}
+    st_bridge_dev.is_bound = 1;
+
 	DBG(cdev, "%s speed %s: IN/%s, OUT/%s\n",
 	    (gadget_is_superspeed(c->cdev->gadget) ? "super" :
 	     (gadget_is_dualspeed(c->cdev->gadget) ? "dual" : "full")),
@@ -273,57 +401,131 @@ static inline void bridge_unlock(atomic_t *excl)
 	atomic_dec(excl);
 }
 
+/**
+ * 数据路径使用请求前调用, unbind开始后返回-ENODEV.
+ * 先计入active再检查is_bound, unbind先清is_bound再等active为0,
+ * 两边都有全屏障, 所以请求释放时不会有人还在使用
+ */
+static int bridge_enter(struct bridge_dev *dev)
+{
+    atomic_inc(&dev->active);
+    smp_mb__after_atomic();
+    if (!dev->is_bound) {
+        if (atomic_dec_and_test(&dev->active))
+            wake_up(&dev->read_wq);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static void bridge_exit(struct bridge_dev *dev)
+{
+    if (atomic_dec_and_test(&dev->active))
+        wake_up(&dev->read_wq);     /* unbind在等 */
+}
+
+/* 把OUT请求排到端点上, 离线或失败时放回rx_idle */
+static void bridge_queue_out(struct usb_request *req)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    unsigned long flags;
+    int ret = -ESHUTDOWN;
+
+    req->length = dev->buflen;
+    spin_lock_irqsave(&dev->lock, flags);
+    if (dev->is_online)
+        ret = bridge_queue_locked(dev, dev->ep_out, req, 1);
+    if (ret)
+        list_add_tail(&req->list, &dev->rx_idle);
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+static void bridge_put_in(struct usb_request *req)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&st_bridge_dev.lock, flags);
+    list_add_tail(&req->list, &st_bridge_dev.tx_idle);
+    spin_unlock_irqrestore(&st_bridge_dev.lock, flags);
+}
+
+/**
+ * 自测模式的完成处理: 成功的请求计数后原样重新排队, 每秒打印一次两个方向的
+ * 吞吐率. 返回0时按普通请求处理(出错, 断开或重新排队失败)
+ */
+static int bridge_selftest_complete(struct usb_ep *ep, struct usb_request *req,
+        int dir)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    unsigned long flags;
+    u64 in = 0, out = 0;
+    s64 us;
+    int ret;
+
+    if (req->status || !dev->is_online)
+        return 0;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->st_bytes[dir] += req->actual;
+    us = ktime_us_delta(ktime_get(), dev->st_start);
+    if (us >= USEC_PER_SEC) {
+        in = dev->st_bytes[0];
+        out = dev->st_bytes[1];
+        dev->st_bytes[0] = 0;
+        dev->st_bytes[1] = 0;
+        dev->st_start = ktime_get();
+    } else {
+        us = 0;
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if (us)
+        printk("[%s]IN %llu MB/s, OUT %llu MB/s\n", __func__,
+            div64_u64(in * USEC_PER_SEC, us) >> 20,
+            div64_u64(out * USEC_PER_SEC, us) >> 20);
+
+    req->length = dev->buflen;
+    req->zero = 0;
+    spin_lock_irqsave(&dev->lock, flags);
+    ret = bridge_queue_locked(dev, ep, req, dir);
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return ret == 0;
+}
+
 static void loopback_complete_out(struct usb_ep *ep, struct usb_request *req)
 {
-    int ret = 0;
 	struct f_loopback	*loop = ep->driver_data;
 	struct usb_composite_dev *cdev = loop->function.config->cdev;
+	unsigned long		flags;
 	int			status = req->status;
 
+	if (st_bridge_dev.selftest && bridge_selftest_complete(ep, req, 1))
+		return;
+
 	switch (status) {
 	case 0:				/* normal completion? */
-		if (ep == loop->out_ep) {
-			/*
-			 * We received some data from the host so let's
-			 * queue it so host can read the from our in ep
-			 */
-            st_bridge_dev.rx_done = 1;
-            // printk("(%d) complete is finish!\n", __LINE__);
-            wake_up(&st_bridge_dev.read_wq);
-            
-		} else {
-			/*
-			 * We have just looped back a bunch of data
-			 * to host. Now let's wait for some more data.
-			 */
-			//req = req->context;
-			//ep = loop->out_ep;
-
-			//bridge_unlock(&st_bridge_dev.write_excl);
-            // printk("(%d) complete is finish!\n", __LINE__);
-            wake_up(&st_bridge_dev.write_wq);
-		}
+		/* 按完成顺序交给读者 */
+		spin_lock_irqsave(&st_bridge_dev.lock, flags);
+		list_add_tail(&req->list, &st_bridge_dev.rx_done);
+		spin_unlock_irqrestore(&st_bridge_dev.lock, flags);
+		wake_up(&st_bridge_dev.read_wq);
 		break;
-		/* "should never get here" */
-	default:
-		ERROR(cdev, "%s loop complete --> %d, %d/%d\n", ep->name,
-				status, req->actual, req->length);
-		/* FALLTHROUGH */
 
-	/* NOTE:  since this driver doesn't maintain an explicit record
-	 * of requests it submitted (just maintains qlen count), we
-	 * rely on the hardware driver to clean up on disconnect or
-	 * endpoint disable.
-	 */
 	case -ECONNABORTED:		/* hardware forced ep reset */
 	case -ECONNRESET:		/* request dequeued */
 	case -ESHUTDOWN:		/* disconnect from host */
-free_req:
-		usb_ep_free_request(ep == loop->in_ep ?
-				    loop->out_ep : loop->in_ep,
-				    req->context);
-		free_ep_req(ep, req);
-		return;
+		/* 重新使能端点时再排队 */
+		spin_lock_irqsave(&st_bridge_dev.lock, flags);
+		list_add_tail(&req->list, &st_bridge_dev.rx_idle);
+		spin_unlock_irqrestore(&st_bridge_dev.lock, flags);
+		wake_up(&st_bridge_dev.read_wq);
+		break;
+
+	default:
+		ERROR(cdev, "%s loop complete --> %d, %d/%d\n", ep->name,
+				status, req->actual, req->length);
+		bridge_queue_out(req);
+		break;
 	}
 }
 
@@ -331,56 +533,32 @@ static void loopback_complete_in(struct usb_ep *ep, struct usb_request *req)
 {
 	struct f_loopback	*loop = ep->driver_data;
 	struct usb_composite_dev *cdev = loop->function.config->cdev;
+	unsigned long		flags;
 	int			status = req->status;
 
+	/* 重新排队的请求仍计在tx_inflight中 */
+	if (st_bridge_dev.selftest && bridge_selftest_complete(ep, req, 0))
+		return;
+
 	switch (status) {
 	case 0:				/* normal completion? */
-		if (ep == loop->out_ep) {
-			/*
-			 * We received some data from the host so let's
-			 * queue it so host can read the from our in ep
-			 */
-
-            //printk("ep is out,buf(%d) = %s\n", req->length, (char *)req->buf);
-            wake_up(&st_bridge_dev.read_wq);
-            
-		} else {
-			/*
-			 * We have just looped back a bunch of data
-			 * to host. Now let's wait for some more data.
-			 */
-			//req = req->context;
-			//ep = loop->out_ep;
-
-			//bridge_unlock(&st_bridge_dev.write_excl);
-            //printk("complete is finish!\n");
-            st_bridge_dev.tx_done = 1;
-            st_bridge_dev.tx_is_idle = 1;
-            wake_up(&st_bridge_dev.write_wq);
-
-		}
+	case -ECONNABORTED:		/* hardware forced ep reset */
+	case -ECONNRESET:		/* request dequeued */
+	case -ESHUTDOWN:		/* disconnect from host */
 		break;
-		/* "should never get here" */
+
 	default:
 		ERROR(cdev, "%s loop complete --> %d, %d/%d\n", ep->name,
 				status, req->actual, req->length);
-		/* FALLTHROUGH */
-
-	/* NOTE:  since this driver doesn't maintain an explicit record
-	 * of requests it submitted (just maintains qlen count), we
-	 * rely on the hardware driver to clean up on disconnect or
-	 * endpoint disable.
-	 */
-	case -ECONNABORTED:		/* hardware forced ep reset */
-	case -ECONNRESET:		/* request dequeued */
-	case -ESHUTDOWN:		/* disconnect from host */
-free_req:
-		usb_ep_free_request(ep == loop->in_ep ?
-				    loop->out_ep : loop->in_ep,
-				    req->context);
-		free_ep_req(ep, req);
-		return;
+		st_bridge_dev.tx_error = status;
+		break;
 	}
+
+	spin_lock_irqsave(&st_bridge_dev.lock, flags);
+	list_add_tail(&req->list, &st_bridge_dev.tx_idle);
+	spin_unlock_irqrestore(&st_bridge_dev.lock, flags);
+	atomic_dec(&st_bridge_dev.tx_inflight);
+	wake_up(&st_bridge_dev.write_wq);
 }
 
 static void disable_loopback(struct f_loopback *loop)
@@ -388,72 +566,172 @@ static void disable_loopback(struct f_loopback *loop)
 	struct usb_composite_dev	*cdev;
 
 	cdev = loop->function.config->cdev;
+    st_bridge_dev.is_online = 0;    /* 之后完成的OUT请求不再排队 */
 	//disable_endpoints(cdev, loop->in_ep, loop->out_ep, NULL, NULL);
 	usb_ep_disable(loop->in_ep);
 	usb_ep_disable(loop->out_ep);
 	VDBG(cdev, "%s disabled\n", loop->function.name);
 }
 
-static inline struct usb_request *lb_alloc_ep_req(struct usb_ep *ep, int len)
+/**
+ * 缓冲区用alloc_pages_exact分配, 物理连续可以DMA, 每页有自己的引用计数,
+ * 可以vm_insert_page到应用程序; unbind后已有的映射仍持有页的引用.
+ * req->context记录缓冲区编号
+ */
+static struct usb_request *bridge_alloc_req(struct usb_ep *ep, unsigned index)
 {
-	return alloc_ep_req(ep, len);
-}
+    struct usb_request *req;
 
-static int alloc_requests(struct usb_composite_dev *cdev,
-			  struct f_loopback *loop)
-{
-	struct usb_request *in_req, *out_req;
-	int i;
-	int result = 0;
+    req = usb_ep_alloc_request(ep, GFP_KERNEL);
+    if (!req)
+        return NULL;
 
-	/*
-	 * allocate a bunch of read buffers and queue them all at once.
-	 * we buffer at most 'qlen' transfers; We allocate buffers only
-	 * for out transfer and reuse them in IN transfers to implement
-	 * our loopback functionality
-	 */
-	for (i = 0; i < loop->qlen && result == 0; i++) {
-		result = -ENOMEM;
+    req->buf = alloc_pages_exact(st_bridge_dev.stride,
+            GFP_KERNEL | __GFP_ZERO);
+    if (!req->buf) {
+        usb_ep_free_request(ep, req);
+        return NULL;
+    }
+    req->length = st_bridge_dev.buflen;
+    req->context = (void *)(unsigned long)index;
 
-        printk("buflen = %d\n", loop->buflen);
-		in_req = lb_alloc_ep_req(loop->in_ep, loop->buflen);
-		if (!in_req)
-			goto fail;
+    return req;
+}
 
-		out_req = lb_alloc_ep_req(loop->out_ep, loop->buflen);
-		if (!out_req)
-			goto fail_in;
+static void bridge_free_req(struct usb_ep *ep, struct usb_request *req)
+{
+    free_pages_exact(req->buf, st_bridge_dev.stride);
+    usb_ep_free_request(ep, req);
+}
 
-		in_req->complete = loopback_complete_in;
-		out_req->complete = loopback_complete_out;
+static void free_requests(void)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    unsigned i;
+
+    mutex_lock(&dev->buf_lock);
+    for (i = 0; i < dev->qlen; i++) {
+        if (dev->reqs_in && dev->reqs_in[i])
+            bridge_free_req(dev->ep_in, dev->reqs_in[i]);
+        if (dev->reqs_out && dev->reqs_out[i])
+            bridge_free_req(dev->ep_out, dev->reqs_out[i]);
+    }
 
-#if 0
-		in_req->buf = out_req->buf;
+    kfree(dev->reqs_in);
+    kfree(dev->reqs_out);
+    dev->reqs_in = NULL;
+    dev->reqs_out = NULL;
+    dev->qlen = 0;
+
+    INIT_LIST_HEAD(&dev->tx_idle);
+    INIT_LIST_HEAD(&dev->rx_idle);
+    INIT_LIST_HEAD(&dev->rx_done);
+    dev->rx_cur = NULL;
+    mutex_unlock(&dev->buf_lock);
+}
 
-		/* length will be set in complete routine */
-		in_req->context = out_req;
-		out_req->context = in_req;
-#endif
-        st_bridge_dev.req_in  = in_req;
-        st_bridge_dev.req_out = out_req;
-#if 0
-		result = usb_ep_queue(st_bridge_dev.ep_out, st_bridge_dev.req_out, GFP_ATOMIC);
-		if (result) {
-			ERROR(cdev, "%s queue req --> %d\n",
-					loop->out_ep->name, result);
-			goto fail_out;
-		}
-#endif
-	}
+/* bind时分配qlen对请求, 之后断开重连都复用 */
+static int alloc_requests(struct usb_composite_dev *cdev,
+        struct f_loopback *loop)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct usb_request *in_req, *out_req;
+    int i;
+
+    mutex_lock(&dev->buf_lock);
+    INIT_LIST_HEAD(&dev->tx_idle);
+    INIT_LIST_HEAD(&dev->rx_idle);
+    INIT_LIST_HEAD(&dev->rx_done);
+    dev->rx_cur = NULL;
+    dev->tx_error = 0;
+    dev->buflen = loop->buflen;
+    dev->stride = PAGE_ALIGN(loop->buflen);
+
+    dev->reqs_in = kcalloc(loop->qlen, sizeof(*dev->reqs_in), GFP_KERNEL);
+    dev->reqs_out = kcalloc(loop->qlen, sizeof(*dev->reqs_out), GFP_KERNEL);
+    dev->qlen = loop->qlen;
+    dev->gen++;
+    if (!dev->reqs_in || !dev->reqs_out)
+        goto fail;
+
+    for (i = 0; i < loop->qlen; i++) {
+        in_req = bridge_alloc_req(loop->in_ep, i);
+        if (!in_req)
+            goto fail;
+        dev->reqs_in[i] = in_req;
+
+        out_req = bridge_alloc_req(loop->out_ep, i);
+        if (!out_req)
+            goto fail;
+        dev->reqs_out[i] = out_req;
+
+        in_req->complete = loopback_complete_in;
+        out_req->complete = loopback_complete_out;
+
+        list_add_tail(&in_req->list, &dev->tx_idle);
+        list_add_tail(&out_req->list, &dev->rx_idle);
+    }
 
-	return 0;
+    DBG(cdev, "%u requests of %u bytes per direction\n", dev->qlen,
+        dev->buflen);
+    mutex_unlock(&dev->buf_lock);
+    return 0;
 
-fail_out:
-	free_ep_req(loop->out_ep, out_req);
-fail_in:
-	usb_ep_free_request(loop->in_ep, in_req);
 fail:
-	return result;
+    mutex_unlock(&dev->buf_lock);
+    free_requests();
+    return -ENOMEM;
+}
+
+/* 端点使能后把所有空闲和未读的OUT请求排上, 上次连接未读的数据丢弃 */
+static void bridge_start_out(void)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct usb_request *req;
+    unsigned long flags;
+    LIST_HEAD(reqs);
+
+    spin_lock_irqsave(&dev->lock, flags);
+    list_splice_tail_init(&dev->rx_done, &reqs);
+    list_splice_tail_init(&dev->rx_idle, &reqs);
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    while (!list_empty(&reqs)) {
+        req = list_first_entry(&reqs, struct usb_request, list);
+        list_del(&req->list);
+        bridge_queue_out(req);
+    }
+}
+
+/* 自测: 把所有空闲的IN请求填满排上, 之后在完成回调中循环 */
+static void bridge_selftest_start(void)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct usb_request *req;
+    unsigned long flags;
+    LIST_HEAD(reqs);
+
+    spin_lock_irqsave(&dev->lock, flags);
+    list_splice_tail_init(&dev->tx_idle, &reqs);
+    dev->st_bytes[0] = 0;
+    dev->st_bytes[1] = 0;
+    dev->st_start = ktime_get();
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    while (!list_empty(&reqs)) {
+        req = list_first_entry(&reqs, struct usb_request, list);
+        list_del(&req->list);
+
+        req->length = dev->buflen;
+        req->zero = 0;
+        atomic_inc(&dev->tx_inflight);
+        spin_lock_irqsave(&dev->lock, flags);
+        if (bridge_queue_locked(dev, dev->ep_in, req, 0)) {
+            list_add_tail(&req->list, &dev->tx_idle);
+            atomic_dec(&dev->tx_inflight);
+        }
+        spin_unlock_irqrestore(&dev->lock, flags);
+    }
 }
 
 static int enable_endpoint(struct usb_composite_dev *cdev,
@@ -488,15 +766,21 @@ enable_loopback(struct usb_composite_dev *cdev, struct f_loopback *loop)
 	if (result)
 		goto disable_in;
 
-	result = alloc_requests(cdev, loop);
-	if (result)
-		goto disable_out;
+	/* bulk流只在SuperSpeed下使用 */
+	st_bridge_dev.nstreams = 0;
+	st_bridge_dev.stream_seq[0] = 0;
+	st_bridge_dev.stream_seq[1] = 0;
+	if (cdev->gadget->speed >= USB_SPEED_SUPER && loop->bulk_streams)
+		st_bridge_dev.nstreams = 1U << loop->bulk_streams;
+
+	st_bridge_dev.is_online = 1;
+	bridge_start_out();
+	if (st_bridge_dev.selftest)
+		bridge_selftest_start();
 
 	DBG(cdev, "%s enabled\n", loop->function.name);
 	return 0;
 
-disable_out:
-	usb_ep_disable(loop->out_ep);
 disable_in:
 	usb_ep_disable(loop->in_ep);
 out:
@@ -515,8 +799,6 @@ static int loopback_set_alt(struct usb_function *f,
     //     return 0;
     // }
 
-    st_bridge_dev.is_online = 1;
-
 	/* we know alt is zero */
 	disable_loopback(loop);
 	return enable_loopback(cdev, loop);
@@ -529,102 +811,481 @@ static void loopback_disable(struct usb_function *f)
     // printk("%s(%d)\n", __func__, __LINE__);
 
 	disable_loopback(loop);
+
+    /* 端点禁用后请求都已完成, 叫醒阻塞的读写返回-EIO */
+    wake_up(&st_bridge_dev.read_wq);
+    wake_up(&st_bridge_dev.write_wq);
+}
+
+static void loopback_unbind(struct usb_configuration *c, struct usb_function *f)
+{
+    st_bridge_dev.is_bound = 0;
+    st_bridge_dev.is_online = 0;
+    smp_mb();   /* 与bridge_enter配对 */
+    wake_up(&st_bridge_dev.read_wq);
+    wake_up(&st_bridge_dev.write_wq);
+
+    /* 阻塞的读写看到离线后返回, 等所有已进入的数据路径退出后再释放请求 */
+    wait_event(st_bridge_dev.read_wq, !atomic_read(&st_bridge_dev.active));
+
+    free_requests();
+	usb_free_all_descriptors(f);
 }
 
 static int bridge_open(struct inode *ip, struct file *fp)
 {
-    if(1 != st_bridge_dev.is_online) {
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct bridge_file *bf;
+    unsigned longs;
+
+    if (dev->selftest)
+        return -EBUSY;
+
+    if(1 != dev->is_online) {
         printk("usb is not online!\n");
         return -EIO;
     }
 
+    mutex_lock(&dev->buf_lock);
+    longs = BITS_TO_LONGS(dev->qlen);
+    bf = kzalloc(sizeof(*bf) + 2 * longs * sizeof(long), GFP_KERNEL);
+    if (!bf) {
+        mutex_unlock(&dev->buf_lock);
+        return -ENOMEM;
+    }
+    bf->gen = dev->gen;
+    bf->user_in = bf->bits;
+    bf->user_out = bf->bits + longs;
+    mutex_unlock(&dev->buf_lock);
+
+    fp->private_data = bf;
     return 0;
 }
 
-static ssize_t bridge_read(struct file *fp, char __user *buf, size_t count, loff_t *pos)
+/* 最后一个进程关闭时收回它DQBUF后没有还回的缓冲区 */
+static int bridge_release(struct inode *ip, struct file *fp)
 {
-    uint32_t ret = 0;
-    struct usb_request *req;
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct bridge_file *bf = fp->private_data;
+    unsigned i;
+
+    /* 还回这个文件取走的缓冲区, 重新bind过的请求已经不是原来的了 */
+    mutex_lock(&dev->buf_lock);
+    if (bf->gen == dev->gen) {
+        for (i = 0; i < dev->qlen; i++) {
+            if (test_and_clear_bit(i, bf->user_in))
+                bridge_put_in(dev->reqs_in[i]);
+            if (test_and_clear_bit(i, bf->user_out))
+                bridge_queue_out(dev->reqs_out[i]);
+        }
+    }
+    mutex_unlock(&dev->buf_lock);
+    kfree(bf);
 
-    if(1 != st_bridge_dev.is_online) {
-        printk("usb is not online!\n");
+    wake_up(&dev->write_wq);
+    return 0;
+}
+
+/* 等一个空闲的IN请求, 之前失败的传输在这里报告 */
+static int bridge_get_in(struct bridge_dev *dev, struct usb_request **reqp,
+        int nonblock)
+{
+    struct usb_request *req = NULL;
+    unsigned long flags;
+    int error = 0;
+    int ret;
+
+    if (nonblock && list_empty(&dev->tx_idle) && dev->is_online)
+        return -EAGAIN;
+
+    ret = wait_event_interruptible(dev->write_wq,
+            !list_empty(&dev->tx_idle) || !dev->is_online);
+    if (ret < 0)
+        return ret;
+    if (!dev->is_online)
+        return -EIO;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    if (!list_empty(&dev->tx_idle)) {
+        req = list_first_entry(&dev->tx_idle, struct usb_request, list);
+        list_del(&req->list);
+    }
+    error = dev->tx_error;
+    dev->tx_error = 0;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if (!req)
+        return -EIO;
+    if (error) {
+        bridge_put_in(req);
         return -EIO;
     }
 
-    req = st_bridge_dev.req_out;
+    *reqp = req;
+    return 0;
+}
 
-    ret = usb_ep_queue(st_bridge_dev.ep_out, st_bridge_dev.req_out, GFP_ATOMIC);
-    if (ret < 0) 
-    {
-        printk("tmc_read: failed to queue req %p (%d)\n", req, ret);
-        ret = -EIO;
+/**
+ * 排队发送, 失败时请求放回tx_idle.
+ * last为1表示这是一次传输的最后一段, 长度是包长的整数倍时UDC补发零长包
+ */
+static int bridge_send(struct bridge_dev *dev, struct usb_request *req,
+        unsigned len, int last)
+{
+    unsigned long flags;
+    int ret;
+
+    req->length = len;
+    req->zero = last;
+    atomic_inc(&dev->tx_inflight);
+    spin_lock_irqsave(&dev->lock, flags);
+    ret = bridge_queue_locked(dev, dev->ep_in, req, 0);
+    if (ret < 0)
+        list_add_tail(&req->list, &dev->tx_idle);
+    spin_unlock_irqrestore(&dev->lock, flags);
+    if (ret < 0) {
+        atomic_dec(&dev->tx_inflight);
+        printk("[%s]failed to queue req %p (%d)\n", __func__, req, ret);
+        return -EIO;
     }
 
-    ret = wait_event_interruptible(st_bridge_dev.read_wq, st_bridge_dev.rx_done);
-    if(ret < 0) {
-        printk("%s[%d].wait event interrupt!\n", __func__, __LINE__);
-        goto out;
+    return 0;
+}
+
+/* 等一个收到数据的OUT请求 */
+static int bridge_get_out(struct bridge_dev *dev, struct usb_request **reqp,
+        int nonblock)
+{
+    struct usb_request *req = NULL;
+    unsigned long flags;
+    int ret;
+
+    if (nonblock && list_empty(&dev->rx_done) && dev->is_online)
+        return -EAGAIN;
+
+    ret = wait_event_interruptible(dev->read_wq,
+            !list_empty(&dev->rx_done) || !dev->is_online);
+    if (ret < 0)
+        return ret;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    if (!list_empty(&dev->rx_done)) {
+        req = list_first_entry(&dev->rx_done, struct usb_request, list);
+        list_del(&req->list);
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    if (!req)
+        return -EIO;
+
+    *reqp = req;
+    return 0;
+}
+
+/* 每次最多返回一个OUT请求的数据, count小于包长时剩余部分留给下一次read */
+static ssize_t bridge_read(struct file *fp, char __user *buf, size_t count, loff_t *pos)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct usb_request *req;
+    size_t n;
+    ssize_t ret;
+
+    ret = bridge_enter(dev);
+    if (ret < 0)
+        return ret;
+    if (bridge_lock(&dev->read_excl)) {
+        bridge_exit(dev);
+        return -EBUSY;
     }
 
-    copy_to_user(buf, (char *)(req->buf), req->actual);
-    ret = req->actual;
+    if (!dev->rx_cur) {
+        ret = bridge_get_out(dev, &dev->rx_cur, fp->f_flags & O_NONBLOCK);
+        if (ret < 0)
+            goto out;
+        dev->rx_off = 0;
+    }
 
-    //printk("len = %d. buf = 0x%x\n", req->actual, (char *)(req->buf));
+    req = dev->rx_cur;
+    n = min_t(size_t, count, req->actual - dev->rx_off);
+    if (copy_to_user(buf, (char *)req->buf + dev->rx_off, n)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    dev->rx_off += n;
+    if (dev->rx_off >= req->actual) {
+        dev->rx_cur = NULL;
+        bridge_queue_out(req);
+    }
+    ret = n;
 
 out:
-    st_bridge_dev.rx_done = 0;
+    bridge_unlock(&dev->read_excl);
+    bridge_exit(dev);
     return ret;
 }
 
-static ssize_t bridge_write(struct file *fp, const char __user *buf, size_t count, loff_t *pos)
+/**
+ * 中间段的长度, 必须是包长的整数倍, 否则主机收到短包认为传输结束.
+ * bind时已保证buflen不小于各速度下的包长
+ */
+static unsigned bridge_chunk_size(struct bridge_dev *dev)
 {
-    int ret = 0;
+    unsigned mps = dev->ep_in->maxpacket;
 
-    if(1 != st_bridge_dev.is_online) {
-        printk("usb is not online!\n");
-        return -EIO;
-    }
+    if (!mps)
+        return dev->buflen;
+    return dev->buflen - dev->buflen % mps;
+}
 
-    if(1 != st_bridge_dev.tx_is_idle) {
-        printk("waiting for tx is finished!\n");
+/**
+ * 一次write是一次传输, 不限长度: 按bridge_chunk_size切成多个IN请求依次排队,
+ * UDC把排队的请求接在一起DMA, 只有最后一段需要时带零长包.
+ * 所有段排队后即返回; 非阻塞时没有空闲请求返回已排队的长度
+ */
+static ssize_t bridge_write(struct file *fp, const char __user *buf, size_t count, loff_t *pos)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    struct usb_request *req;
+    size_t done = 0;
+    unsigned chunk;
+    ssize_t ret;
+
+    ret = bridge_enter(dev);
+    if (ret < 0)
+        return ret;
+    if (bridge_lock(&dev->write_excl)) {
+        bridge_exit(dev);
         return -EBUSY;
     }
 
-    if(count > (16 * 1024)) {
-        printk("data package len is over 16KB!\n");
+    /* count为0时发一个零长包 */
+    do {
+        ret = bridge_get_in(dev, &req, fp->f_flags & O_NONBLOCK);
+        if (ret < 0)
+            break;
+
+        chunk = min_t(size_t, count - done, bridge_chunk_size(dev));
+        if (copy_from_user(req->buf, buf + done, chunk)) {
+            bridge_put_in(req);
+            ret = -EFAULT;
+            break;
+        }
+
+        ret = bridge_send(dev, req, chunk, done + chunk == count);
+        if (ret < 0)
+            break;
+        done += chunk;
+    } while (done < count);
+
+    if (done)
+        ret = done;
+
+    bridge_unlock(&dev->write_excl);
+    bridge_exit(dev);
+    wake_up(&dev->write_wq);
+    return ret;
+}
+
+static int bridge_dqbuf(struct bridge_dev *dev, struct bridge_file *bf,
+        struct bridge_buffer *b, int nonblock)
+{
+    struct usb_request *req;
+    int ret;
+
+    /**
+     * 不占用read_excl/write_excl: 阻塞等待时其他线程还要能QBUF.
+     * 取请求在dev->lock下进行, 取到后就归调用者的文件所有
+     */
+    if (bf->gen != dev->gen)
+        return -ENODEV;
+
+    b->flags = 0;
+    if (b->type == BRIDGE_BUF_IN) {
+        ret = bridge_get_in(dev, &req, nonblock);
+        if (ret < 0)
+            return ret;
+        b->index = bridge_req_index(req);
+        b->length = dev->buflen;
+        b->offset = b->index * dev->stride;
+        set_bit(b->index, bf->user_in);
+    } else if (b->type == BRIDGE_BUF_OUT) {
+        ret = bridge_get_out(dev, &req, nonblock);
+        if (ret < 0)
+            return ret;
+        b->index = bridge_req_index(req);
+        b->length = req->actual;
+        b->offset = (dev->qlen + b->index) * dev->stride;
+        set_bit(b->index, bf->user_out);
+    } else {
         return -EINVAL;
     }
 
-#if 1
-    if (bridge_lock(&st_bridge_dev.write_excl)) {
-		printk("locked!\n");
-		return -EBUSY;
-	}
-#endif
+    return 0;
+}
 
-    st_bridge_dev.tx_is_idle = 0;
+static int bridge_qbuf(struct bridge_dev *dev, struct bridge_file *bf,
+        struct bridge_buffer *b)
+{
+    int more;
+    int ret = 0;
 
-    ret = copy_from_user(st_bridge_dev.req_in->buf, buf, count);
-    if(ret < 0) {
-        printk("copy from user failed!\n");
-        return -EINVAL;
+    /**
+     * 只能还回本文件DQBUF取走的缓冲区, 用test_and_clear_bit认领,
+     * 同一缓冲区并发QBUF只有一个成功, 不需要read_excl/write_excl
+     */
+    if (bf->gen != dev->gen) {
+        ret = -ENODEV;
+    } else if (b->index >= dev->qlen) {
+        ret = -EINVAL;
+    } else if (b->type == BRIDGE_BUF_IN) {
+        more = b->flags & BRIDGE_BUF_FLAG_MORE;
+        if (b->length > dev->buflen ||
+            (more && (!b->length || b->length % dev->ep_in->maxpacket)) ||
+            !test_and_clear_bit(b->index, bf->user_in))
+            ret = -EINVAL;
+        else
+            ret = bridge_send(dev, dev->reqs_in[b->index], b->length, !more);
+    } else if (b->type == BRIDGE_BUF_OUT) {
+        if (!test_and_clear_bit(b->index, bf->user_out))
+            ret = -EINVAL;
+        else
+            bridge_queue_out(dev->reqs_out[b->index]);
+    } else {
+        ret = -EINVAL;
     }
-    st_bridge_dev.req_in->length = count;
-    st_bridge_dev.req_in->actual = count;
 
-    //printk("write queue begin!\n");
-    usb_ep_queue(st_bridge_dev.ep_in, st_bridge_dev.req_in, GFP_ATOMIC);
-    //printk("write queue end!\n");
+    return ret;
+}
+
+static long bridge_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    void __user *argp = (void __user *)arg;
+    struct bridge_bufinfo info;
+    struct bridge_buffer b;
+    int ret;
+
+    switch (cmd) {
+    case BRIDGE_IOC_QUERYBUF:
+        memset(&info, 0, sizeof(info));
+        info.count = dev->qlen;
+        info.size = dev->buflen;
+        info.stride = dev->stride;
+        return copy_to_user(argp, &info, sizeof(info)) ? -EFAULT : 0;
+
+    case BRIDGE_IOC_DQBUF:
+        if (copy_from_user(&b, argp, sizeof(b)))
+            return -EFAULT;
+        ret = bridge_enter(dev);
+        if (ret < 0)
+            return ret;
+        ret = bridge_dqbuf(dev, fp->private_data, &b,
+                fp->f_flags & O_NONBLOCK);
+        bridge_exit(dev);
+        if (ret)
+            return ret;
+        return copy_to_user(argp, &b, sizeof(b)) ? -EFAULT : 0;
+
+    case BRIDGE_IOC_QBUF:
+        if (copy_from_user(&b, argp, sizeof(b)))
+            return -EFAULT;
+        ret = bridge_enter(dev);
+        if (ret < 0)
+            return ret;
+        ret = bridge_qbuf(dev, fp->private_data, &b);
+        bridge_exit(dev);
+        return ret;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* 有数据可读或有空闲IN请求时就绪, 断开或传输失败报告POLLERR */
+static unsigned int bridge_poll(struct file *fp, poll_table *wait)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    unsigned int mask = 0;
+
+    poll_wait(fp, &dev->read_wq, wait);
+    poll_wait(fp, &dev->write_wq, wait);
+
+    if (dev->rx_cur || !list_empty(&dev->rx_done))
+        mask |= POLLIN | POLLRDNORM;
+    if (!list_empty(&dev->tx_idle))
+        mask |= POLLOUT | POLLWRNORM;
+    if (dev->tx_error)
+        mask |= POLLERR;
+    if (!dev->is_online)
+        mask |= POLLERR | POLLHUP;
+
+    return mask;
+}
+
+/* 等已排队的IN请求都发完, 返回期间的传输错误 */
+static int bridge_fsync(struct file *fp, loff_t start, loff_t end, int datasync)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    unsigned long flags;
+    int error;
+    int ret;
+
+    ret = wait_event_interruptible(dev->write_wq,
+            !atomic_read(&dev->tx_inflight) || !dev->is_online);
+    if (ret < 0)
+        return ret;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    error = dev->tx_error;
+    dev->tx_error = 0;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    return (error || !dev->is_online) ? -EIO : 0;
+}
+
+/* 映射缓冲池, 前qlen个是IN缓冲区, 后qlen个是OUT缓冲区 */
+static int bridge_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+    struct bridge_dev *dev = &st_bridge_dev;
+    unsigned long npages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    unsigned long addr = vma->vm_start;
+    unsigned long i, total, per_buf;
+    struct usb_request *req;
+    int ret = 0;
+
+    /* 私有映射写时复制, 应用程序写的数据到不了请求缓冲区 */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
 
-    ret = wait_event_interruptible(st_bridge_dev.write_wq, st_bridge_dev.tx_done);
-    if(ret < 0) {
-        printk("%s[%d].wait event interruptible failed!\n", __func__, __LINE__);
+    mutex_lock(&dev->buf_lock);
+    if (!dev->qlen) {
+        ret = -ENODEV;
+        goto out;
     }
 
-	//printk("write finish!\n");
-    st_bridge_dev.tx_done = 0;
-    bridge_unlock(&st_bridge_dev.write_excl);
+    per_buf = dev->stride >> PAGE_SHIFT;
+    total = 2 * dev->qlen * per_buf;
+    if (vma->vm_pgoff > total || npages > total - vma->vm_pgoff) {
+        ret = -EINVAL;
+        goto out;
+    }
 
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    for (i = vma->vm_pgoff; addr < vma->vm_end; i++, addr += PAGE_SIZE) {
+        if (i / per_buf < dev->qlen)
+            req = dev->reqs_in[i / per_buf];
+        else
+            req = dev->reqs_out[i / per_buf - dev->qlen];
+
+        ret = vm_insert_page(vma, addr,
+                virt_to_page((char *)req->buf + (i % per_buf) * PAGE_SIZE));
+        if (ret)
+            break;
+    }
+
+out:
+    mutex_unlock(&dev->buf_lock);
     return ret;
 }
 
@@ -634,9 +1295,12 @@ static const struct file_operations bridge_fops =
 	.read = bridge_read,
 	.write = bridge_write,
 	.open = bridge_open,
-    //.unlocked_ioctl	= tmc_ioctl,
-	//.release = tmc_release,
-	//.poll    = tmc_poll,  
+	.unlocked_ioctl = bridge_ioctl,
+	.compat_ioctl = bridge_ioctl,
+	.mmap = bridge_mmap,
+	.release = bridge_release,
+	.poll = bridge_poll,
+	.fsync = bridge_fsync,
 };
 
 static struct miscdevice bridge_device = 
@@ -651,6 +1315,7 @@ static struct usb_function *loopback_alloc(struct usb_function_instance *fi)
     int ret = 0;
 	struct f_loopback	*loop;
 	struct f_lb_opts	*lb_opts;
+	struct f_bridge_opts	*opts;
 
 	printk("************************************\n");
 
@@ -659,6 +1324,7 @@ static struct usb_function *loopback_alloc(struct usb_function_instance *fi)
 		return ERR_PTR(-ENOMEM);
 
 	lb_opts = container_of(fi, struct f_lb_opts, func_inst);
+	opts = container_of(lb_opts, struct f_bridge_opts, lb);
 
 	mutex_lock(&lb_opts->lock);
 	lb_opts->refcnt++;
@@ -668,11 +1334,15 @@ static struct usb_function *loopback_alloc(struct usb_function_instance *fi)
 	loop->qlen = lb_opts->qlen;
 	if (!loop->qlen)
 		loop->qlen = 32;
+	loop->max_burst = opts->max_burst;
+	loop->bulk_streams = opts->bulk_streams;
+	loop->selftest = opts->selftest;
 
 	loop->function.name = "bridge";
 	loop->function.bind = loopback_bind;
 	loop->function.set_alt = loopback_set_alt;
 	loop->function.disable = loopback_disable;
+	loop->function.unbind = loopback_unbind;
 	loop->function.strings = loopback_strings;
 
 	loop->function.free_func = lb_free_func;
@@ -680,14 +1350,17 @@ static struct usb_function *loopback_alloc(struct usb_function_instance *fi)
     init_waitqueue_head(&st_bridge_dev.write_wq);
     init_waitqueue_head(&st_bridge_dev.read_wq);
 
-    st_bridge_dev.rx_done = 0;
-    st_bridge_dev.tx_done = 0;
-
-    st_bridge_dev.tx_is_idle = 1;
+    spin_lock_init(&st_bridge_dev.lock);
+    mutex_init(&st_bridge_dev.buf_lock);
+    INIT_LIST_HEAD(&st_bridge_dev.tx_idle);
+    INIT_LIST_HEAD(&st_bridge_dev.rx_idle);
+    INIT_LIST_HEAD(&st_bridge_dev.rx_done);
     st_bridge_dev.is_online = 0;
+    st_bridge_dev.selftest = loop->selftest;
 
     atomic_set(&st_bridge_dev.write_excl, 0);
     atomic_set(&st_bridge_dev.read_excl, 0);
+    atomic_set(&st_bridge_dev.tx_inflight, 0);
 
     ret = misc_register(&bridge_device);
 	if (ret)
@@ -789,9 +1462,102 @@ end:
 
 CONFIGFS_ATTR(f_lb_opts_, bulk_buflen);
 
+static inline struct f_bridge_opts *to_f_bridge_opts(struct config_item *item)
+{
+	return container_of(to_f_lb_opts(item), struct f_bridge_opts, lb);
+}
+
+static ssize_t bridge_opts_show(struct config_item *item, char *page,
+				unsigned *val)
+{
+	struct f_lb_opts *opts = to_f_lb_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%u\n", *val);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t bridge_opts_store(struct config_item *item, const char *page,
+				 size_t len, unsigned *val, u32 max)
+{
+	struct f_lb_opts *opts = to_f_lb_opts(item);
+	int ret;
+	u32 num;
+
+	mutex_lock(&opts->lock);
+	if (opts->refcnt) {
+		ret = -EBUSY;
+		goto end;
+	}
+
+	ret = kstrtou32(page, 0, &num);
+	if (ret)
+		goto end;
+	if (num > max) {
+		ret = -EINVAL;
+		goto end;
+	}
+
+	*val = num;
+	ret = len;
+end:
+	mutex_unlock(&opts->lock);
+	return ret;
+}
+
+static ssize_t f_lb_opts_max_burst_show(struct config_item *item, char *page)
+{
+	return bridge_opts_show(item, page, &to_f_bridge_opts(item)->max_burst);
+}
+
+static ssize_t f_lb_opts_max_burst_store(struct config_item *item,
+				    const char *page, size_t len)
+{
+	return bridge_opts_store(item, page, len,
+				 &to_f_bridge_opts(item)->max_burst, 15);
+}
+
+CONFIGFS_ATTR(f_lb_opts_, max_burst);
+
+static ssize_t f_lb_opts_bulk_streams_show(struct config_item *item,
+					   char *page)
+{
+	return bridge_opts_show(item, page,
+				&to_f_bridge_opts(item)->bulk_streams);
+}
+
+static ssize_t f_lb_opts_bulk_streams_store(struct config_item *item,
+				    const char *page, size_t len)
+{
+	return bridge_opts_store(item, page, len,
+				 &to_f_bridge_opts(item)->bulk_streams, 16);
+}
+
+CONFIGFS_ATTR(f_lb_opts_, bulk_streams);
+
+static ssize_t f_lb_opts_selftest_show(struct config_item *item, char *page)
+{
+	return bridge_opts_show(item, page, &to_f_bridge_opts(item)->selftest);
+}
+
+static ssize_t f_lb_opts_selftest_store(struct config_item *item,
+				    const char *page, size_t len)
+{
+	return bridge_opts_store(item, page, len,
+				 &to_f_bridge_opts(item)->selftest, 1);
+}
+
+CONFIGFS_ATTR(f_lb_opts_, selftest);
+
 static struct configfs_attribute *lb_attrs[] = {
 	&f_lb_opts_attr_qlen,
 	&f_lb_opts_attr_bulk_buflen,
+	&f_lb_opts_attr_max_burst,
+	&f_lb_opts_attr_bulk_streams,
+	&f_lb_opts_attr_selftest,
 	NULL,
 };
 
@@ -806,16 +1572,18 @@ static void lb_free_instance(struct usb_function_instance *fi)
 	struct f_lb_opts *lb_opts;
 
 	lb_opts = container_of(fi, struct f_lb_opts, func_inst);
-	kfree(lb_opts);
+	kfree(container_of(lb_opts, struct f_bridge_opts, lb));
 }
 
 static struct usb_function_instance *loopback_alloc_instance(void)
 {
+	struct f_bridge_opts *opts;
 	struct f_lb_opts *lb_opts;
 
-	lb_opts = kzalloc(sizeof(*lb_opts), GFP_KERNEL);
-	if (!lb_opts)
+	opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+	if (!opts)
 		return ERR_PTR(-ENOMEM);
+	lb_opts = &opts->lb;
 	mutex_init(&lb_opts->lock);
 	lb_opts->func_inst.free_func_inst = lb_free_instance;
 	lb_opts->bulk_buflen = GZERO_BULK_BUFLEN;
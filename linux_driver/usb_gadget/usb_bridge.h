@@ -0,0 +1,52 @@
+/**
+ * /dev/usb_bridge的零拷贝接口, 内核和应用程序共用.
+ *
+ * 每个方向qlen个缓冲区, 每个bulk_buflen字节, 就是排到端点上的请求缓冲区.
+ * 以MAP_SHARED mmap整个缓冲池(2 * count * stride字节)后:
+ *   发送(IN, 设备到主机): DQBUF取一个空闲缓冲区, 填好数据后QBUF排队发送,
+ *                         传输完成后缓冲区自动回到空闲队列
+ *   接收(OUT, 主机到设备): DQBUF取一个收到数据的缓冲区, 用完后QBUF还回,
+ *                         驱动重新排到端点上
+ * 缓冲区在offset处, DQBUF返回. read()/write()仍然可用, 与这里共用同一组缓冲区.
+ * DQBUF取走的缓冲区归这个打开的文件所有, 只能由它QBUF, 关闭时自动还回.
+ *
+ * 一次QBUF是一次传输, 长度是包长整数倍时自动补零长包. 大于size的帧分成
+ * 多个缓冲区, 除最后一个外都带BRIDGE_BUF_FLAG_MORE, 长度为包长的整数倍.
+ *
+ * SuperSpeed下配置了bulk_streams(流数N = 2^bulk_streams)时, 两个方向的
+ * 请求各自按排到端点上的顺序轮流使用流1, 2, ..., N, 再回到1.
+ * write切成的每一段和每次QBUF的缓冲区都是一个请求, 各占一个流.
+ * 主机必须按同样的顺序在各个流上提交传输, 否则管道会卡住.
+ * 每次连接(端点使能)从流1重新开始.
+ */
+#ifndef _USB_BRIDGE_H
+#define _USB_BRIDGE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BRIDGE_BUF_IN       0   /* 设备到主机, 应用程序写 */
+#define BRIDGE_BUF_OUT      1   /* 主机到设备, 应用程序读 */
+
+#define BRIDGE_BUF_FLAG_MORE    0x1 /* QBUF: 传输在下一个缓冲区继续, 不补零长包 */
+
+struct bridge_bufinfo {
+    __u32   count;      /* 每个方向的缓冲区数 */
+    __u32   size;       /* 每个缓冲区的最大数据长度 */
+    __u32   stride;     /* 缓冲区在映射中的间隔, 页对齐 */
+    __u32   reserved;
+};
+
+struct bridge_buffer {
+    __u32   type;       /* BRIDGE_BUF_IN/BRIDGE_BUF_OUT */
+    __u32   index;      /* 0 ~ count-1 */
+    __u32   length;     /* DQBUF: IN为size, OUT为收到的长度; QBUF: IN为要发送的长度 */
+    __u32   offset;     /* 缓冲区在映射中的偏移, DQBUF返回 */
+    __u32   flags;      /* BRIDGE_BUF_FLAG_* */
+};
+
+#define BRIDGE_IOC_QUERYBUF _IOR('b', 0, struct bridge_bufinfo)
+#define BRIDGE_IOC_DQBUF    _IOWR('b', 1, struct bridge_buffer)
+#define BRIDGE_IOC_QBUF     _IOW('b', 2, struct bridge_buffer)
+
+#endif